@@ -0,0 +1,15 @@
+# Build the native extension next to sl500.py:
+#
+#     python3 setup.py build_ext --inplace
+
+from setuptools import setup, Extension
+
+setup(
+    name="sl500",
+    version="1.0",
+    ext_modules=[
+        Extension("_sl500",
+                  sources=["sl500module.c", "../src/sl500.c"],
+                  include_dirs=["../src"]),
+    ],
+)
@@ -0,0 +1,628 @@
+// vim: ts=4 expandtab ai
+
+/*
+ * Copyright (c) 2008, Henrik Torstensson <laban@kryo.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Python extension on top of the C reader library.
+ *
+ * All reader I/O runs with the GIL released. Block data is read straight
+ * into the bytes object that is returned, or into a caller supplied
+ * buffer with the *_into() methods.
+ *
+ *     import _sl500
+ *     r = _sl500.Reader("/dev/ttyUSB0", _sl500.BAUD_115200)
+ *     uid = r.wait_for_card(5.0)
+ *     data = r.read_block(4, _sl500.KEY_A, b"\xff" * 6)
+ */
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <pythread.h>
+
+#include "sl500.h"
+
+#include <setjmp.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#define READ_TIMEOUT 5                  // Answer timeout in 100 ms units
+
+static PyObject *ReaderError;
+static PyObject *CommError;
+
+/*
+ * The C library reports communication errors through a global handler.
+ * Jump back to whichever Reader method was running on this thread.
+ */
+static __thread jmp_buf *comm_jmp;
+
+static void comm_handler(void)
+{
+    if (comm_jmp != NULL)
+        longjmp(*comm_jmp, 1);
+}
+
+typedef struct {
+    PyObject_HEAD
+    int fd;
+    PyThread_type_lock lock;
+    struct rf_session session;
+} Reader;
+
+/* Arguments for the functions run by reader_io() */
+struct io_args {
+    int a, b;
+    uint8_t *key;
+    uint8_t *data;
+    Py_ssize_t len;
+};
+
+typedef uint8_t (*io_fn)(Reader *self, struct io_args *args);
+
+/*
+ * Run 'fn' without the GIL, serialized with other threads using the same
+ * reader. Returns the reader status, or -1 with an exception set.
+ */
+static int reader_io(Reader *self, io_fn fn, struct io_args *args)
+{
+    jmp_buf env;
+    jmp_buf *prev;
+    volatile int failed = 0;
+    int closed = 0;
+    uint8_t status = 0;
+
+    if (self->fd == -1) {
+        PyErr_SetString(PyExc_ValueError, "reader is closed");
+        return -1;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    PyThread_acquire_lock(self->lock, WAIT_LOCK);
+    prev = comm_jmp;
+    comm_jmp = &env;
+    if (self->fd == -1) {
+        /* Closed while waiting for the lock */
+        closed = 1;
+    } else if (setjmp(env) == 0) {
+        status = fn(self, args);
+    } else {
+        /* Drop whatever is left of the broken frame */
+        failed = 1;
+        tcflush(self->fd, TCIOFLUSH);
+        rf_session_reset(&self->session);
+    }
+    comm_jmp = prev;
+    PyThread_release_lock(self->lock);
+    Py_END_ALLOW_THREADS
+
+    if (closed) {
+        PyErr_SetString(PyExc_ValueError, "reader is closed");
+        return -1;
+    }
+    if (failed) {
+        PyErr_SetString(CommError, "communication error");
+        return -1;
+    }
+    return status;
+}
+
+/*
+ * Turn a reader status into None or an exception.
+ */
+static PyObject *status_result(int status)
+{
+    if (status == -1)
+        return NULL;
+    if (status != 0) {
+        PyErr_Format(ReaderError, "reader status %d", status);
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+/*
+ * Block and sector numbers are checked against the selected card, or
+ * against the largest card when none is selected, before they are
+ * narrowed to the uint8_t the reader takes. Returns -1 with ValueError
+ * set if the key type, block or sector is out of range.
+ */
+static int check_key_type(int key_type)
+{
+    if (key_type != KEY_A && key_type != KEY_B) {
+        PyErr_SetString(PyExc_ValueError, "key type must be KEY_A or KEY_B");
+        return -1;
+    }
+    return 0;
+}
+
+static int card_sectors(Reader *self)
+{
+    return self->session.selected ? rf_M1_sectors(self->session.capacity) : 40;
+}
+
+static int check_block(Reader *self, int block, int key_type)
+{
+    if (check_key_type(key_type) == -1)
+        return -1;
+    if (block < 0 || block > 0xff || rf_M1_block_sector(block) >= card_sectors(self)) {
+        PyErr_SetString(PyExc_ValueError, "no such block");
+        return -1;
+    }
+    return 0;
+}
+
+static int check_sector(Reader *self, int sector, int key_type)
+{
+    if (check_key_type(key_type) == -1)
+        return -1;
+    if (sector < 0 || sector >= card_sectors(self)) {
+        PyErr_SetString(PyExc_ValueError, "no such sector");
+        return -1;
+    }
+    return 0;
+}
+
+static int get_key(PyObject *obj, Py_buffer *view)
+{
+    if (PyObject_GetBuffer(obj, view, PyBUF_SIMPLE) == -1)
+        return -1;
+    if (view->len != 6) {
+        PyBuffer_Release(view);
+        PyErr_SetString(PyExc_ValueError, "key must be 6 bytes");
+        return -1;
+    }
+    return 0;
+}
+
+static uint8_t do_init_com(Reader *self, struct io_args *args)
+{
+    return rf_init_com(self->fd, args->a);
+}
+
+static uint8_t do_get_model(Reader *self, struct io_args *args)
+{
+    return rf_get_model(self->fd, args->len, args->data);
+}
+
+static uint8_t do_beep(Reader *self, struct io_args *args)
+{
+    return rf_beep(self->fd, args->a);
+}
+
+static uint8_t do_light(Reader *self, struct io_args *args)
+{
+    return rf_light(self->fd, args->a);
+}
+
+static uint8_t do_find_card(Reader *self, struct io_args *args)
+{
+    rf_session_reset(&self->session);
+    return rf_session_select(&self->session);
+}
+
+static uint8_t do_halt(Reader *self, struct io_args *args)
+{
+    return rf_session_halt(&self->session);
+}
+
+static uint8_t do_read_block(Reader *self, struct io_args *args)
+{
+    uint8_t status;
+
+    status = rf_session_auth(&self->session, args->b, args->a, args->key);
+    if (status == 0)
+        status = rf_session_read(&self->session, args->a, args->data);
+    return status;
+}
+
+static uint8_t do_write_block(Reader *self, struct io_args *args)
+{
+    uint8_t status;
+
+    status = rf_session_auth(&self->session, args->b, args->a, args->key);
+    if (status == 0)
+        status = rf_session_write(&self->session, args->a, args->data);
+    return status;
+}
+
+static uint8_t do_read_sector(Reader *self, struct io_args *args)
+{
+    uint8_t first = rf_M1_sector_block(args->a);
+    uint8_t status;
+    int i;
+
+    status = rf_session_auth(&self->session, args->b, first, args->key);
+    for (i=0; status == 0 && i<rf_M1_sector_blocks(args->a); i++)
+        status = rf_session_read(&self->session, first + i, &args->data[i * 16]);
+    return status;
+}
+
+/*
+ * Close the port once no other thread is using it.
+ */
+static void close_port(Reader *self)
+{
+    /* Another thread may hold the lock for a whole command */
+    Py_BEGIN_ALLOW_THREADS
+    PyThread_acquire_lock(self->lock, WAIT_LOCK);
+    if (self->fd != -1) {
+        close(self->fd);
+        self->fd = -1;
+    }
+    PyThread_release_lock(self->lock);
+    Py_END_ALLOW_THREADS
+}
+
+static int Reader_init(Reader *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"path", "baud", NULL};
+    const char *path = "/dev/ttyUSB0";
+    int baud = BAUD_19200;
+    struct io_args io;
+    int status;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|si", kwlist, &path, &baud))
+        return -1;
+
+    if (self->lock == NULL) {
+        self->lock = PyThread_allocate_lock();
+        if (self->lock == NULL) {
+            PyErr_NoMemory();
+            return -1;
+        }
+    }
+
+    /* __init__ called again, let go of the old port first */
+    close_port(self);
+
+    Py_BEGIN_ALLOW_THREADS
+    self->fd = open_port_path(path);
+    Py_END_ALLOW_THREADS
+    if (self->fd == -1) {
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+        return -1;
+    }
+    rf_session_init(&self->session, self->fd);
+
+    /* A reader that stays silent raises CommError instead of hanging */
+    if (rf_set_timeout(self->fd, READ_TIMEOUT) == -1) {
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+        close(self->fd);
+        self->fd = -1;
+        return -1;
+    }
+
+    if (baud != BAUD_19200) {
+        io.a = baud;
+        status = reader_io(self, do_init_com, &io);
+        if (status != 0) {
+            if (status > 0)
+                PyErr_Format(ReaderError, "could not set baud rate, status %d", status);
+            close(self->fd);
+            self->fd = -1;
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static void Reader_dealloc(Reader *self)
+{
+    if (self->fd != -1)
+        close(self->fd);
+    if (self->lock != NULL)
+        PyThread_free_lock(self->lock);
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static PyObject *Reader_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    Reader *self = (Reader *)type->tp_alloc(type, 0);
+
+    if (self != NULL) {
+        self->fd = -1;
+        self->lock = NULL;
+    }
+    return (PyObject *)self;
+}
+
+static PyObject *Reader_close(Reader *self, PyObject *unused)
+{
+    if (self->lock != NULL)
+        close_port(self);
+    Py_RETURN_NONE;
+}
+
+static PyObject *Reader_model(Reader *self, PyObject *unused)
+{
+    uint8_t buf[64] = {0};
+    struct io_args io;
+    int status;
+
+    io.data = buf;
+    io.len = sizeof(buf) - 1;
+    status = reader_io(self, do_get_model, &io);
+    if (status != 0)
+        return status_result(status);
+    return PyBytes_FromString((char *)buf);
+}
+
+static PyObject *Reader_beep(Reader *self, PyObject *args)
+{
+    struct io_args io;
+
+    if (!PyArg_ParseTuple(args, "i", &io.a))
+        return NULL;
+    return status_result(reader_io(self, do_beep, &io));
+}
+
+static PyObject *Reader_light(Reader *self, PyObject *args)
+{
+    struct io_args io;
+
+    if (!PyArg_ParseTuple(args, "i", &io.a))
+        return NULL;
+    return status_result(reader_io(self, do_light, &io));
+}
+
+static PyObject *Reader_wait_for_card(Reader *self, PyObject *args)
+{
+    double timeout = -1.0, interval = 0.1;
+    struct timespec start, now, pause;
+    struct io_args io;
+    int status;
+
+    if (!PyArg_ParseTuple(args, "|dd", &timeout, &interval))
+        return NULL;
+
+    pause.tv_sec = (time_t)interval;
+    pause.tv_nsec = (long)((interval - pause.tv_sec) * 1e9);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (;;) {
+        status = reader_io(self, do_find_card, &io);
+        if (status == -1)
+            return NULL;
+        if (status == 0)
+            return PyBytes_FromStringAndSize((char *)self->session.uid,
+                                             sizeof(self->session.uid));
+
+        if (PyErr_CheckSignals() == -1)
+            return NULL;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (timeout >= 0 && (now.tv_sec - start.tv_sec) +
+                (now.tv_nsec - start.tv_nsec) / 1e9 >= timeout)
+            Py_RETURN_NONE;
+
+        Py_BEGIN_ALLOW_THREADS
+        nanosleep(&pause, NULL);
+        Py_END_ALLOW_THREADS
+    }
+}
+
+static PyObject *Reader_halt(Reader *self, PyObject *unused)
+{
+    struct io_args io;
+
+    return status_result(reader_io(self, do_halt, &io));
+}
+
+static PyObject *Reader_read_block(Reader *self, PyObject *args)
+{
+    PyObject *key_obj, *result;
+    Py_buffer key;
+    struct io_args io;
+    int status;
+
+    if (!PyArg_ParseTuple(args, "iiO", &io.a, &io.b, &key_obj))
+        return NULL;
+    if (check_block(self, io.a, io.b) == -1)
+        return NULL;
+    if (get_key(key_obj, &key) == -1)
+        return NULL;
+
+    /* Read straight into the new bytes object, nobody else sees it yet */
+    result = PyBytes_FromStringAndSize(NULL, 16);
+    if (result == NULL) {
+        PyBuffer_Release(&key);
+        return NULL;
+    }
+    io.key = key.buf;
+    io.data = (uint8_t *)PyBytes_AS_STRING(result);
+    status = reader_io(self, do_read_block, &io);
+    PyBuffer_Release(&key);
+
+    if (status != 0) {
+        Py_DECREF(result);
+        return status_result(status);
+    }
+    return result;
+}
+
+static PyObject *Reader_read_block_into(Reader *self, PyObject *args)
+{
+    PyObject *key_obj, *buf_obj;
+    Py_buffer key, buf;
+    struct io_args io;
+    int status;
+
+    if (!PyArg_ParseTuple(args, "iiOO", &io.a, &io.b, &key_obj, &buf_obj))
+        return NULL;
+    if (check_block(self, io.a, io.b) == -1)
+        return NULL;
+    if (get_key(key_obj, &key) == -1)
+        return NULL;
+    if (PyObject_GetBuffer(buf_obj, &buf, PyBUF_WRITABLE) == -1) {
+        PyBuffer_Release(&key);
+        return NULL;
+    }
+    if (buf.len < 16) {
+        PyErr_SetString(PyExc_ValueError, "buffer must hold 16 bytes");
+        status = -1;
+    } else {
+        io.key = key.buf;
+        io.data = buf.buf;
+        status = reader_io(self, do_read_block, &io);
+    }
+    PyBuffer_Release(&buf);
+    PyBuffer_Release(&key);
+
+    return status_result(status);
+}
+
+static PyObject *Reader_read_sector(Reader *self, PyObject *args)
+{
+    PyObject *key_obj, *result;
+    Py_buffer key;
+    struct io_args io;
+    int status;
+
+    if (!PyArg_ParseTuple(args, "iiO", &io.a, &io.b, &key_obj))
+        return NULL;
+    if (check_sector(self, io.a, io.b) == -1)
+        return NULL;
+    if (get_key(key_obj, &key) == -1)
+        return NULL;
+
+    result = PyBytes_FromStringAndSize(NULL, rf_M1_sector_blocks(io.a) * 16);
+    if (result == NULL) {
+        PyBuffer_Release(&key);
+        return NULL;
+    }
+    io.key = key.buf;
+    io.data = (uint8_t *)PyBytes_AS_STRING(result);
+    status = reader_io(self, do_read_sector, &io);
+    PyBuffer_Release(&key);
+
+    if (status != 0) {
+        Py_DECREF(result);
+        return status_result(status);
+    }
+    return result;
+}
+
+static PyObject *Reader_write_block(Reader *self, PyObject *args)
+{
+    PyObject *key_obj, *data_obj;
+    Py_buffer key, data;
+    struct io_args io;
+    int status;
+
+    if (!PyArg_ParseTuple(args, "iiOO", &io.a, &io.b, &key_obj, &data_obj))
+        return NULL;
+    if (check_block(self, io.a, io.b) == -1)
+        return NULL;
+    if (get_key(key_obj, &key) == -1)
+        return NULL;
+    if (PyObject_GetBuffer(data_obj, &data, PyBUF_SIMPLE) == -1) {
+        PyBuffer_Release(&key);
+        return NULL;
+    }
+    if (data.len != 16) {
+        PyErr_SetString(PyExc_ValueError, "data must be 16 bytes");
+        status = -1;
+    } else {
+        io.key = key.buf;
+        io.data = data.buf;
+        status = reader_io(self, do_write_block, &io);
+    }
+    PyBuffer_Release(&data);
+    PyBuffer_Release(&key);
+
+    return status_result(status);
+}
+
+static PyMethodDef Reader_methods[] = {
+    {"close", (PyCFunction)Reader_close, METH_NOARGS,
+     "Close the serial port."},
+    {"model", (PyCFunction)Reader_model, METH_NOARGS,
+     "Return the reader model string."},
+    {"beep", (PyCFunction)Reader_beep, METH_VARARGS,
+     "beep(time): beep for time * 10 ms."},
+    {"light", (PyCFunction)Reader_light, METH_VARARGS,
+     "light(color): set the LED to LED_OFF, LED_RED or LED_GREEN."},
+    {"wait_for_card", (PyCFunction)Reader_wait_for_card, METH_VARARGS,
+     "wait_for_card([timeout[, interval]]): poll until a card is selected.\n"
+     "Returns its UID, or None on timeout."},
+    {"halt", (PyCFunction)Reader_halt, METH_NOARGS,
+     "Halt the selected card."},
+    {"read_block", (PyCFunction)Reader_read_block, METH_VARARGS,
+     "read_block(block, key_type, key) -> bytes"},
+    {"read_block_into", (PyCFunction)Reader_read_block_into, METH_VARARGS,
+     "read_block_into(block, key_type, key, buffer): read into a writable buffer."},
+    {"read_sector", (PyCFunction)Reader_read_sector, METH_VARARGS,
+     "read_sector(sector, key_type, key) -> bytes"},
+    {"write_block", (PyCFunction)Reader_write_block, METH_VARARGS,
+     "write_block(block, key_type, key, data)"},
+    {NULL}
+};
+
+static PyTypeObject ReaderType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "_sl500.Reader",
+    .tp_doc = "Reader(path='/dev/ttyUSB0', baud=BAUD_19200)",
+    .tp_basicsize = sizeof(Reader),
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_new = Reader_new,
+    .tp_init = (initproc)Reader_init,
+    .tp_dealloc = (destructor)Reader_dealloc,
+    .tp_methods = Reader_methods,
+};
+
+static struct PyModuleDef sl500module = {
+    PyModuleDef_HEAD_INIT,
+    .m_name = "_sl500",
+    .m_doc = "SL500 RFID reader, backed by the C library.",
+    .m_size = -1,
+};
+
+PyMODINIT_FUNC PyInit__sl500(void)
+{
+    PyObject *m;
+
+    if (PyType_Ready(&ReaderType) < 0)
+        return NULL;
+
+    m = PyModule_Create(&sl500module);
+    if (m == NULL)
+        return NULL;
+
+    ReaderError = PyErr_NewException("_sl500.ReaderError", NULL, NULL);
+    CommError = PyErr_NewException("_sl500.CommError", PyExc_OSError, NULL);
+    Py_INCREF(&ReaderType);
+    PyModule_AddObject(m, "Reader", (PyObject *)&ReaderType);
+    PyModule_AddObject(m, "ReaderError", ReaderError);
+    PyModule_AddObject(m, "CommError", CommError);
+
+    PyModule_AddIntMacro(m, KEY_A);
+    PyModule_AddIntMacro(m, KEY_B);
+    PyModule_AddIntMacro(m, LED_OFF);
+    PyModule_AddIntMacro(m, LED_RED);
+    PyModule_AddIntMacro(m, LED_GREEN);
+    PyModule_AddIntMacro(m, BAUD_9600);
+    PyModule_AddIntMacro(m, BAUD_19200);
+    PyModule_AddIntMacro(m, BAUD_38400);
+    PyModule_AddIntMacro(m, BAUD_57600);
+    PyModule_AddIntMacro(m, BAUD_115200);
+
+    rf_set_error_handler(comm_handler);
+
+    return m;
+}
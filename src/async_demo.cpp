@@ -0,0 +1,83 @@
+// vim: ts=4 expandtab ai
+
+/*
+ * Copyright (c) 2008, Henrik Torstensson <laban@kryo.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Watches any number of readers from one thread. For every card it
+ * reads block 8 with the default key and beeps.
+ *
+ *     async_demo /dev/ttyUSB0 /dev/ttyUSB1 ...
+ */
+
+#include "sl500_async.hpp"
+
+#include <cstdio>
+#include <memory>
+
+static sl500::task<void> watch(sl500::reader &r, const char *name)
+{
+    const std::array<uint8_t, 6> key = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
+
+    printf("%s: %s\n", name, (co_await r.model()).c_str());
+    for (;;) {
+        uint32_t card_no = co_await r.wait_for_card();
+        printf("%s: card %08x\n", name, card_no);
+
+        if (co_await r.authenticate(KEY_A, 8, key) == 0x00) {
+            sl500::block b = co_await r.read_block(8);
+            if (b.status == 0x00) {
+                printf("%s: block 8:", name);
+                for (uint8_t ch : b.data)
+                    printf(" %02x", ch);
+                printf("\n");
+            }
+        }
+        co_await r.beep(10);
+
+        /* Wait for the card to leave before looking for the next one */
+        do {
+            co_await r.halt();
+            co_await r.loop().sleep(std::chrono::milliseconds(200));
+        } while (co_await r.request() == 0x00);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    sl500::event_loop loop;
+    std::vector<std::unique_ptr<sl500::reader>> readers;
+    int i;
+
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <port>...\n", argv[0]);
+        return 1;
+    }
+
+    try {
+        for (i=1; i<argc; i++)
+            readers.push_back(std::make_unique<sl500::reader>(loop, argv[i]));
+    } catch (const std::exception &e) {
+        fprintf(stderr, "%s\n", e.what());
+        return 1;
+    }
+
+    for (i=1; i<argc; i++)
+        loop.spawn(watch(*readers[i - 1], argv[i]));
+    loop.run();
+
+    return 0;
+}
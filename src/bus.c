@@ -0,0 +1,130 @@
+// vim: ts=4 expandtab ai
+
+/*
+ * Copyright (c) 2008, Henrik Torstensson <laban@kryo.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "bus.h"
+#include "sl500.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+#define BUS_TIMEOUT 2                   // Answer timeout in 100 ms units
+
+struct bus *bus_open(const char *path)
+{
+    struct bus *b;
+
+    b = calloc(1, sizeof(*b));
+    if (b == NULL)
+        return NULL;
+
+    b->fd = open_port_path(path);
+    if (b->fd == -1) {
+        free(b);
+        return NULL;
+    }
+    snprintf(b->path, sizeof(b->path), "%s", path);
+
+    /* A missing device must not hold up the line for the others */
+    rf_set_timeout(b->fd, BUS_TIMEOUT);
+    tcflush(b->fd, TCIOFLUSH);
+
+    return b;
+}
+
+int bus_add(struct bus *b, const uint8_t dev_id[2])
+{
+    struct bus_node *n;
+
+    if (b->count == BUS_MAX_NODES)
+        return -1;
+
+    n = &b->nodes[b->count];
+    memset(n, 0, sizeof(*n));
+    n->dev_id[0] = dev_id[0];
+    n->dev_id[1] = dev_id[1];
+    return b->count++;
+}
+
+void bus_address(struct bus *b, int node)
+{
+    rf_set_device(b->fd, b->nodes[node].dev_id);
+}
+
+int bus_next(struct bus *b, long long now, uint32_t skip)
+{
+    struct bus_node *n;
+    int i, best = -1, total = 0;
+
+    /* Offline readers due for a retry go first, they are rare */
+    for (i=0; i<b->count; i++) {
+        n = &b->nodes[i];
+        if (!n->online && !(skip & (1u << i)) && now >= n->retry_at) {
+            n->retry_at = now + BUS_RETRY_MS;
+            return i;
+        }
+    }
+
+    /* Then any reader that has waited longer than the latency target */
+    for (i=0; i<b->count; i++) {
+        n = &b->nodes[i];
+        if (!n->online || (skip & (1u << i)) || now - n->last_poll < BUS_MAX_GAP_MS)
+            continue;
+        if (best == -1 || n->last_poll < b->nodes[best].last_poll)
+            best = i;
+    }
+
+    if (best == -1) {
+        /* Smooth weighted round-robin */
+        for (i=0; i<b->count; i++) {
+            n = &b->nodes[i];
+            if (!n->online || (skip & (1u << i)))
+                continue;
+            n->current += (now < n->busy_until) ? BUS_BUSY_WEIGHT : 1;
+            total += (now < n->busy_until) ? BUS_BUSY_WEIGHT : 1;
+            if (best == -1 || n->current > b->nodes[best].current)
+                best = i;
+        }
+        if (best == -1)
+            return -1;
+        b->nodes[best].current -= total;
+    }
+
+    b->nodes[best].last_poll = now;
+    b->nodes[best].polls++;
+    return best;
+}
+
+void bus_report(struct bus *b, int node, long long now, int active)
+{
+    if (active)
+        b->nodes[node].busy_until = now + BUS_BOOST_MS;
+}
+
+void bus_set_online(struct bus *b, int node, int online, long long now)
+{
+    struct bus_node *n = &b->nodes[node];
+
+    n->online = online;
+    n->current = 0;
+    n->last_poll = now;
+    if (!online)
+        n->retry_at = now + BUS_RETRY_MS;
+}
@@ -0,0 +1,101 @@
+// vim: ts=4 expandtab ai
+
+#ifndef BUS_H
+#define BUS_H
+
+/*
+ * Copyright (c) 2008, Henrik Torstensson <laban@kryo.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Poll scheduling for several readers sharing one RS-485 line.
+ *
+ * Only one device can talk at a time, so the line is handed out in poll
+ * slots. Readers are picked by smooth weighted round-robin, where a
+ * reader that has seen a card recently weighs BUS_BUSY_WEIGHT times
+ * more than an idle one. A reader that has not been polled for
+ * BUS_MAX_GAP_MS goes first regardless, which bounds the time any gate
+ * waits. Readers that stopped answering are retried every BUS_RETRY_MS.
+ */
+
+#include <stdint.h>
+
+#define BUS_MAX_NODES 16
+#define BUS_BUSY_WEIGHT 4
+#define BUS_BOOST_MS 3000
+#define BUS_MAX_GAP_MS 500
+#define BUS_RETRY_MS 5000
+
+struct bus_node {
+    uint8_t dev_id[2];
+    int online;
+    int current;                        // Round-robin credit
+    long long busy_until;
+    long long last_poll;
+    long long retry_at;
+    unsigned long polls;
+};
+
+struct bus {
+    int fd;
+    char path[64];
+    int count;
+    struct bus_node nodes[BUS_MAX_NODES];
+};
+
+/*
+ * 'bus_open()' - Open the line on 'path'.
+ *
+ * Returns NULL on error.
+ */
+
+struct bus *bus_open(const char *path);
+
+/*
+ * 'bus_add()' - Add the reader with device ID 'dev_id'. It starts out
+ * offline and is probed on its first slot.
+ *
+ * Returns the node index, or -1 if the bus is full.
+ */
+
+int bus_add(struct bus *b, const uint8_t dev_id[2]);
+
+/*
+ * 'bus_address()' - Address the following commands on the line to
+ * 'node'.
+ */
+
+void bus_address(struct bus *b, int node);
+
+/*
+ * 'bus_next()' - Pick the node for the next poll slot, leaving out the
+ * nodes set in 'skip'. An offline node is returned when it is due for a
+ * retry; check its 'online' flag.
+ *
+ * Returns the node index, or -1 if no node wants the slot.
+ */
+
+int bus_next(struct bus *b, long long now, uint32_t skip);
+
+/*
+ * 'bus_report()' - Tell the scheduler whether the last poll of 'node'
+ * found a card, to give busy readers more slots.
+ */
+
+void bus_report(struct bus *b, int node, long long now, int active);
+
+void bus_set_online(struct bus *b, int node, int online, long long now);
+
+#endif
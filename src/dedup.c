@@ -0,0 +1,208 @@
+// vim: ts=4 expandtab ai
+
+/*
+ * Copyright (c) 2008, Henrik Torstensson <laban@kryo.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "dedup.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define WHEEL_SLOTS 256                 // Power of two
+#define WHEEL_TICK_MS 16
+
+struct dedup_entry {
+    uint8_t uid[DEDUP_UID_MAX];
+    uint8_t uid_len;
+    uint32_t scope;
+    long long expires;
+    int32_t hash_next;                  // Bucket chain, or the free list
+    int32_t wheel_next;
+};
+
+struct dedup {
+    int window_ms;
+    int entries;
+    uint32_t mask;                      // Buckets - 1
+    int32_t free;
+    long long tick;                     // Next wheel tick to run
+    int32_t *buckets;
+    int32_t wheel[WHEEL_SLOTS];
+    struct dedup_stats stats;
+    struct dedup_entry entry[];
+};
+
+struct dedup *dedup_create(int window_ms, int entries)
+{
+    struct dedup *d;
+    uint32_t buckets = 1;
+    int i;
+
+    if (entries < 1)
+        return NULL;
+    while (buckets < entries)
+        buckets <<= 1;
+
+    d = calloc(1, sizeof(*d) + entries * sizeof(struct dedup_entry));
+    if (d == NULL)
+        return NULL;
+    d->buckets = malloc(buckets * sizeof(*d->buckets));
+    if (d->buckets == NULL) {
+        free(d);
+        return NULL;
+    }
+
+    d->window_ms = window_ms;
+    d->entries = entries;
+    d->mask = buckets - 1;
+    d->tick = -1;
+    for (i=0; i<buckets; i++)
+        d->buckets[i] = -1;
+    for (i=0; i<WHEEL_SLOTS; i++)
+        d->wheel[i] = -1;
+    for (i=0; i<entries; i++)
+        d->entry[i].hash_next = (i + 1 < entries) ? i + 1 : -1;
+    d->free = 0;
+
+    return d;
+}
+
+void dedup_free(struct dedup *d)
+{
+    if (d == NULL)
+        return;
+    free(d->buckets);
+    free(d);
+}
+
+static uint32_t hash(const uint8_t *uid, int uid_len, uint32_t scope)
+{
+    uint32_t h = 2166136261u ^ scope;
+    int i;
+
+    for (i=0; i<uid_len; i++) {
+        h ^= uid[i];
+        h *= 16777619u;
+    }
+    h ^= h >> 15;
+    return h;
+}
+
+static void wheel_add(struct dedup *d, int32_t i)
+{
+    int slot = (d->entry[i].expires / WHEEL_TICK_MS) & (WHEEL_SLOTS - 1);
+
+    d->entry[i].wheel_next = d->wheel[slot];
+    d->wheel[slot] = i;
+}
+
+static void unlink_entry(struct dedup *d, int32_t i)
+{
+    struct dedup_entry *e = &d->entry[i];
+    int32_t *p = &d->buckets[hash(e->uid, e->uid_len, e->scope) & d->mask];
+
+    while (*p != i)
+        p = &d->entry[*p].hash_next;
+    *p = e->hash_next;
+
+    e->hash_next = d->free;
+    d->free = i;
+    d->stats.live--;
+}
+
+/*
+ * Run the wheel up to 'now', dropping what expired and moving entries
+ * whose window was extended to the slot they expire in now. After a
+ * long pause one turn is enough, lookups ignore stale entries anyway.
+ */
+static void expire(struct dedup *d, long long now)
+{
+    long long end = now / WHEEL_TICK_MS;
+    int32_t i, next;
+    int slot;
+
+    /* Only ticks that are over, their entries have all expired */
+    if (d->tick == -1 || end - d->tick > WHEEL_SLOTS)
+        d->tick = end - WHEEL_SLOTS;
+
+    for (; d->tick < end; d->tick++) {
+        slot = d->tick & (WHEEL_SLOTS - 1);
+        i = d->wheel[slot];
+        d->wheel[slot] = -1;
+        for (; i != -1; i = next) {
+            next = d->entry[i].wheel_next;
+            if (d->entry[i].expires <= now)
+                unlink_entry(d, i);
+            else
+                wheel_add(d, i);
+        }
+    }
+}
+
+int dedup_check(struct dedup *d, const uint8_t *uid, int uid_len, uint32_t scope, long long now)
+{
+    struct dedup_entry *e;
+    int32_t i, *bucket;
+
+    if (d == NULL || d->window_ms <= 0) {
+        return 1;
+    }
+    if (uid_len > DEDUP_UID_MAX)
+        uid_len = DEDUP_UID_MAX;
+
+    expire(d, now);
+
+    bucket = &d->buckets[hash(uid, uid_len, scope) & d->mask];
+    for (i = *bucket; i != -1; i = e->hash_next) {
+        e = &d->entry[i];
+        if (e->scope == scope && e->uid_len == uid_len && memcmp(e->uid, uid, uid_len) == 0) {
+            /* The wheel catches up with the new expiry when it gets there */
+            if (e->expires > now) {
+                e->expires = now + d->window_ms;
+                d->stats.suppressed++;
+                return 0;
+            }
+            e->expires = now + d->window_ms;
+            d->stats.passed++;
+            return 1;
+        }
+    }
+
+    d->stats.passed++;
+    if (d->free == -1) {
+        d->stats.overflow++;
+        return 1;
+    }
+
+    i = d->free;
+    e = &d->entry[i];
+    d->free = e->hash_next;
+    memcpy(e->uid, uid, uid_len);
+    e->uid_len = uid_len;
+    e->scope = scope;
+    e->expires = now + d->window_ms;
+    e->hash_next = *bucket;
+    *bucket = i;
+    wheel_add(d, i);
+    d->stats.live++;
+
+    return 1;
+}
+
+void dedup_get_stats(struct dedup *d, struct dedup_stats *stats)
+{
+    *stats = d->stats;
+}
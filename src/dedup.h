@@ -0,0 +1,74 @@
+// vim: ts=4 expandtab ai
+
+#ifndef DEDUP_H
+#define DEDUP_H
+
+/*
+ * Copyright (c) 2008, Henrik Torstensson <laban@kryo.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Suppression of repeated taps.
+ *
+ * A card is remembered per scope (a reader, or a group of readers) for
+ * a window after it was last seen. Seeing it again within the window is
+ * the same tap and extends the window, so a card resting on a reader or
+ * moved between readers of one group counts once.
+ *
+ * All entries are allocated up front. Expiry runs on a timing wheel
+ * that is advanced by the checks themselves; an entry whose window was
+ * extended is moved on lazily when its old slot comes up.
+ */
+
+#include <stdint.h>
+
+#define DEDUP_WINDOW_MS 2000
+#define DEDUP_ENTRIES 4096
+#define DEDUP_UID_MAX 10
+
+struct dedup;
+
+struct dedup_stats {
+    uint64_t passed;                    // New taps
+    uint64_t suppressed;                // Repeats within the window
+    uint64_t overflow;                  // Passed because the table was full
+    int live;
+};
+
+/*
+ * 'dedup_create()' - Set up a table for 'entries' cards at a time,
+ * suppressing repeats for 'window_ms' milliseconds. A window of 0
+ * passes every sighting.
+ *
+ * Returns NULL on error.
+ */
+
+struct dedup *dedup_create(int window_ms, int entries);
+
+void dedup_free(struct dedup *d);
+
+/*
+ * 'dedup_check()' - Record a sighting of 'uid' in 'scope' at 'now'
+ * (milliseconds, monotonic).
+ *
+ * Returns 1 for a new tap and 0 for a repeat. When the table is full
+ * the sighting is passed rather than lost.
+ */
+
+int dedup_check(struct dedup *d, const uint8_t *uid, int uid_len, uint32_t scope, long long now);
+
+void dedup_get_stats(struct dedup *d, struct dedup_stats *stats);
+
+#endif
@@ -0,0 +1,360 @@
+// vim: ts=4 expandtab ai
+
+/*
+ * Copyright (c) 2008, Henrik Torstensson <laban@kryo.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+
+#include "discovery.h"
+#include "sl500.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <termios.h>
+#include <unistd.h>
+
+#define DISCOVERY_NODES 32
+#define DISCOVERY_TIMEOUT 5             // Answer timeout in 100 ms units
+
+enum node_states {
+    NODE_FREE = 0,
+    NODE_ATTACHED,
+    NODE_REJECTED                       // Not a reader, until the node changes
+};
+
+struct node {
+    int state;
+    char name[NAME_MAX + 1];
+};
+
+struct discovery {
+    char dir[DISCOVERY_PATH_MAX];
+    char pattern[64];
+    int inotify_fd;
+    int pipe[2];
+    pthread_t thread;
+    pthread_mutex_t lock;
+    struct node nodes[DISCOVERY_NODES];
+    int hint_count;
+    struct discovery_hint hints[DISCOVERY_HINTS_MAX];
+};
+
+/* Rates to probe at, the reader's default first */
+static const uint8_t probe_rates[] = {
+    BAUD_19200, BAUD_115200, BAUD_57600, BAUD_38400, BAUD_9600
+};
+
+/* Call with the lock held */
+static struct node *node_find(struct discovery *d, const char *name)
+{
+    int i;
+
+    for (i=0; i<DISCOVERY_NODES; i++) {
+        if (d->nodes[i].state != NODE_FREE && strcmp(d->nodes[i].name, name) == 0)
+            return &d->nodes[i];
+    }
+    return NULL;
+}
+
+static void node_set(struct discovery *d, const char *name, int state)
+{
+    struct node *n;
+    int i;
+
+    pthread_mutex_lock(&d->lock);
+    n = node_find(d, name);
+    for (i=0; n == NULL && i<DISCOVERY_NODES; i++) {
+        if (d->nodes[i].state == NODE_FREE)
+            n = &d->nodes[i];
+    }
+    if (n != NULL) {
+        n->state = state;
+        snprintf(n->name, sizeof(n->name), "%s", name);
+    }
+    pthread_mutex_unlock(&d->lock);
+}
+
+static void emit(struct discovery *d, struct discovery_event *ev)
+{
+    /* Events are smaller than PIPE_BUF, so each write is atomic */
+    if (write(d->pipe[1], ev, sizeof(*ev)) != sizeof(*ev)) {
+        perror("discovery");
+        if (ev->type == DISCOVERY_ATTACH)
+            close(ev->fd);
+    }
+}
+
+/*
+ * Open 'path' at 'rate' and ask it for its model and device number, or
+ * with a 'hint' only check the device number. Runs in the discovery
+ * thread, communication errors land back here.
+ */
+static int probe_at(const char *path, uint8_t rate, const struct discovery_hint *hint,
+                    struct discovery_event *ev)
+{
+    jmp_buf env;
+    volatile int fd;
+
+    fd = open_port_path(path);
+    if (fd == -1)
+        return -1;
+
+    rf_set_speed(fd, rate);
+    rf_set_timeout(fd, DISCOVERY_TIMEOUT);
+    tcflush(fd, TCIOFLUSH);
+
+    if (setjmp(env)) {
+        rf_set_error_jmp(NULL);
+        close(fd);
+        return -1;
+    }
+    rf_set_error_jmp(&env);
+
+    memset(ev, 0, sizeof(*ev));
+    ev->type = DISCOVERY_ATTACH;
+    ev->fd = fd;
+    ev->baud = rate;
+    snprintf(ev->path, sizeof(ev->path), "%s", path);
+    if (hint != NULL) {
+        if (rf_get_device_number(fd, ev->dev_id) != 0 ||
+                memcmp(ev->dev_id, hint->dev_id, 2) != 0) {
+            comm_error();
+        }
+        memcpy(ev->model, hint->model, sizeof(ev->model));
+    } else {
+        if (rf_get_model(fd, sizeof(ev->model) - 1, (uint8_t*)ev->model) != 0 ||
+                rf_get_device_number(fd, ev->dev_id) != 0) {
+            comm_error();
+        }
+        rf_light(fd, LED_OFF);
+    }
+
+    rf_set_error_jmp(NULL);
+    return 0;
+}
+
+static int probe(struct discovery *d, const char *path, struct discovery_event *ev)
+{
+    const struct discovery_hint *hint = NULL;
+    int i;
+
+    for (i=0; i<d->hint_count && hint == NULL; i++) {
+        if (strcmp(d->hints[i].path, path) == 0)
+            hint = &d->hints[i];
+    }
+    if (hint != NULL && probe_at(path, hint->baud, hint, ev) == 0)
+        return 0;
+
+    for (i=0; i<sizeof(probe_rates); i++) {
+        if (probe_at(path, probe_rates[i], NULL, ev) == 0)
+            return 0;
+    }
+
+    fprintf(stderr, "discovery: No reader on %s.\n", path);
+    return -1;
+}
+
+/*
+ * Probe every matching node that is not known yet.
+ */
+static void scan(struct discovery *d)
+{
+    struct discovery_event ev;
+    struct dirent *de;
+    char path[sizeof(ev.path)];
+    int known;
+    DIR *dir;
+
+    dir = opendir(d->dir);
+    if (dir == NULL)
+        return;
+
+    while ((de = readdir(dir)) != NULL) {
+        if (fnmatch(d->pattern, de->d_name, 0) != 0)
+            continue;
+
+        pthread_mutex_lock(&d->lock);
+        known = (node_find(d, de->d_name) != NULL);
+        pthread_mutex_unlock(&d->lock);
+        if (known)
+            continue;
+
+        if (snprintf(path, sizeof(path), "%s/%s", d->dir, de->d_name) >= sizeof(path)) {
+            fprintf(stderr, "discovery: Path too long, ignoring %s\n", de->d_name);
+            node_set(d, de->d_name, NODE_REJECTED);
+        } else if (probe(d, path, &ev) == 0) {
+            node_set(d, de->d_name, NODE_ATTACHED);
+            emit(d, &ev);
+        } else {
+            node_set(d, de->d_name, NODE_REJECTED);
+        }
+    }
+
+    closedir(dir);
+}
+
+/*
+ * Any change to a node makes it unknown again, so that it is probed on
+ * the next scan. Removing an attached node detaches it.
+ */
+static void handle_inotify(struct discovery *d)
+{
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct inotify_event *ie;
+    struct discovery_event ev;
+    struct node *n;
+    int len, detach;
+    char *p;
+
+    len = read(d->inotify_fd, buf, sizeof(buf));
+    for (p=buf; len > 0 && p<buf + len; p += sizeof(*ie) + ie->len) {
+        ie = (struct inotify_event *)p;
+        if (ie->len == 0 || fnmatch(d->pattern, ie->name, 0) != 0)
+            continue;
+
+        detach = 0;
+        pthread_mutex_lock(&d->lock);
+        n = node_find(d, ie->name);
+        if (n != NULL) {
+            detach = (n->state == NODE_ATTACHED) &&
+                (ie->mask & (IN_DELETE | IN_MOVED_FROM));
+            if (detach || n->state == NODE_REJECTED)
+                n->state = NODE_FREE;
+        }
+        pthread_mutex_unlock(&d->lock);
+
+        if (detach) {
+            memset(&ev, 0, sizeof(ev));
+            ev.type = DISCOVERY_DETACH;
+            ev.fd = -1;
+            /* Always fits, the node was attached under this path */
+            if (snprintf(ev.path, sizeof(ev.path), "%s/%s", d->dir, ie->name) < sizeof(ev.path))
+                emit(d, &ev);
+        }
+    }
+}
+
+static void *discovery_thread(void *arg)
+{
+    struct discovery *d = arg;
+    struct pollfd pfd;
+
+    for (;;) {
+        scan(d);
+
+        pfd.fd = d->inotify_fd;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, DISCOVERY_RESCAN_MS) > 0)
+            handle_inotify(d);
+    }
+
+    return NULL;
+}
+
+struct discovery *discovery_start(const char *pattern, const struct discovery_hint *hints,
+                                  int hint_count)
+{
+    struct discovery *d;
+    const char *slash;
+
+    slash = strrchr(pattern, '/');
+    if (slash == NULL || slash == pattern || strlen(slash + 1) >= sizeof(d->pattern) ||
+            slash - pattern >= sizeof(d->dir)) {
+        fprintf(stderr, "discovery: Bad device pattern %s\n", pattern);
+        return NULL;
+    }
+
+    d = calloc(1, sizeof(*d));
+    if (d == NULL)
+        return NULL;
+    d->pipe[0] = d->pipe[1] = -1;
+    memcpy(d->dir, pattern, slash - pattern);
+    strcpy(d->pattern, slash + 1);
+    pthread_mutex_init(&d->lock, NULL);
+    d->hint_count = min(hint_count, DISCOVERY_HINTS_MAX);
+    if (d->hint_count > 0)
+        memcpy(d->hints, hints, d->hint_count * sizeof(hints[0]));
+
+    d->inotify_fd = inotify_init1(IN_CLOEXEC);
+    if (d->inotify_fd == -1 ||
+            inotify_add_watch(d->inotify_fd, d->dir,
+                              IN_CREATE | IN_DELETE | IN_ATTRIB | IN_MOVED_FROM | IN_MOVED_TO) == -1) {
+        perror("discovery: inotify");
+        goto fail;
+    }
+
+    if (pipe2(d->pipe, O_CLOEXEC) == -1) {
+        perror("discovery: pipe");
+        goto fail;
+    }
+    fcntl(d->pipe[0], F_SETFL, O_NONBLOCK);
+
+    if (pthread_create(&d->thread, NULL, discovery_thread, d) != 0) {
+        fprintf(stderr, "discovery: Could not start thread\n");
+        goto fail;
+    }
+
+    return d;
+
+fail:
+    if (d->inotify_fd != -1)
+        close(d->inotify_fd);
+    if (d->pipe[0] != -1) {
+        close(d->pipe[0]);
+        close(d->pipe[1]);
+    }
+    free(d);
+    return NULL;
+}
+
+int discovery_fd(struct discovery *d)
+{
+    return d->pipe[0];
+}
+
+int discovery_next(struct discovery *d, struct discovery_event *ev)
+{
+    int n;
+
+    n = read(d->pipe[0], ev, sizeof(*ev));
+    if (n == sizeof(*ev))
+        return 1;
+    if (n == -1 && (errno == EAGAIN || errno == EINTR))
+        return 0;
+    return -1;
+}
+
+void discovery_forget(struct discovery *d, const char *path)
+{
+    const char *name = strrchr(path, '/');
+    struct node *n;
+
+    pthread_mutex_lock(&d->lock);
+    n = node_find(d, name != NULL ? name + 1 : path);
+    if (n != NULL)
+        n->state = NODE_FREE;
+    pthread_mutex_unlock(&d->lock);
+}
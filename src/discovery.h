@@ -0,0 +1,107 @@
+// vim: ts=4 expandtab ai
+
+#ifndef DISCOVERY_H
+#define DISCOVERY_H
+
+/*
+ * Copyright (c) 2008, Henrik Torstensson <laban@kryo.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Hot-plug discovery of readers.
+ *
+ * A thread watches the directory of a glob such as "/dev/ttyUSB*" with
+ * inotify. New nodes matching the glob are opened and probed with
+ * rf_get_model() and rf_get_device_number(); those that answer are
+ * handed to the caller as DISCOVERY_ATTACH events with the port open.
+ * A DISCOVERY_DETACH event follows when the node goes away. Probing
+ * happens in the thread, so a slow or silent node never holds up the
+ * readers already attached.
+ *
+ * Attached ports have VMIN = 0 and VTIME set, so a reader that stops
+ * answering gives a communication error instead of hanging the caller.
+ *
+ * Readers are probed at 19200 baud first, then at the other rates in
+ * case one was left at a higher speed. A hint for the path, e.g. from a
+ * snapshot of the last run, is tried before that with a single command.
+ */
+
+#include <stdint.h>
+
+#define DISCOVERY_GLOB "/dev/ttyUSB*"
+#define DISCOVERY_RESCAN_MS 1000
+#define DISCOVERY_HINTS_MAX 32
+#define DISCOVERY_PATH_MAX 128         // Room for /dev/serial/by-id names
+
+enum discovery_events {
+    DISCOVERY_ATTACH = 1,
+    DISCOVERY_DETACH
+};
+
+struct discovery_event {
+    int type;
+    int fd;                             // Open port, ATTACH only
+    char path[DISCOVERY_PATH_MAX];
+    uint8_t dev_id[2];
+    char model[16];
+    uint8_t baud;                       // BAUD_* rate the port is at
+};
+
+/* What a path had the last time, to skip the full probe */
+struct discovery_hint {
+    char path[DISCOVERY_PATH_MAX];
+    uint8_t baud;
+    uint8_t dev_id[2];
+    char model[16];
+};
+
+struct discovery;
+
+/*
+ * 'discovery_start()' - Start watching for nodes matching 'pattern'.
+ * Nodes already present are reported as well. 'hints' (may be NULL)
+ * are copied.
+ *
+ * Returns NULL on error.
+ */
+
+struct discovery *discovery_start(const char *pattern, const struct discovery_hint *hints,
+                                  int hint_count);
+
+/*
+ * 'discovery_fd()' - File descriptor that gets readable when events are
+ * pending, for poll().
+ */
+
+int discovery_fd(struct discovery *d);
+
+/*
+ * 'discovery_next()' - Fetch the next event without blocking.
+ *
+ * Returns 1 if 'ev' was filled in, 0 if nothing was pending or -1 on
+ * error.
+ */
+
+int discovery_next(struct discovery *d, struct discovery_event *ev);
+
+/*
+ * 'discovery_forget()' - Tell discovery that the caller dropped the
+ * reader on 'path' after an error. It is probed again on the next
+ * rescan if the node is still there.
+ */
+
+void discovery_forget(struct discovery *d, const char *path);
+
+#endif
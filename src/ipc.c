@@ -0,0 +1,154 @@
+// vim: ts=4 expandtab ai
+
+/*
+ * Copyright (c) 2008, Henrik Torstensson <laban@kryo.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+
+#include "ipc.h"
+#include "sl500.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+int ipc_pair(int sv[2])
+{
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) == -1) {
+        perror("socketpair");
+        return -1;
+    }
+    return 0;
+}
+
+int ipc_send_batch(int fd, struct ipc_msg *msgs, int count)
+{
+    struct mmsghdr hdrs[IPC_BATCH_MAX];
+    struct iovec iov[IPC_BATCH_MAX];
+    int i, n, sent = 0;
+
+    while (sent < count) {
+        n = min(count - sent, IPC_BATCH_MAX);
+        memset(hdrs, 0, n * sizeof(hdrs[0]));
+        for (i=0; i<n; i++) {
+            iov[i].iov_base = &msgs[sent + i];
+            iov[i].iov_len = IPC_MSG_SIZE(&msgs[sent + i]);
+            hdrs[i].msg_hdr.msg_iov = &iov[i];
+            hdrs[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        n = sendmmsg(fd, hdrs, n, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            perror("ipc_send");
+            return -1;
+        }
+        sent += n;
+    }
+
+    return sent;
+}
+
+void ipc_queue_init(struct ipc_queue *q, int fd)
+{
+    q->fd = fd;
+    q->head = 0;
+    q->count = 0;
+    q->sent = 0;
+}
+
+struct ipc_msg *ipc_queue_add(struct ipc_queue *q)
+{
+    struct pollfd pfd;
+
+    while (q->count == IPC_QUEUE_LEN) {
+        pfd.fd = q->fd;
+        pfd.events = POLLOUT;
+        if (poll(&pfd, 1, -1) == -1 && errno != EINTR) {
+            perror("poll");
+            return NULL;
+        }
+        if (ipc_queue_flush(q) == -1)
+            return NULL;
+    }
+
+    return &q->msgs[(q->head + q->count++) % IPC_QUEUE_LEN];
+}
+
+int ipc_queue_flush(struct ipc_queue *q)
+{
+    int n, want;
+
+    while (q->count > 0) {
+        /* The part up to the end of the ring, then the rest */
+        want = min(q->count, IPC_QUEUE_LEN - q->head);
+        n = ipc_send_batch(q->fd, &q->msgs[q->head], want);
+        if (n == -1)
+            return -1;
+        q->head = (q->head + n) % IPC_QUEUE_LEN;
+        q->count -= n;
+        q->sent += n;
+        if (n < want)
+            break;
+    }
+
+    return 0;
+}
+
+int ipc_recv_batch(int fd, struct ipc_msg *msgs, int max)
+{
+    struct mmsghdr hdrs[IPC_BATCH_MAX];
+    struct iovec iov[IPC_BATCH_MAX];
+    int i, n;
+
+    max = min(max, IPC_BATCH_MAX);
+    memset(hdrs, 0, max * sizeof(hdrs[0]));
+    for (i=0; i<max; i++) {
+        iov[i].iov_base = &msgs[i];
+        iov[i].iov_len = sizeof(msgs[i]);
+        hdrs[i].msg_hdr.msg_iov = &iov[i];
+        hdrs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    do {
+        n = recvmmsg(fd, hdrs, max, MSG_DONTWAIT, NULL);
+    } while (n == -1 && errno == EINTR);
+
+    if (n == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
+        perror("ipc_recv");
+        return -1;
+    }
+
+    for (i=0; i<n; i++) {
+        /* A zero length record means the other end closed */
+        if (hdrs[i].msg_len < IPC_HDR_SIZE) {
+            if (i == 0)
+                return -1;
+            return i;
+        }
+        msgs[i].len = min(msgs[i].len, hdrs[i].msg_len - IPC_HDR_SIZE);
+    }
+
+    return n;
+}
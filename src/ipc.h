@@ -0,0 +1,153 @@
+// vim: ts=4 expandtab ai
+
+#ifndef IPC_H
+#define IPC_H
+
+/*
+ * Copyright (c) 2008, Henrik Torstensson <laban@kryo.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Message passing between the network and RFID processes.
+ *
+ * Messages travel over a SOCK_SEQPACKET socketpair, one record per
+ * send, so a message is never split or merged with the next. Only the
+ * used part of 'data' is sent.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define IPC_DATA_MAX 256
+#define IPC_BATCH_MAX 16
+
+enum cmds {
+    CMD_WAIT_FOR_CARD = 0x10,
+    CMD_CARD_ACK,
+    CMD_CARD_LOST,                      // CMD_CARD_ACK for a card_detected
+                                        // the client never got, no reply
+
+    CMD_CARD_DETECTED,
+
+    CMD_BEEP,                           // arg = time in 10 ms units
+    CMD_LIGHT,                          // arg = LED_* color
+
+    /*
+     * Card commands, run on the card selected at the last
+     * CMD_CARD_DETECTED until CMD_CARD_ACK or CMD_CARD_LOST. Keys are
+     * given as key_type (KEY_A/KEY_B) and a key_slot in the server key
+     * table.
+     */
+    CMD_READ_BLOCK,                     // arg = block
+    CMD_WRITE_BLOCK,                    // arg = block, data = 16 bytes
+    CMD_READ_SECTOR,                    // arg = sector
+    CMD_DUMP,                           // One CMD_SECTOR_DATA per sector
+
+    CMD_RESULT,                         // Reply to any command, status set
+    CMD_BLOCK_DATA,                     // arg = block
+    CMD_SECTOR_DATA,                    // arg = sector
+    CMD_DUMP_DONE
+};
+
+/* Statuses not coming from the reader */
+#define IPC_ERR_NO_READER (0xfa)        // Reader unplugged or not answering
+#define IPC_ERR_UNKNOWN (0xff)          // Unknown command
+#define IPC_ERR_NO_CARD (0xfe)          // No card session active
+#define IPC_ERR_NO_KEY (0xfd)           // Empty key slot
+#define IPC_ERR_RANGE (0xfc)            // Block or sector not on card
+
+struct ipc_msg {
+    uint8_t cmd;
+    uint8_t status;
+    uint16_t len;                       // Used bytes of data
+    uint16_t client;                    // Echoed back in replies
+    uint8_t reader;
+    uint8_t arg;                        // Block, sector, time or color
+    uint8_t key_type;
+    uint8_t key_slot;
+    uint8_t pad[2];
+    uint8_t data[IPC_DATA_MAX];
+};
+
+#define IPC_HDR_SIZE (offsetof(struct ipc_msg, data))
+#define IPC_MSG_SIZE(msg) (IPC_HDR_SIZE + (msg)->len)
+
+/*
+ * 'ipc_pair()' - Create the socketpair shared by the two processes.
+ *
+ * Returns 0 on success or -1 on error.
+ */
+
+int ipc_pair(int sv[2]);
+
+/*
+ * 'ipc_send_batch()' - Send up to 'count' messages without blocking,
+ * in as few system calls as possible.
+ *
+ * Returns the number of messages sent, fewer than 'count' when the
+ * socket is full, or -1 on error.
+ */
+
+int ipc_send_batch(int fd, struct ipc_msg *msgs, int count);
+
+/*
+ * Messages waiting for room in the socket. Both processes queue what
+ * they send here and flush it when the socket is writable, so neither
+ * blocks on the other.
+ */
+
+#define IPC_QUEUE_LEN 1024
+
+struct ipc_queue {
+    int fd;
+    unsigned int head;
+    unsigned int count;
+    unsigned long long sent;            // Messages sent so far
+    struct ipc_msg msgs[IPC_QUEUE_LEN];
+};
+
+void ipc_queue_init(struct ipc_queue *q, int fd);
+
+/*
+ * 'ipc_queue_add()' - Return a new message at the end of the queue, for
+ * the caller to fill in. It goes out with the next ipc_queue_flush().
+ *
+ * Only when all IPC_QUEUE_LEN messages are still waiting does this
+ * block until the other process makes room; the callers hold back
+ * their input long before that.
+ */
+
+struct ipc_msg *ipc_queue_add(struct ipc_queue *q);
+
+/*
+ * 'ipc_queue_flush()' - Send as many queued messages as the socket
+ * takes without blocking.
+ *
+ * Returns 0, or -1 on error.
+ */
+
+int ipc_queue_flush(struct ipc_queue *q);
+
+/*
+ * 'ipc_recv_batch()' - Fetch up to 'max' pending messages without
+ * blocking.
+ *
+ * Returns the number of messages received (0 if none were pending), or
+ * -1 on error or when the other process has gone away.
+ */
+
+int ipc_recv_batch(int fd, struct ipc_msg *msgs, int max);
+
+#endif
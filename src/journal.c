@@ -0,0 +1,434 @@
+// vim: ts=4 expandtab ai
+
+/*
+ * Copyright (c) 2008, Henrik Torstensson <laban@kryo.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "journal.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define JOURNAL_MAGIC (0x534c354a)      // "SL5J"
+#define JOURNAL_BUCKETS 4096            // Power of two
+#define PAGE_BYTES 4096
+
+struct segment_hdr {
+    uint32_t magic;                     // Stored last when creating
+    uint32_t records;                   // Capacity
+    uint64_t first_seq;
+    uint64_t first_time;
+    uint64_t last_time;
+    uint32_t count;                     // Records written, stored last
+    uint32_t pad;
+    uint32_t heads[JOURNAL_BUCKETS];    // Newest record + 1 per UID hash
+};
+
+#define HDR_BYTES ((sizeof(struct segment_hdr) + PAGE_BYTES - 1) & ~(PAGE_BYTES - 1))
+
+struct segment {
+    uint64_t first_seq;
+    struct segment_hdr *hdr;
+    struct journal_record *rec;
+    size_t map_size;
+};
+
+struct journal {
+    char dir[128];
+    int writable;
+    int count;                          // Segments mapped, oldest first
+    struct segment seg[JOURNAL_SEGMENTS_MAX + 1];
+    uint32_t synced;                    // Records of the newest segment on disk
+    long long sync_at;
+    uint64_t last_time;                 // Of the newest record, the writer's floor
+};
+
+static uint32_t uid_bucket(const uint8_t *uid, int uid_len)
+{
+    uint32_t h = 2166136261u;
+    int i;
+
+    for (i=0; i<uid_len; i++) {
+        h ^= uid[i];
+        h *= 16777619u;
+    }
+    return (h ^ (h >> 16)) & (JOURNAL_BUCKETS - 1);
+}
+
+static void segment_path(struct journal *j, uint64_t first_seq, char *path, int len)
+{
+    snprintf(path, len, "%s/taps-%016llx.jnl", j->dir, (unsigned long long)first_seq);
+}
+
+static int segment_map(struct journal *j, struct segment *s, uint64_t first_seq, int create)
+{
+    size_t bytes = HDR_BYTES + JOURNAL_SEGMENT_RECORDS * sizeof(struct journal_record);
+    struct segment_hdr *hdr;
+    char path[192];
+    int fd;
+
+    segment_path(j, first_seq, path, sizeof(path));
+    if (create) {
+        fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd != -1 && ftruncate(fd, bytes) == -1) {
+            perror("journal: ftruncate");
+            close(fd);
+            unlink(path);
+            return -1;
+        }
+    } else {
+        fd = open(path, j->writable ? O_RDWR : O_RDONLY);
+    }
+    if (fd == -1) {
+        fprintf(stderr, "journal: Unable to open %s - %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    hdr = mmap(NULL, bytes, PROT_READ | (j->writable ? PROT_WRITE : 0), MAP_SHARED, fd, 0);
+    close(fd);
+    if (hdr == MAP_FAILED) {
+        perror("journal: mmap");
+        return -1;
+    }
+
+    if (create) {
+        hdr->records = JOURNAL_SEGMENT_RECORDS;
+        hdr->first_seq = first_seq;
+        __atomic_store_n(&hdr->magic, JOURNAL_MAGIC, __ATOMIC_RELEASE);
+    } else if (__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != JOURNAL_MAGIC ||
+               hdr->records != JOURNAL_SEGMENT_RECORDS || hdr->first_seq != first_seq) {
+        fprintf(stderr, "journal: %s has a bad header\n", path);
+        munmap(hdr, bytes);
+        return -1;
+    }
+
+    s->first_seq = first_seq;
+    s->hdr = hdr;
+    s->rec = (struct journal_record *)((uint8_t*)hdr + HDR_BYTES);
+    s->map_size = bytes;
+    return 0;
+}
+
+static int seq_cmp(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+/*
+ * Bring the mapped segments in line with the directory, which the
+ * writer may have added to or pruned since.
+ */
+static int refresh(struct journal *j)
+{
+    uint64_t seqs[JOURNAL_SEGMENTS_MAX * 2];
+    struct segment seg[JOURNAL_SEGMENTS_MAX + 1];
+    unsigned long long seq;
+    struct dirent *de;
+    int i, k, n = 0, count = 0;
+    char end;
+    DIR *dir;
+
+    dir = opendir(j->dir);
+    if (dir == NULL)
+        return -1;
+    while ((de = readdir(dir)) != NULL && n < JOURNAL_SEGMENTS_MAX * 2) {
+        if (sscanf(de->d_name, "taps-%16llx.jn%c", &seq, &end) == 2 && end == 'l')
+            seqs[n++] = seq;
+    }
+    closedir(dir);
+    qsort(seqs, n, sizeof(seqs[0]), seq_cmp);
+
+    /* Only the newest segments, a reader may race the writer's pruning */
+    for (i = (n > JOURNAL_SEGMENTS_MAX + 1) ? n - JOURNAL_SEGMENTS_MAX - 1 : 0; i<n; i++) {
+        for (k=0; k<j->count && j->seg[k].first_seq != seqs[i]; k++)
+            ;
+        if (k < j->count) {
+            seg[count] = j->seg[k];
+            j->seg[k].hdr = NULL;
+            count++;
+        } else if (segment_map(j, &seg[count], seqs[i], 0) == 0) {
+            count++;
+        }
+    }
+
+    for (k=0; k<j->count; k++) {
+        if (j->seg[k].hdr != NULL)
+            munmap(j->seg[k].hdr, j->seg[k].map_size);
+    }
+    memcpy(j->seg, seg, count * sizeof(seg[0]));
+    j->count = count;
+    return 0;
+}
+
+struct journal *journal_open(const char *dir, int writable)
+{
+    struct journal *j;
+    int i;
+
+    j = calloc(1, sizeof(*j));
+    if (j == NULL)
+        return NULL;
+    snprintf(j->dir, sizeof(j->dir), "%s", dir);
+    j->writable = writable;
+
+    if (writable && mkdir(dir, 0755) == -1 && errno != EEXIST) {
+        fprintf(stderr, "journal: Unable to create %s - %s\n", dir, strerror(errno));
+        free(j);
+        return NULL;
+    }
+
+    if (refresh(j) == -1) {
+        fprintf(stderr, "journal: Unable to read %s - %s\n", dir, strerror(errno));
+        free(j);
+        return NULL;
+    }
+
+    if (writable && j->count == 0) {
+        if (segment_map(j, &j->seg[0], 0, 1) == -1) {
+            free(j);
+            return NULL;
+        }
+        j->count = 1;
+    }
+    if (writable) {
+        j->synced = j->seg[j->count - 1].hdr->count;
+        for (i=0; i<j->count; i++) {
+            if (j->seg[i].hdr->count > 0 && j->seg[i].hdr->last_time > j->last_time)
+                j->last_time = j->seg[i].hdr->last_time;
+        }
+    }
+
+    return j;
+}
+
+void journal_close(struct journal *j)
+{
+    int i;
+
+    if (j == NULL)
+        return;
+    if (j->writable)
+        journal_sync(j, 0, 1);
+    for (i=0; i<j->count; i++)
+        munmap(j->seg[i].hdr, j->seg[i].map_size);
+    free(j);
+}
+
+/*
+ * Start a new segment after a full one, deleting the oldest when there
+ * are too many.
+ */
+static int rotate(struct journal *j)
+{
+    struct segment *last = &j->seg[j->count - 1];
+    char path[192];
+
+    journal_sync(j, 0, 1);
+    if (segment_map(j, &j->seg[j->count], last->first_seq + last->hdr->records, 1) == -1)
+        return -1;
+    j->count++;
+    j->synced = 0;
+
+    if (j->count > JOURNAL_SEGMENTS_MAX) {
+        segment_path(j, j->seg[0].first_seq, path, sizeof(path));
+        unlink(path);
+        munmap(j->seg[0].hdr, j->seg[0].map_size);
+        memmove(&j->seg[0], &j->seg[1], (j->count - 1) * sizeof(j->seg[0]));
+        j->count--;
+    }
+    return 0;
+}
+
+int64_t journal_append(struct journal *j, uint64_t time, uint16_t reader, uint8_t result,
+                       const uint8_t *uid, int uid_len)
+{
+    struct segment_hdr *hdr = j->seg[j->count - 1].hdr;
+    struct journal_record *r;
+    struct timespec now;
+    uint32_t idx, bucket;
+
+    if (hdr->count == hdr->records) {
+        if (rotate(j) == -1)
+            return -1;
+        hdr = j->seg[j->count - 1].hdr;
+    }
+    if (uid_len > JOURNAL_UID_MAX)
+        uid_len = JOURNAL_UID_MAX;
+
+    idx = hdr->count;
+    r = &j->seg[j->count - 1].rec[idx];
+    if (time == 0) {
+        clock_gettime(CLOCK_REALTIME, &now);
+        time = (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+    }
+    /* Queries rely on time order, hold still while the clock steps back */
+    if (time < j->last_time)
+        time = j->last_time;
+    j->last_time = time;
+    r->time = time;
+    r->reader = reader;
+    r->result = result;
+    r->uid_len = uid_len;
+    memcpy(r->uid, uid, uid_len);
+
+    /* Readers ignore the record until the count covers it */
+    bucket = uid_bucket(uid, uid_len);
+    r->prev = hdr->heads[bucket];
+    __atomic_store_n(&hdr->heads[bucket], idx + 1, __ATOMIC_RELEASE);
+    if (idx == 0)
+        hdr->first_time = r->time;
+    hdr->last_time = r->time;
+    __atomic_store_n(&hdr->count, idx + 1, __ATOMIC_RELEASE);
+
+    return hdr->first_seq + idx;
+}
+
+void journal_sync(struct journal *j, long long now, int force)
+{
+    struct segment *s = &j->seg[j->count - 1];
+    uint32_t count = s->hdr->count;
+    size_t from, to;
+
+    if (count == j->synced)
+        return;
+    if (!force && count - j->synced < JOURNAL_SYNC_RECORDS && now < j->sync_at)
+        return;
+
+    /* The new records and the header, which holds the bucket heads */
+    from = (j->synced * sizeof(struct journal_record)) & ~(size_t)(PAGE_BYTES - 1);
+    to = count * sizeof(struct journal_record);
+    if (msync((uint8_t*)s->rec + from, to - from, MS_SYNC) == -1 ||
+            msync(s->hdr, HDR_BYTES, MS_SYNC) == -1) {
+        perror("journal: msync");
+    }
+    j->synced = count;
+    j->sync_at = now + JOURNAL_SYNC_MS;
+}
+
+int journal_query_uid(struct journal *j, const uint8_t *uid, int uid_len,
+                      uint64_t since, journal_fn fn, void *arg)
+{
+    const struct journal_record *r;
+    struct segment *s;
+    uint32_t bucket, idx, count;
+    int i, found = 0;
+
+    if (!j->writable)
+        refresh(j);
+    if (uid_len > JOURNAL_UID_MAX)
+        uid_len = JOURNAL_UID_MAX;
+    bucket = uid_bucket(uid, uid_len);
+
+    for (i=j->count - 1; i>=0; i--) {
+        s = &j->seg[i];
+        count = __atomic_load_n(&s->hdr->count, __ATOMIC_ACQUIRE);
+        if (count == 0)
+            continue;
+        if (s->hdr->last_time < since)
+            break;
+
+        idx = __atomic_load_n(&s->hdr->heads[bucket], __ATOMIC_ACQUIRE);
+        while (idx != 0) {
+            r = &s->rec[idx - 1];
+            if (idx <= count) {
+                if (r->time < since)
+                    return found;
+                if (r->uid_len == uid_len && memcmp(r->uid, uid, uid_len) == 0) {
+                    found++;
+                    if (fn(arg, s->first_seq + idx - 1, r) != 0)
+                        return found;
+                }
+            }
+            idx = r->prev;
+        }
+    }
+
+    return found;
+}
+
+int journal_query_time(struct journal *j, uint64_t from, uint64_t to,
+                       journal_fn fn, void *arg)
+{
+    struct segment *s;
+    uint32_t lo, hi, mid, count;
+    int i, found = 0;
+
+    if (!j->writable)
+        refresh(j);
+
+    for (i=0; i<j->count; i++) {
+        s = &j->seg[i];
+        count = __atomic_load_n(&s->hdr->count, __ATOMIC_ACQUIRE);
+        if (count == 0 || s->hdr->last_time < from)
+            continue;
+        if (s->hdr->first_time > to)
+            break;
+
+        /* First record at or after 'from' */
+        lo = 0;
+        hi = count;
+        while (lo < hi) {
+            mid = lo + (hi - lo) / 2;
+            if (s->rec[mid].time < from)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+
+        for (; lo < count && s->rec[lo].time <= to; lo++) {
+            found++;
+            if (fn(arg, s->first_seq + lo, &s->rec[lo]) != 0)
+                return found;
+        }
+    }
+
+    return found;
+}
+
+uint64_t journal_replay(struct journal *j, uint64_t seq, journal_fn fn, void *arg)
+{
+    struct segment *s;
+    uint32_t idx, count;
+    int i;
+
+    if (!j->writable)
+        refresh(j);
+
+    for (i=0; i<j->count; i++) {
+        s = &j->seg[i];
+        count = __atomic_load_n(&s->hdr->count, __ATOMIC_ACQUIRE);
+        if (s->first_seq + count <= seq)
+            continue;
+
+        idx = (seq > s->first_seq) ? seq - s->first_seq : 0;
+        for (; idx < count; idx++) {
+            seq = s->first_seq + idx + 1;
+            if (fn(arg, s->first_seq + idx, &s->rec[idx]) != 0)
+                return seq;
+        }
+    }
+
+    return seq;
+}
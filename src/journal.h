@@ -0,0 +1,137 @@
+// vim: ts=4 expandtab ai
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+/*
+ * Copyright (c) 2008, Henrik Torstensson <laban@kryo.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Append-only journal of taps.
+ *
+ * Records have a fixed size and live in segment files of
+ * JOURNAL_SEGMENT_RECORDS each in one directory, named after the
+ * sequence number of their first record. The writer appends through a
+ * shared mapping and syncs in batches; once more than
+ * JOURNAL_SEGMENTS_MAX segments exist the oldest is deleted. Readers in
+ * other processes map the same files read-only.
+ *
+ * Each segment header keeps the time span it covers and, per UID hash
+ * bucket, the newest record in it. Records link to the previous one in
+ * their bucket, so the taps of one card are found by walking a short
+ * chain from the newest segment backwards. Time ranges are found by a
+ * binary search, records being appended in time order: a time before
+ * the newest record's is recorded as that time.
+ */
+
+#include <stdint.h>
+
+#define JOURNAL_DIR "/var/lib/sl500/journal"
+#define JOURNAL_SEGMENT_RECORDS 65536
+#define JOURNAL_SEGMENTS_MAX 64
+#define JOURNAL_SYNC_MS 1000
+#define JOURNAL_SYNC_RECORDS 256
+#define JOURNAL_UID_MAX 10
+
+enum journal_results {
+    JOURNAL_TAP = 1,                    // Card came into the field
+    JOURNAL_DELIVERED,                  // Reported to a waiting client
+    JOURNAL_REMOVED                     // Card left the field
+};
+
+struct journal_record {
+    uint64_t time;                      // CLOCK_REALTIME, milliseconds
+    uint32_t prev;                      // Previous record in the bucket + 1
+    uint16_t reader;
+    uint8_t result;
+    uint8_t uid_len;
+    uint8_t uid[JOURNAL_UID_MAX];
+    uint8_t pad[6];
+};
+
+struct journal;
+
+/*
+ * Called for each record found. Returning non-zero ends the walk.
+ */
+
+typedef int (*journal_fn)(void *arg, uint64_t seq, const struct journal_record *rec);
+
+/*
+ * 'journal_open()' - Open the journal in 'dir', as the writer if
+ * 'writable' is set. The writer creates the directory if needed and
+ * carries on after the last record written.
+ *
+ * Returns NULL on error.
+ */
+
+struct journal *journal_open(const char *dir, int writable);
+
+/* 'journal_close()' - Sync and unmap */
+
+void journal_close(struct journal *j);
+
+/*
+ * 'journal_append()' - Add a record stamped with 'time' (CLOCK_REALTIME,
+ * milliseconds), or with the current time if it is 0. A time earlier
+ * than the last one appended, as after the clock is set back, is raised
+ * to it.
+ *
+ * Returns its sequence number, or -1 on error.
+ */
+
+int64_t journal_append(struct journal *j, uint64_t time, uint16_t reader, uint8_t result,
+                       const uint8_t *uid, int uid_len);
+
+/*
+ * 'journal_sync()' - Flush what was appended to disk, if JOURNAL_SYNC_MS
+ * have passed since the last sync at 'now' (milliseconds, monotonic) or
+ * JOURNAL_SYNC_RECORDS are waiting, or right away with 'force'.
+ */
+
+void journal_sync(struct journal *j, long long now, int force);
+
+/*
+ * 'journal_query_uid()' - Call 'fn' for the records of 'uid' from
+ * 'since' (CLOCK_REALTIME milliseconds) on, newest first.
+ *
+ * Returns the number of records passed to 'fn'.
+ */
+
+int journal_query_uid(struct journal *j, const uint8_t *uid, int uid_len,
+                      uint64_t since, journal_fn fn, void *arg);
+
+/*
+ * 'journal_query_time()' - Call 'fn' for the records from 'from' up to
+ * and including 'to', oldest first.
+ *
+ * Returns the number of records passed to 'fn'.
+ */
+
+int journal_query_time(struct journal *j, uint64_t from, uint64_t to,
+                       journal_fn fn, void *arg);
+
+/*
+ * 'journal_replay()' - Call 'fn' for every record from sequence number
+ * 'seq' on, oldest first. Records deleted with their segment are
+ * skipped.
+ *
+ * Returns the sequence number after the last record passed to 'fn'.
+ */
+
+uint64_t journal_replay(struct journal *j, uint64_t seq, journal_fn fn, void *arg);
+
+#endif
@@ -0,0 +1,74 @@
+// vim: ts=4 expandtab ai
+
+/*
+ * Copyright (c) 2008, Henrik Torstensson <laban@kryo.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "keys.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+
+static uint8_t key_table[KEY_SLOTS][6] = {
+    {0xff, 0xff, 0xff, 0xff, 0xff, 0xff}
+};
+static int key_set[KEY_SLOTS] = {1};
+
+int keys_load(const char *path)
+{
+    FILE *f;
+    char line[100];
+    char *p;
+    unsigned int slot;
+    unsigned int b[6];
+    int lineno = 0;
+    int i;
+
+    f = fopen(path, "r");
+    if (f == NULL) {
+        perror("keys_load");
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), f) != NULL) {
+        lineno++;
+        for (p = line; isspace((unsigned char)*p); p++);
+        if (*p == '\0' || *p == '#')
+            continue;
+
+        if (sscanf(p, "%u %2x%2x%2x%2x%2x%2x", &slot,
+                   &b[0], &b[1], &b[2], &b[3], &b[4], &b[5]) != 7 ||
+                slot >= KEY_SLOTS) {
+            fprintf(stderr, "%s:%d: bad key line\n", path, lineno);
+            fclose(f);
+            return -1;
+        }
+
+        for (i=0; i<6; i++)
+            key_table[slot][i] = b[i];
+        key_set[slot] = 1;
+    }
+
+    fclose(f);
+    return 0;
+}
+
+uint8_t *keys_get(int slot)
+{
+    if (slot < 0 || slot >= KEY_SLOTS || !key_set[slot])
+        return NULL;
+    return key_table[slot];
+}
@@ -0,0 +1,52 @@
+// vim: ts=4 expandtab ai
+
+#ifndef KEYS_H
+#define KEYS_H
+
+/*
+ * Copyright (c) 2008, Henrik Torstensson <laban@kryo.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Server side key table. Clients refer to keys by slot number so that
+ * key material never has to cross the socket.
+ */
+
+#include <stdint.h>
+
+#define KEY_SLOTS 16
+
+/*
+ * 'keys_load()' - Read keys from a file with lines of the form
+ *
+ *     <slot> <12 hex digits>
+ *
+ * Empty lines and lines starting with '#' are ignored. Slot 0 holds the
+ * transport key ff ff ff ff ff ff unless the file says otherwise.
+ *
+ * Returns 0 on success or -1 on error.
+ */
+
+int keys_load(const char *path);
+
+/*
+ * 'keys_get()' - Look up a key slot.
+ *
+ * Returns NULL if the slot is out of range or has no key.
+ */
+
+uint8_t *keys_get(int slot);
+
+#endif
@@ -16,216 +16,2353 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include "bus.h"
+#include "dedup.h"
+#include "discovery.h"
+#include "ipc.h"
+#include "journal.h"
+#include "keys.h"
+#include "pool.h"
+#include "realtime.h"
+#include "sector_cache.h"
 #include "sl500.h"
+#include "snapshot.h"
+#include "tap_ring.h"
+#include "workpool.h"
 
 #include <assert.h>
+#include <errno.h>
 #include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
-#include <sys/time.h>
 #include <sys/types.h>
-#include <signal.h>
+#include <sys/uio.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #define PROTO_VER "1.0"
-#define PIPEBUF_SIZE 50
+#define POLL_INTERVAL_MS 100
+
+#define SESSION_TIMEOUT_MS 5000
+
+#define MAX_READERS 32
+#define MAX_BUSES 4
+#define BUS_POLL_SLOTS 4                // Bus readers polled per tick and bus
+#define MAX_GROUPS 8
+#define RTT_ROUNDS 8                    // Round trips timed per reader
+#define MAX_CLIENTS 256
+#define NET_CLIENTS 32                  // Default for -C
+#define NET_QUEUE_LEN 64                // Lines queued per client
+#define NET_QUEUE_HEADROOM 8            // Lines a replay leaves free for live output
+#define NET_LINE_MAX 576                // Longest line, a 256 byte sector in hex
+#define NET_READ_SIZE 256
+#define CMD_QUEUE_MAX 64                // Reader commands waiting to run
+#define OUTBOX_ROOM (IPC_BATCH_MAX * 48) // Replies to one batch of commands, a dump is 41
+#define FLASH_COUNT 3                   // Quick flashes when a card is found
+#define FLASH_MS 50
+#define DISK_QUEUE_MAX 1024             // Journal records waiting for the disk thread
 
-enum cmds {
-    CMD_WAIT_FOR_CARD = 0x10,
-    CMD_CARD_ACK,
+/*
+ * UID of a card in the field: 4 bytes for MIFARE Classic, 7 for
+ * Ultralight and NTAG.
+ */
+struct card_uid {
+    uint8_t len;                        // 0 for no card
+    uint8_t uid[RF_UL_UID_LEN];
+};
+
+struct rfid_reader {
+    int fd;                             // -1 while detached
+    char path[DISCOVERY_PATH_MAX];
+    uint8_t dev_id[2];
+    char model[16];
+    uint8_t baud;                       // BAUD_* rate the port is at
+    unsigned long polls;
+    unsigned long taps;
+    struct card_uid uid;                // Card seen at the last poll
+    struct card_uid reported;           // Card last published as present
+    int pending;                        // New tap not handed to a client yet
+    int found;                          // Tap claimed for a waiter this tick
+    struct rf_session card;             // Card selected for 'session_client'
+    uint16_t session_client;            // 0 while there is no card session
+    long long session_deadline;
+    uint32_t scope;                     // Taps are deduplicated per scope
+    long long flash_until;              // Quick flashes queued until then
+    struct bus *bus;                    // NULL for a reader on its own port
+    int bus_node;
+};
+
+struct bus_spec {
+    const char *path;
+    int count;
+    uint8_t dev_ids[BUS_MAX_NODES][2];
+};
+
+struct group_spec {
+    int count;
+    uint8_t dev_ids[MAX_READERS][2];
+};
+
+/*
+ * Reader command to run at a given time. Workers also post 'job' back
+ * this way when they are done with it.
+ */
+struct reader_cmd {
+    long long at;                       // now_ms() time
+    uint8_t reader;
+    uint8_t cmd;                        // CMD_BEEP, CMD_LIGHT or CMD_WRITE_BLOCK
+    uint8_t arg;                        // Block for CMD_WRITE_BLOCK
+    uint8_t key_type;
+    uint8_t key_slot;
+    struct card_uid card;               // Card to write, the one tapped
+    uint8_t data[16];
+    void *job;
+};
+
+struct disk_record {
+    uint64_t time;                      // CLOCK_REALTIME, milliseconds
+    uint16_t reader;
+    uint8_t result;
+    struct card_uid card;
+};
+
+struct tap_job {
+    int reader;
+    struct card_uid card;
+};
+
+/*
+ * What to do when a client does not read and its queue is full.
+ */
+enum net_overflows {
+    OVERFLOW_DISCONNECT = 0,            // Drop the client, it can replay
+    OVERFLOW_DROP,                      // Drop the oldest line
+    OVERFLOW_COALESCE                   // Drop an older event of the same reader
+};
+
+struct net_line {
+    long long queued;                   // now_ms() time
+    int reader;                         // Event of this reader, -1 for others
+    int len;
+    char text[NET_LINE_MAX];
+};
+
+struct net_queue {
+    int head;                           // Oldest line
+    int count;
+    int sent;                           // Bytes of the oldest line written
+    struct net_line lines[NET_QUEUE_LEN];
+};
+
+struct client {
+    int fd;
+    uint16_t id;
+    int handshake;
+    int waiting;
+    int reader;                         // Where the last card was found
+    char client_protocol[10];
+    char buf[100];
+    int bufpos;
+    struct net_queue *q;                // From the output pool
+    int closing;                        // Drop at the end of this round
+    int lost_reader;                    // Reader of a dropped card_detected, or -1
+    int replaying;
+    uint64_t replay_seq;                // Next record to replay
+    int stats_pool;                     // Next pool line of a stats answer, -1 if none
+    uint16_t stats_after;               // Client lines up to this id are out
+    char held[NET_READ_SIZE];           // Input after a replay or stats, run when it is done
+    int held_len;
+    int peak;                           // Most lines queued at once
+    unsigned long dropped;
+    unsigned long coalesced;
+    unsigned long long sent_bytes;
+    long long max_lag;                  // Longest a line waited, ms
+    unsigned long long ipc_seq;         // Sent to the RFID process once net_ipc.sent is here
+};
+
+int card_found = 0;                     // Readers with 'found' set
+unsigned int flash_on_found = 1;
+uint16_t waiters[MAX_CLIENTS];          // Clients in wait_for_card, first served first
+int waiter_count = 0;
+struct sector_cache *cache;
+const char *cache_path;
+int cache_enabled = 0;
+uint32_t cache_ro_mask = 0;
+int cache_version_block = -1;
+struct tap_ring *taps;
+const char *device_glob;
+struct discovery *discovery;
+struct rfid_reader readers[MAX_READERS];
+int reader_count = 0;                   // Slots handed out so far
+struct rfid_reader *current_reader;     // Blamed for communication errors
+struct bus_spec bus_specs[MAX_BUSES];
+int bus_count = 0;
+struct bus *buses[MAX_BUSES];
+struct dedup *dedup;
+int dedup_window = DEDUP_WINDOW_MS;
+struct group_spec group_specs[MAX_GROUPS];
+int group_count = 0;
+int low_latency = 0;
+int rt_priority = 0;                    // SCHED_FIFO priority, 0 = off
+int rt_cpu = -1;
+const char *journal_dir;
+struct journal *journal;                // Written by the RFID process
+struct journal *replay_journal;         // Read by the network process
+const char *snapshot_path;
+int fast_baud = 0;
+int max_clients = NET_CLIENTS;
+const char *tap_hook_cmd;
+int hook_threads = WORKPOOL_THREADS;
+struct workpool *workers;
+struct pool *job_pool;
+struct reader_cmd cmd_queue[CMD_QUEUE_MAX];
+int cmd_count = 0;
+struct reader_cmd inbox[CMD_QUEUE_MAX]; // Posted by workers
+int inbox_count = 0;
+pthread_mutex_t inbox_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t inbox_room = PTHREAD_COND_INITIALIZER;
+int inbox_fd = -1;
+struct pool *client_pool;
+struct pool *out_pool;
+struct client **clients;                // Connected, in no particular order
+int client_count = 0;
+struct ipc_queue net_ipc;               // To the RFID process
+enum net_overflows net_overflow = OVERFLOW_DISCONNECT;
+struct disk_record disk_queue[DISK_QUEUE_MAX];
+int disk_count = 0;
+struct snapshot_reader disk_snap[MAX_READERS];
+int disk_snap_count = -1;               // -1 when there is no snapshot to save
+int disk_started = 0;
+int disk_stopping = 0;
+pthread_mutex_t disk_lock;
+pthread_cond_t disk_wake;
+pthread_t disk_tid;
+
+const struct card_uid no_card = {0};
+
+long long now_ms(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/*
+ * Parse a key reference such as "A0" or "B12" into key type and slot.
+ */
+int parse_keyref(const char *ref, struct ipc_msg *msg)
+{
+    unsigned int slot;
+    char extra;
+
+    if (sscanf(&ref[1], "%u%c", &slot, &extra) != 1 || slot >= KEY_SLOTS)
+        return -1;
+
+    if (ref[0] == 'A' || ref[0] == 'a') {
+        msg->key_type = KEY_A;
+    } else if (ref[0] == 'B' || ref[0] == 'b') {
+        msg->key_type = KEY_B;
+    } else {
+        return -1;
+    }
+    msg->key_slot = slot;
+    return 0;
+}
+
+int parse_hex(const char *hex, uint8_t *data, int len)
+{
+    int i;
+
+    if (strlen(hex) != len * 2)
+        return -1;
+    for (i=0; i<len; i++) {
+        if (sscanf(&hex[i * 2], "%2hhx", &data[i]) != 1)
+            return -1;
+    }
+    return 0;
+}
+
+char *format_hex(char *out, const uint8_t *data, int len)
+{
+    int i;
+
+    for (i=0; i<len; i++) {
+        out += sprintf(out, "%02hhx", data[i]);
+    }
+    return out;
+}
+
+int card_same(const struct card_uid *a, const struct card_uid *b)
+{
+    return a->len == b->len && memcmp(a->uid, b->uid, a->len) == 0;
+}
+
+/*
+ * Publish presence changes to local consumers through the shared
+ * memory ring, independent of any socket client waiting.
+ */
+void publish_tap(int reader, const struct card_uid *card, const struct card_uid *prev_card)
+{
+    struct tap_event ev;
+
+    if (taps == NULL || card_same(card, prev_card))
+        return;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.reader = reader;
+    if (card->len) {
+        ev.type = TAP_CARD_PRESENT;
+        ev.uid_len = card->len;
+        memcpy(ev.uid, card->uid, card->len);
+    } else {
+        ev.type = TAP_CARD_REMOVED;
+        ev.uid_len = prev_card->len;
+        memcpy(ev.uid, prev_card->uid, prev_card->len);
+    }
+    tap_ring_publish(taps, &ev);
+}
+
+/*
+ * Disk writes of the RFID process, journal records and the reader
+ * snapshot, are done by a thread at normal priority. The poll loop only
+ * queues them, so a slow disk never holds it up, even under -r.
+ */
+
+void *disk_thread(void *arg)
+{
+    static struct disk_record recs[DISK_QUEUE_MAX];
+    static struct snapshot_reader snap[MAX_READERS];
+    struct timespec until;
+    int i, count, snap_count, stopping;
+
+    pthread_mutex_lock(&disk_lock);
+    for (;;) {
+        /* Wake up now and then to sync what was appended */
+        if (disk_count == 0 && disk_snap_count == -1 && !disk_stopping) {
+            clock_gettime(CLOCK_MONOTONIC, &until);
+            until.tv_sec += JOURNAL_SYNC_MS / 1000;
+            until.tv_nsec += (JOURNAL_SYNC_MS % 1000) * 1000000;
+            if (until.tv_nsec >= 1000000000) {
+                until.tv_sec++;
+                until.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&disk_wake, &disk_lock, &until);
+        }
+
+        count = disk_count;
+        memcpy(recs, disk_queue, count * sizeof(recs[0]));
+        disk_count = 0;
+        snap_count = disk_snap_count;
+        if (snap_count > 0) {
+            memcpy(snap, disk_snap, snap_count * sizeof(snap[0]));
+        }
+        disk_snap_count = -1;
+        stopping = disk_stopping;
+        pthread_mutex_unlock(&disk_lock);
+
+        for (i=0; i<count; i++) {
+            journal_append(journal, recs[i].time, recs[i].reader, recs[i].result,
+                           recs[i].card.uid, recs[i].card.len);
+        }
+        if (journal != NULL) {
+            journal_sync(journal, now_ms(), stopping);
+        }
+        if (snap_count >= 0) {
+            snapshot_save(snapshot_path, snap, snap_count);
+        }
+
+        pthread_mutex_lock(&disk_lock);
+        if (stopping && disk_count == 0 && disk_snap_count == -1)
+            break;
+    }
+    pthread_mutex_unlock(&disk_lock);
+    return NULL;
+}
+
+/*
+ * Start the disk thread if there is a journal or a snapshot to write.
+ * Call before realtime_start(), the thread keeps the priority it starts
+ * with.
+ */
+void disk_start(void)
+{
+    pthread_mutexattr_t ma;
+    pthread_condattr_t ca;
+
+    if (journal == NULL && snapshot_path == NULL)
+        return;
+
+    /* The poll loop may wait for the lock, so lend it its priority */
+    pthread_mutexattr_init(&ma);
+    pthread_mutexattr_setprotocol(&ma, PTHREAD_PRIO_INHERIT);
+    pthread_mutex_init(&disk_lock, &ma);
+    pthread_mutexattr_destroy(&ma);
+    pthread_condattr_init(&ca);
+    pthread_condattr_setclock(&ca, CLOCK_MONOTONIC);
+    pthread_cond_init(&disk_wake, &ca);
+    pthread_condattr_destroy(&ca);
+
+    if (pthread_create(&disk_tid, NULL, disk_thread, NULL) != 0) {
+        fprintf(stderr, "RFID: Could not start the disk thread.\n");
+        exit(EXIT_FAILURE);
+    }
+    disk_started = 1;
+}
+
+/*
+ * Write out everything queued and stop the disk thread.
+ */
+void disk_stop(void)
+{
+    if (!disk_started)
+        return;
+
+    pthread_mutex_lock(&disk_lock);
+    disk_stopping = 1;
+    pthread_cond_signal(&disk_wake);
+    pthread_mutex_unlock(&disk_lock);
+    pthread_join(disk_tid, NULL);
+    disk_started = 0;
+}
+
+/*
+ * Record a tap in the journal, if there is one.
+ */
+void journal_tap(int reader, const struct card_uid *card, uint8_t result)
+{
+    struct disk_record *rec;
+    struct timespec now;
+
+    if (journal == NULL || !disk_started)
+        return;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    pthread_mutex_lock(&disk_lock);
+    if (disk_count == DISK_QUEUE_MAX) {
+        fprintf(stderr, "RFID: Disk behind, dropping a journal record.\n");
+    } else {
+        rec = &disk_queue[disk_count++];
+        rec->time = (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+        rec->reader = reader;
+        rec->result = result;
+        rec->card = *card;
+        pthread_cond_signal(&disk_wake);
+    }
+    pthread_mutex_unlock(&disk_lock);
+}
+
+/*
+ * Clients waiting for a card are served in the order they asked. A
+ * card session holds only its own reader, taps on the other readers
+ * still go to the next waiter.
+ */
+
+void waiter_add(uint16_t client)
+{
+    int i;
+
+    for (i=0; i<waiter_count; i++) {
+        if (waiters[i] == client)
+            return;
+    }
+    if (waiter_count < MAX_CLIENTS) {
+        waiters[waiter_count++] = client;
+    }
+}
+
+void waiter_remove(uint16_t client)
+{
+    int i;
+
+    for (i=0; i<waiter_count; i++) {
+        if (waiters[i] == client) {
+            memmove(&waiters[i], &waiters[i + 1], (waiter_count - i - 1) * sizeof(waiters[0]));
+            waiter_count--;
+            return;
+        }
+    }
+}
+
+/*
+ * Return the port of 'r', remembering it as the reader to drop if the
+ * command about to be sent fails.
+ */
+int reader_fd(struct rfid_reader *r)
+{
+    current_reader = r;
+    if (r->bus != NULL) {
+        bus_address(r->bus, r->bus_node);
+    }
+    return r->fd;
+}
+
+/*
+ * Readers in a group share one scope for deduplication, so a card is
+ * taken once by whichever reader of the group sees it first. Others
+ * have a scope of their own.
+ */
+void reader_set_scope(struct rfid_reader *r)
+{
+    int i, j;
+
+    r->scope = r - readers;
+    for (i=0; i<group_count; i++) {
+        for (j=0; j<group_specs[i].count; j++) {
+            if (memcmp(group_specs[i].dev_ids[j], r->dev_id, 2) == 0)
+                r->scope = MAX_READERS + i;
+        }
+    }
+}
+
+struct rfid_reader *reader_get(int index)
+{
+    if (index >= reader_count || readers[index].fd == -1)
+        return NULL;
+    return &readers[index];
+}
+
+/*
+ * Switch the port of a new reader to low-latency mode, timing round
+ * trips before and after.
+ */
+void reader_tune(struct rfid_reader *r)
+{
+    struct rf_rtt before, after;
+    jmp_buf env, *outer;
+    int set;
+
+    outer = rf_set_error_jmp(&env);
+    if (setjmp(env) == 0) {
+        rf_measure_rtt(reader_fd(r), RTT_ROUNDS, &before);
+        set = rf_set_low_latency(r->fd);
+        rf_measure_rtt(r->fd, RTT_ROUNDS, &after);
+        printf("RFID: Reader %d low latency%s%s%s, round trip %ld us -> %ld us (max %ld us).\n",
+               (int)(r - readers), (set & RF_LL_SERIAL) ? " serial" : "",
+               (set & RF_LL_TIMER) ? " timer" : "", (set & RF_LL_FRAMED) ? " framed" : "",
+               before.avg_us, after.avg_us, after.max_us);
+    } else {
+        fprintf(stderr, "RFID: Reader %d failed the round trip test.\n", (int)(r - readers));
+    }
+    rf_set_error_jmp(outer);
+}
+
+/*
+ * Raise a reader on its own port to 115200 baud.
+ */
+void reader_speed_up(struct rfid_reader *r)
+{
+    jmp_buf env, *outer;
+
+    outer = rf_set_error_jmp(&env);
+    if (setjmp(env) == 0) {
+        if (rf_init_com(reader_fd(r), BAUD_115200) == 0) {
+            r->baud = BAUD_115200;
+            printf("RFID: Reader %d now at 115200 baud.\n", (int)(r - readers));
+        }
+    } else {
+        fprintf(stderr, "RFID: Reader %d did not change speed.\n", (int)(r - readers));
+    }
+    rf_set_error_jmp(outer);
+}
+
+/*
+ * Save what is known about the readers on their own ports, through the
+ * disk thread. Bus readers come from the command line each time.
+ */
+void snapshot_write(void)
+{
+    struct snapshot_reader snap[MAX_READERS];
+    struct rfid_reader *r;
+    int i, count = 0;
+
+    if (snapshot_path == NULL || !disk_started)
+        return;
+
+    for (i=0; i<reader_count; i++) {
+        r = &readers[i];
+        if (r->bus != NULL || r->model[0] == '\0')
+            continue;
+        snap[count].index = i;
+        memcpy(snap[count].path, r->path, sizeof(r->path));
+        snap[count].baud = r->baud;
+        memcpy(snap[count].dev_id, r->dev_id, sizeof(r->dev_id));
+        memcpy(snap[count].model, r->model, sizeof(r->model));
+        snap[count].polls = r->polls;
+        snap[count].taps = r->taps;
+        count++;
+    }
+
+    pthread_mutex_lock(&disk_lock);
+    memcpy(disk_snap, snap, count * sizeof(snap[0]));
+    disk_snap_count = count;
+    pthread_cond_signal(&disk_wake);
+    pthread_mutex_unlock(&disk_lock);
+}
+
+/*
+ * Load the snapshot of the last run. Its readers get their numbers and
+ * stats back, and discovery gets hints to check them quickly.
+ *
+ * Returns the number of hints.
+ */
+int snapshot_restore(struct discovery_hint *hints)
+{
+    struct snapshot_reader snap[MAX_READERS];
+    struct rfid_reader *r;
+    int i, n, count = 0;
+
+    if (snapshot_path == NULL)
+        return 0;
+
+    n = snapshot_load(snapshot_path, snap, MAX_READERS);
+    for (i=0; i<n; i++) {
+        if (snap[i].index >= MAX_READERS ||
+                (snap[i].index < reader_count && readers[snap[i].index].bus != NULL))
+            continue;
+
+        r = &readers[snap[i].index];
+        memset(r, 0, sizeof(*r));
+        r->fd = -1;
+        memcpy(r->path, snap[i].path, sizeof(r->path));
+        r->baud = snap[i].baud;
+        memcpy(r->dev_id, snap[i].dev_id, sizeof(r->dev_id));
+        memcpy(r->model, snap[i].model, sizeof(r->model));
+        r->polls = snap[i].polls;
+        r->taps = snap[i].taps;
+
+        memcpy(hints[count].path, r->path, sizeof(r->path));
+        hints[count].baud = r->baud;
+        memcpy(hints[count].dev_id, r->dev_id, sizeof(r->dev_id));
+        memcpy(hints[count].model, r->model, sizeof(r->model));
+        count++;
+    }
+
+    /* Slots in between stay free for new readers */
+    for (i=0; i<n; i++) {
+        if (snap[i].index < MAX_READERS && snap[i].index >= reader_count) {
+            while (reader_count < snap[i].index)
+                readers[reader_count++].fd = -1;
+            reader_count = snap[i].index + 1;
+        }
+    }
+
+    return count;
+}
+
+/*
+ * Take over a port found by discovery. A reader seen before gets its
+ * old number back: by its port, which with /dev/serial/by-id paths
+ * follows the adapter, or else by device ID if its old port is gone.
+ * SL500s all leave the factory as device 0000, so the ID alone would
+ * mix up readers of the same model.
+ */
+void reader_attach(struct discovery_event *ev)
+{
+    struct rfid_reader *r = NULL;
+    unsigned long polls = 0, taps = 0;
+    int i, known;
+
+    for (i=0; i<reader_count && r == NULL; i++) {
+        if (readers[i].fd == -1 && readers[i].bus == NULL &&
+                strcmp(readers[i].path, ev->path) == 0 &&
+                strcmp(readers[i].model, ev->model) == 0)
+            r = &readers[i];
+    }
+    for (i=0; i<reader_count && r == NULL; i++) {
+        if (readers[i].fd == -1 && readers[i].bus == NULL &&
+                memcmp(readers[i].dev_id, ev->dev_id, 2) == 0 &&
+                strcmp(readers[i].model, ev->model) == 0 &&
+                access(readers[i].path, F_OK) == -1)
+            r = &readers[i];
+    }
+    known = (r != NULL);
+    if (r == NULL && reader_count < MAX_READERS)
+        r = &readers[reader_count++];
+    for (i=0; i<reader_count && r == NULL; i++) {
+        if (readers[i].fd == -1 && readers[i].bus == NULL)
+            r = &readers[i];
+    }
+    if (r == NULL) {
+        fprintf(stderr, "RFID: Too many readers, ignoring %s.\n", ev->path);
+        close(ev->fd);
+        return;
+    }
+
+    /* The same reader back again keeps its stats */
+    if (known) {
+        polls = r->polls;
+        taps = r->taps;
+    }
+
+    memset(r, 0, sizeof(*r));
+    r->fd = ev->fd;
+    r->baud = ev->baud;
+    r->polls = polls;
+    r->taps = taps;
+    memcpy(r->path, ev->path, sizeof(r->path));
+    memcpy(r->dev_id, ev->dev_id, sizeof(r->dev_id));
+    memcpy(r->model, ev->model, sizeof(r->model));
+    reader_set_scope(r);
+    printf("RFID: Reader %d (%s, device %02hhx%02hhx) attached on %s.\n",
+           (int)(r - readers), r->model, r->dev_id[0], r->dev_id[1], r->path);
+
+    if (fast_baud && r->baud != BAUD_115200) {
+        reader_speed_up(r);
+    }
+    if (low_latency) {
+        reader_tune(r);
+    }
+    snapshot_write();
+}
+
+/*
+ * Drop a reader that was unplugged or stopped answering. Nothing more is
+ * sent to it; a card session on it just ends.
+ */
+void reader_detach(struct rfid_reader *r)
+{
+    int index = r - readers;
+
+    printf("RFID: Reader %d detached from %s.\n", index, r->path);
+
+    if (r->session_client != 0) {
+        rf_session_reset(&r->card);
+        r->session_client = 0;
+    }
+    if (r->found) {
+        r->found = 0;
+        card_found--;
+    }
+    publish_tap(index, &no_card, &r->reported);
+    if (r->reported.len) {
+        journal_tap(index, &r->reported, JOURNAL_REMOVED);
+    }
+
+    if (r->bus != NULL) {
+        /* The line stays open for the others, the bus retries this one */
+        bus_set_online(r->bus, r->bus_node, 0, now_ms());
+    } else {
+        close(r->fd);
+    }
+    r->fd = -1;
+    r->uid.len = 0;
+    r->reported.len = 0;
+    r->pending = 0;
+    if (current_reader == r) {
+        current_reader = NULL;
+    }
+}
+
+/*
+ * Communication error on the current reader: detach it and let
+ * discovery probe the port again in case it recovers.
+ */
+void reader_lost(void)
+{
+    struct rfid_reader *r = current_reader;
+
+    if (r == NULL || r->fd == -1)
+        return;
+
+    fprintf(stderr, "RFID: Reader %d on %s stopped answering.\n", (int)(r - readers), r->path);
+    if (r->bus == NULL && discovery != NULL) {
+        discovery_forget(discovery, r->path);
+    }
+    reader_detach(r);
+}
+
+/*
+ * Reader command queue. Commands run on the RFID thread when they are
+ * due, between polls, so a flash pattern or a handler's answer never
+ * makes the poll loop sleep. Workers post into 'inbox' and wake the
+ * loop through 'inbox_fd'.
+ */
+
+void cmd_queue_add(const struct reader_cmd *c)
+{
+    if (cmd_count == CMD_QUEUE_MAX) {
+        fprintf(stderr, "RFID: Command queue full, dropping a command.\n");
+        return;
+    }
+    cmd_queue[cmd_count++] = *c;
+}
+
+/*
+ * Queue 'c' from a worker, waiting for room if the loop is behind.
+ */
+void reader_post(const struct reader_cmd *c)
+{
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&inbox_lock);
+    while (inbox_count == CMD_QUEUE_MAX)
+        pthread_cond_wait(&inbox_room, &inbox_lock);
+    inbox[inbox_count++] = *c;
+    pthread_mutex_unlock(&inbox_lock);
+
+    write(inbox_fd, &one, sizeof(one));
+}
+
+/*
+ * Write a block of the card a handler was run for. Goes through the
+ * card session of the reader when it has that card selected, otherwise
+ * selects it, and fails if another card has taken its place.
+ */
+uint8_t cmd_write_block(struct rfid_reader *r, struct reader_cmd *c)
+{
+    struct rf_session own, *s = &r->card;
+    uint8_t *key = keys_get(c->key_slot);
+    uint8_t status;
+
+    if (key == NULL)
+        return IPC_ERR_NO_KEY;
+    if (c->card.len != sizeof(s->uid))
+        return IPC_ERR_NO_CARD;         // Not a MIFARE Classic card
+
+    reader_fd(r);
+    if (r->session_client == 0 || memcmp(r->card.uid, c->card.uid, sizeof(r->card.uid)) != 0) {
+        s = &own;
+        rf_session_init(s, r->fd);
+        memcpy(s->uid, c->card.uid, sizeof(s->uid));
+    }
+
+    status = rf_session_auth(s, c->key_type, c->arg, key);
+    if (status == 0)
+        status = sector_cache_write(cache, s, c->arg, c->data);
+    return status;
+}
+
+void cmd_run(struct reader_cmd *c)
+{
+    struct rfid_reader *r = reader_get(c->reader);
+    jmp_buf env, *outer;
+    uint8_t status;
+    int failed = 0;
+
+    if (r == NULL)
+        return;
+
+    outer = rf_set_error_jmp(&env);
+    if (setjmp(env) == 0) {
+        if (c->cmd == CMD_BEEP) {
+            rf_beep(reader_fd(r), c->arg);
+        } else if (c->cmd == CMD_LIGHT) {
+            rf_light(reader_fd(r), c->arg);
+        } else {
+            status = cmd_write_block(r, c);
+            if (status != 0) {
+                fprintf(stderr, "RFID: Handler write of block %u on reader %u failed, status %u.\n",
+                        c->arg, c->reader, status);
+            }
+        }
+    } else {
+        failed = 1;
+    }
+    rf_set_error_jmp(outer);
+
+    if (failed) {
+        reader_lost();
+    }
+}
+
+/*
+ * Take what the workers posted and run the commands that are due.
+ * Commands for bus readers stay queued for cmd_run_slot(), the line is
+ * only theirs in a poll slot. Returns when the next other command is
+ * due, or -1 if none is queued.
+ */
+long long cmd_queue_run(long long now)
+{
+    struct rfid_reader *r;
+    struct reader_cmd *c;
+    long long next = -1;
+    uint64_t count;
+    int i, n = 0;
+
+    if (inbox_fd != -1 && read(inbox_fd, &count, sizeof(count)) > 0) {
+        pthread_mutex_lock(&inbox_lock);
+        for (i=0; i<inbox_count; i++) {
+            if (inbox[i].job != NULL) {
+                /* Handler done, its job goes back to the pool */
+                pool_put(job_pool, inbox[i].job);
+            } else {
+                cmd_queue_add(&inbox[i]);
+            }
+        }
+        inbox_count = 0;
+        pthread_cond_broadcast(&inbox_room);
+        pthread_mutex_unlock(&inbox_lock);
+    }
+
+    /* In the order queued, so equal times keep their order */
+    for (i=0; i<cmd_count; i++) {
+        c = &cmd_queue[i];
+        r = reader_get(c->reader);
+        if (r != NULL && r->bus != NULL) {
+            cmd_queue[n++] = *c;
+            continue;
+        }
+        if (c->at <= now) {
+            cmd_run(c);
+            continue;
+        }
+        if (next == -1 || c->at < next)
+            next = c->at;
+        cmd_queue[n++] = *c;
+    }
+    cmd_count = n;
+
+    return next;
+}
+
+/*
+ * Run the oldest due command for bus reader 'r' in its poll slot. One
+ * per slot, so that a handler cannot stretch the slot.
+ */
+void cmd_run_slot(struct rfid_reader *r, long long now)
+{
+    int i;
+
+    for (i=0; i<cmd_count; i++) {
+        if (cmd_queue[i].reader == r - readers && cmd_queue[i].at <= now) {
+            cmd_run(&cmd_queue[i]);
+            memmove(&cmd_queue[i], &cmd_queue[i + 1], (cmd_count - i - 1) * sizeof(cmd_queue[0]));
+            cmd_count--;
+            return;
+        }
+    }
+}
+
+/*
+ * Flash the LED of 'r' a few times, without waiting for it.
+ */
+void reader_flash(struct rfid_reader *r)
+{
+    struct reader_cmd c = {0};
+    long long now = now_ms();
+    int i;
+
+    c.reader = r - readers;
+    c.cmd = CMD_LIGHT;
+    for (i=0; i<FLASH_COUNT; i++) {
+        c.at = now + i * POLL_INTERVAL_MS;
+        c.arg = LED_GREEN;
+        cmd_queue_add(&c);
+        c.at += FLASH_MS;
+        c.arg = LED_OFF;
+        cmd_queue_add(&c);
+    }
+    r->flash_until = c.at + FLASH_MS;
+}
+
+/*
+ * Tap handler, run on a worker: the program given with -x gets the
+ * reader and the card, and may answer with reader commands on its
+ * output, one per line:
+ *
+ *     beep <time in 10 ms>
+ *     light <color> [delay ms]
+ *     write <block> <key ref> <32 hex digits>
+ *
+ * A write goes to the card tapped, in the reader's turn like the rest.
+ */
+void tap_hook_run(void *arg)
+{
+    struct tap_job *job = arg;
+    struct reader_cmd c = {0};
+    struct ipc_msg key;
+    char cmdline[300], line[80], keyref[10], hex[40], uid[RF_UL_UID_LEN * 2 + 1];
+    unsigned int val, delay;
+    FILE *out;
+
+    format_hex(uid, job->card.uid, job->card.len);
+    snprintf(cmdline, sizeof(cmdline), "%s %d %s", tap_hook_cmd, job->reader, uid);
+
+    out = popen(cmdline, "r");
+    if (out == NULL) {
+        perror("popen");
+    }
+    while (out != NULL && fgets(line, sizeof(line), out) != NULL) {
+        c.reader = job->reader;
+        c.at = now_ms();
+        delay = 0;
+        if (sscanf(line, "beep %u", &val) == 1 && val <= 0xff) {
+            c.cmd = CMD_BEEP;
+        } else if (sscanf(line, "light %u %u", &val, &delay) >= 1 &&
+                val <= (LED_RED|LED_GREEN)) {
+            c.cmd = CMD_LIGHT;
+        } else if (sscanf(line, "write %u %9s %39s", &val, keyref, hex) == 3 &&
+                val <= 0xff && parse_keyref(keyref, &key) == 0 &&
+                parse_hex(hex, c.data, 16) == 0) {
+            c.cmd = CMD_WRITE_BLOCK;
+            c.key_type = key.key_type;
+            c.key_slot = key.key_slot;
+            c.card = job->card;
+        } else {
+            continue;
+        }
+        c.arg = val;
+        c.at += delay;
+        reader_post(&c);
+    }
+    if (out != NULL) {
+        pclose(out);
+    }
+
+    memset(&c, 0, sizeof(c));
+    c.job = job;
+    reader_post(&c);
+}
+
+void tap_hook(int reader, const struct card_uid *card)
+{
+    struct tap_job *job;
+
+    if (workers == NULL)
+        return;
+
+    job = pool_get(job_pool);
+    if (job == NULL) {
+        fprintf(stderr, "RFID: Tap handlers behind, skipping a tap.\n");
+        return;
+    }
+    job->reader = reader;
+    job->card = *card;
+    if (workpool_submit(workers, reader, tap_hook_run, job) == -1) {
+        pool_put(job_pool, job);
+    }
+}
+
+void poll_card(struct rfid_reader *r)
+{
+    int index = r - readers;
+    unsigned int card_no;
+    uint8_t atqa[2];
+
+    /* Look for card, the answer to request tells a 7 byte UID */
+    r->polls++;
+    r->uid.len = 0;
+    if (rf_request_type(reader_fd(r), atqa) == 0) {
+        if (RF_ATQA_DOUBLE_UID(atqa)) {
+            if (rf_ul_select(r->fd, r->uid.uid) == 0)
+                r->uid.len = RF_UL_UID_LEN;
+        } else if (rf_anticoll(r->fd, &card_no) == 0 && card_no != 0) {
+            memcpy(r->uid.uid, &card_no, sizeof(card_no));
+            r->uid.len = sizeof(card_no);
+        }
+    }
+
+    if (r->reported.len && !card_same(&r->uid, &r->reported)) {
+        publish_tap(index, &no_card, &r->reported);
+        journal_tap(index, &r->reported, JOURNAL_REMOVED);
+        r->reported.len = 0;
+        r->pending = 0;
+    }
+
+    /* Every sighting extends the window, a resting card is one tap */
+    if (r->uid.len && dedup_check(dedup, r->uid.uid, r->uid.len, r->scope, now_ms())) {
+        publish_tap(index, &r->uid, &r->reported);
+        if (!card_same(&r->uid, &r->reported)) {
+            journal_tap(index, &r->uid, JOURNAL_TAP);
+            tap_hook(index, &r->uid);
+            r->taps++;
+        }
+        r->reported = r->uid;
+        r->pending = 1;
+    }
+
+    if (r->pending && card_found < waiter_count && r->session_client == 0) {
+        r->pending = 0;
+        r->found = 1;
+        card_found++;
+
+        if (flash_on_found) {
+            rf_beep(r->fd, 10);
+            reader_flash(r);
+        }
+    }
+}
+
+void poll_led(struct rfid_reader *r, unsigned int count)
+{
+    /* The quick flashes of a found card run from the command queue */
+    if (now_ms() < r->flash_until)
+        return;
+
+    /* Blink green LED 200 ms every 2 s */
+    if (count % 20 == 0) {
+        rf_light(reader_fd(r), LED_GREEN);
+    }
+    if (count % 20 == 2) {
+        rf_light(reader_fd(r), LED_OFF);
+    }
+}
+
+struct rfid_reader *bus_reader(struct bus *b, int node)
+{
+    int i;
+
+    for (i=0; i<reader_count; i++) {
+        if (readers[i].bus == b && readers[i].bus_node == node)
+            return &readers[i];
+    }
+    return NULL;
+}
+
+/*
+ * See if a bus reader that is offline answers again. A missing reader
+ * only costs one answer timeout, the rest of the tick goes on.
+ */
+void bus_probe(struct rfid_reader *r)
+{
+    jmp_buf env, *outer;
+    uint8_t dev_id[2];
+
+    outer = rf_set_error_jmp(&env);
+    if (setjmp(env) == 0) {
+        reader_fd(r);
+        if (rf_get_device_number(r->bus->fd, dev_id) == 0) {
+            rf_light(r->bus->fd, LED_OFF);
+            r->fd = r->bus->fd;
+            bus_set_online(r->bus, r->bus_node, 1, now_ms());
+            printf("RFID: Reader %d (device %02hhx%02hhx) attached on %s.\n",
+                   (int)(r - readers), r->dev_id[0], r->dev_id[1], r->bus->path);
+        }
+    }
+    rf_set_error_jmp(outer);
+}
+
+/*
+ * Hand out the poll slots of one tick on a bus. Each reader gets at most
+ * one slot per tick, the scheduler decides who when there are more
+ * readers than slots. A reader that fails is taken offline and the
+ * slot goes to the next one.
+ */
+void poll_bus(struct bus *b)
+{
+    struct rfid_reader *r;
+    long long now = now_ms();
+    jmp_buf env, *outer;
+    uint32_t skip = 0;
+    int i, slot, node, failed;
+
+    /* Session readers are busy with their client's commands */
+    for (i=0; i<reader_count; i++) {
+        if (readers[i].bus == b && readers[i].session_client != 0)
+            skip |= 1u << readers[i].bus_node;
+    }
+
+    for (slot=0; slot<BUS_POLL_SLOTS; slot++) {
+        node = bus_next(b, now, skip);
+        if (node == -1)
+            break;
+        skip |= 1u << node;
+
+        r = bus_reader(b, node);
+        if (!b->nodes[node].online) {
+            bus_probe(r);
+            continue;
+        }
+
+        failed = 0;
+        outer = rf_set_error_jmp(&env);
+        if (setjmp(env) == 0) {
+            poll_card(r);
+            bus_report(b, node, now, r->uid.len != 0);
+            cmd_run_slot(r, now);
+        } else {
+            failed = 1;
+        }
+        rf_set_error_jmp(outer);
+
+        if (failed) {
+            reader_lost();
+        }
+    }
+}
+
+/*
+ * Poll every reader once. Each has a jump point of its own, so a reader
+ * that fails is detached and the rest are still polled this tick.
+ */
+void poll_loop()
+{
+    static unsigned int count = 0;
+    struct rfid_reader *r;
+    jmp_buf env, *outer;
+    int i, failed;
+
+    for (i=0; i<reader_count; i++) {
+        r = &readers[i];
+        if (r->fd == -1)
+            continue;
+
+        failed = 0;
+        outer = rf_set_error_jmp(&env);
+        if (setjmp(env) == 0) {
+            /* Bus readers only get the line in their poll slots */
+            if (r->bus == NULL && count % 2 == 0 &&
+                    r->session_client == 0) {
+                poll_card(r);
+            }
+            if (r->bus == NULL) {
+                poll_led(r, count);
+            }
+        } else {
+            failed = 1;
+        }
+        rf_set_error_jmp(outer);
+
+        if (failed) {
+            reader_lost();
+        }
+    }
+
+    for (i=0; i<bus_count; i++) {
+        poll_bus(buses[i]);
+    }
+
+    count++;
+}
+
+/*
+ * Open the buses given with -b. Their readers get fixed numbers and
+ * come online on their first answer.
+ */
+void bus_start(void)
+{
+    struct rfid_reader *r;
+    int i, j, node;
+
+    for (i=0; i<bus_count; i++) {
+        buses[i] = bus_open(bus_specs[i].path);
+        if (buses[i] == NULL) {
+            exit(EXIT_FAILURE);
+        }
+        /* The readers may not be up yet, so there are no timings here */
+        if (low_latency && rf_set_low_latency(buses[i]->fd) == -1) {
+            fprintf(stderr, "RFID: No low latency mode on %s.\n", buses[i]->path);
+        }
+        for (j=0; j<bus_specs[i].count && reader_count<MAX_READERS; j++) {
+            node = bus_add(buses[i], bus_specs[i].dev_ids[j]);
+            r = &readers[reader_count++];
+            memset(r, 0, sizeof(*r));
+            r->fd = -1;
+            r->bus = buses[i];
+            r->bus_node = node;
+            memcpy(r->dev_id, bus_specs[i].dev_ids[j], sizeof(r->dev_id));
+            reader_set_scope(r);
+            snprintf(r->path, sizeof(r->path), "%s#%02hhx%02hhx", bus_specs[i].path,
+                     r->dev_id[0], r->dev_id[1]);
+        }
+    }
+}
+
+/*
+ * Replies from the RFID process are collected here and sent in batches
+ * when the current round of the event loop is done. What the socket
+ * does not take waits for POLLOUT; no more commands are read while the
+ * queue is short of OUTBOX_ROOM.
+ */
+struct outbox {
+    struct ipc_queue q;
+    struct ipc_msg *last;               // Last reply to the current command
+};
+
+void outbox_flush(struct outbox *ob)
+{
+    if (ipc_queue_flush(&ob->q) == -1) {
+        exit(EXIT_FAILURE);
+    }
+}
+
+struct ipc_msg *outbox_reply(struct outbox *ob, struct ipc_msg *req, uint8_t cmd)
+{
+    struct ipc_msg *reply;
+
+    reply = ipc_queue_add(&ob->q);
+    if (reply == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    ob->last = reply;
+    memset(reply, 0, IPC_HDR_SIZE);
+    reply->cmd = cmd;
+    if (req != NULL) {
+        reply->client = req->client;
+        reply->reader = req->reader;
+        reply->arg = req->arg;
+    }
+    return reply;
+}
+
+/*
+ * Card session: the card reported with the last CMD_CARD_DETECTED stays
+ * selected so that card commands from the client run straight away,
+ * without another request/anticoll/select round. Each reader has its
+ * own session and a client at most one.
+ */
+
+void session_start(struct rfid_reader *r, uint16_t client)
+{
+    uint8_t capacity;
+
+    /* Card commands are for MIFARE Classic, a 4 byte UID */
+    rf_session_init(&r->card, reader_fd(r));
+    if (r->uid.len == sizeof(r->card.uid) &&
+            rf_select(r->fd, r->uid.len, r->uid.uid, &capacity) == 0) {
+        rf_session_adopt(&r->card, r->uid.uid, capacity);
+        r->session_client = client;
+        r->session_deadline = now_ms() + SESSION_TIMEOUT_MS;
+    }
+}
+
+void session_end(struct rfid_reader *r)
+{
+    if (r->session_client != 0) {
+        r->session_client = 0;
+        reader_fd(r);
+        rf_session_halt(&r->card);
+    }
+}
+
+/*
+ * Return the reader 'client' has a card session on, or NULL.
+ */
+struct rfid_reader *session_find(uint16_t client)
+{
+    int i;
+
+    for (i=0; i<reader_count; i++) {
+        if (readers[i].session_client == client && readers[i].fd != -1)
+            return &readers[i];
+    }
+    return NULL;
+}
+
+/*
+ * Find the card session of the client of 'msg' and look up its key.
+ */
+uint8_t session_key(struct ipc_msg *msg, struct rfid_reader **r, uint8_t **key)
+{
+    *r = session_find(msg->client);
+    if (*r == NULL)
+        return IPC_ERR_NO_CARD;
+    reader_fd(*r);
+
+    *key = keys_get(msg->key_slot);
+    if (*key == NULL)
+        return IPC_ERR_NO_KEY;
+
+    (*r)->session_deadline = now_ms() + SESSION_TIMEOUT_MS;
+    return 0;
+}
+
+uint8_t session_read_block(struct ipc_msg *msg, uint8_t block, uint8_t *data)
+{
+    struct rfid_reader *r;
+    uint8_t sector_data[64];
+    uint8_t *key;
+    uint8_t status;
+    int sector = rf_M1_block_sector(block);
+
+    status = session_key(msg, &r, &key);
+    if (status != 0)
+        return status;
+
+    status = rf_session_auth(&r->card, msg->key_type, block, key);
+    if (status != 0)
+        return status;
+
+    if (sector_cache_lookup(cache, r->card.uid, sector, sector_data)) {
+        memcpy(data, &sector_data[(block - rf_M1_sector_block(sector)) * 16], 16);
+        return 0;
+    }
+    return rf_session_read(&r->card, block, data);
+}
+
+uint8_t session_write_block(struct ipc_msg *msg, uint8_t block, uint8_t *data)
+{
+    struct rfid_reader *r;
+    uint8_t *key;
+    uint8_t status;
+
+    status = session_key(msg, &r, &key);
+    if (status == 0)
+        status = rf_session_auth(&r->card, msg->key_type, block, key);
+    if (status == 0)
+        status = sector_cache_write(cache, &r->card, block, data);
+    return status;
+}
+
+/*
+ * Read all blocks of 'sector' into 'data', which must hold 16 blocks.
+ * Returns the reader status and the number of bytes read in 'len'.
+ */
+uint8_t session_read_sector(struct ipc_msg *msg, int sector, uint8_t *data, uint16_t *len)
+{
+    struct rfid_reader *r;
+    uint8_t *key;
+    uint8_t status;
+
+    *len = 0;
+    status = session_key(msg, &r, &key);
+    if (status != 0)
+        return status;
+
+    if (sector >= rf_M1_sectors(r->card.capacity))
+        return IPC_ERR_RANGE;
+
+    return sector_cache_read(cache, &r->card, msg->key_type, key, sector, data, len);
+}
+
+/*
+ * Handle a command from the network process, queueing any replies.
+ */
+void rfid_handle(struct ipc_msg *msg, struct outbox *ob)
+{
+    struct rfid_reader *r;
+    struct ipc_msg *reply;
+    int sector, sectors;
+
+    switch (msg->cmd) {
+        case CMD_WAIT_FOR_CARD:
+            printf("RFID: Received CMD_WAIT_FOR_CARD.\n");
+            r = session_find(msg->client);
+            if (r != NULL) {
+                session_end(r);
+            }
+            waiter_add(msg->client);
+            /* Answered with CMD_CARD_DETECTED from the poll loop */
+            break;
+        case CMD_CARD_ACK:
+            waiter_remove(msg->client);
+            r = session_find(msg->client);
+            if (r != NULL) {
+                session_end(r);
+            }
+            reply = outbox_reply(ob, msg, CMD_RESULT);
+            break;
+        case CMD_CARD_LOST:
+            /* Not a newer session the client did get */
+            r = session_find(msg->client);
+            if (r != NULL && r - readers == msg->reader) {
+                session_end(r);
+            }
+            break;
+        case CMD_BEEP:
+            reply = outbox_reply(ob, msg, CMD_RESULT);
+            r = reader_get(msg->reader);
+            reply->status = r ? rf_beep(reader_fd(r), msg->arg) : IPC_ERR_NO_READER;
+            break;
+        case CMD_LIGHT:
+            reply = outbox_reply(ob, msg, CMD_RESULT);
+            r = reader_get(msg->reader);
+            reply->status = r ? rf_light(reader_fd(r), msg->arg) : IPC_ERR_NO_READER;
+            break;
+        case CMD_READ_BLOCK:
+            reply = outbox_reply(ob, msg, CMD_BLOCK_DATA);
+            reply->status = session_read_block(msg, msg->arg, reply->data);
+            if (reply->status == 0)
+                reply->len = 16;
+            break;
+        case CMD_WRITE_BLOCK:
+            reply = outbox_reply(ob, msg, CMD_RESULT);
+            if (msg->len != 16) {
+                reply->status = IPC_ERR_RANGE;
+                break;
+            }
+            reply->status = session_write_block(msg, msg->arg, msg->data);
+            break;
+        case CMD_READ_SECTOR:
+            reply = outbox_reply(ob, msg, CMD_SECTOR_DATA);
+            reply->status = session_read_sector(msg, msg->arg, reply->data, &reply->len);
+            break;
+        case CMD_DUMP:
+            r = session_find(msg->client);
+            sectors = (r != NULL) ? rf_M1_sectors(r->card.capacity) : 0;
+            for (sector=0; sector<sectors; sector++) {
+                reply = outbox_reply(ob, msg, CMD_SECTOR_DATA);
+                reply->arg = sector;
+                reply->status = session_read_sector(msg, sector, reply->data, &reply->len);
+            }
+            reply = outbox_reply(ob, msg, CMD_DUMP_DONE);
+            if (sectors == 0)
+                reply->status = IPC_ERR_NO_CARD;
+            break;
+        default:
+            reply = outbox_reply(ob, msg, CMD_RESULT);
+            reply->status = IPC_ERR_UNKNOWN;
+            break;
+    }
+}
+
+/*
+ * Run one command from the network process. If a reader fails on the
+ * way it is detached, and the command is answered with
+ * IPC_ERR_NO_READER instead of taking the process down.
+ */
+void rfid_dispatch(struct ipc_msg *msg, struct outbox *ob)
+{
+    struct ipc_msg *reply;
+    jmp_buf env;
+
+    ob->last = NULL;
+    if (setjmp(env) == 0) {
+        rf_set_error_jmp(&env);
+        rfid_handle(msg, ob);
+        rf_set_error_jmp(NULL);
+        return;
+    }
+    rf_set_error_jmp(NULL);
+    reader_lost();
+
+    if (msg->cmd == CMD_WAIT_FOR_CARD || msg->cmd == CMD_CARD_LOST) {
+        /* The session that failed to end is gone, carry on without it */
+        rfid_handle(msg, ob);
+        return;
+    }
+    if (ob->last != NULL) {
+        ob->last->status = IPC_ERR_NO_READER;
+        ob->last->len = 0;
+    }
+    if (ob->last == NULL || msg->cmd == CMD_DUMP) {
+        reply = outbox_reply(ob, msg, msg->cmd == CMD_DUMP ? CMD_DUMP_DONE : CMD_RESULT);
+        reply->status = IPC_ERR_NO_READER;
+    }
+}
+
+/*
+ * Report a card found by the poll loop to the first waiting client and
+ * start its card session on the reader.
+ */
+void card_deliver(struct rfid_reader *r, struct outbox *ob)
+{
+    struct ipc_msg *reply;
+    int index = r - readers;
+    uint16_t client;
+    jmp_buf env, *outer;
+    int failed = 0;
+
+    r->found = 0;
+    card_found--;
+    if (waiter_count == 0) {
+        r->pending = 1;
+        return;
+    }
+
+    printf("RFID: Sending CMD_CARD_DETECTED.\n");
+    client = waiters[0];
+    waiter_remove(client);
+    reply = outbox_reply(ob, NULL, CMD_CARD_DETECTED);
+    reply->client = client;
+    reply->reader = index;
+    reply->len = r->uid.len;
+    memcpy(reply->data, r->uid.uid, r->uid.len);
+    journal_tap(index, &r->uid, JOURNAL_DELIVERED);
+
+    outer = rf_set_error_jmp(&env);
+    if (setjmp(env) == 0) {
+        session_start(r, client);
+    } else {
+        failed = 1;
+    }
+    rf_set_error_jmp(outer);
+
+    if (failed) {
+        reader_lost();
+    }
+}
+
+/*
+ * End the card sessions their clients let sit for too long.
+ */
+void session_expire(long long now)
+{
+    struct rfid_reader *r;
+    jmp_buf env, *outer;
+    int i, failed;
+
+    for (i=0; i<reader_count; i++) {
+        r = &readers[i];
+        if (r->session_client == 0 || now < r->session_deadline)
+            continue;
+
+        printf("RFID: Card session on reader %d timed out.\n", i);
+        failed = 0;
+        outer = rf_set_error_jmp(&env);
+        if (setjmp(env) == 0) {
+            session_end(r);
+        } else {
+            failed = 1;
+        }
+        rf_set_error_jmp(outer);
+
+        if (failed) {
+            reader_lost();
+        }
+    }
+}
+
+/*
+ * Poll the readers and report the cards found to the waiting clients.
+ * Runs every POLL_INTERVAL_MS. A reader that fails on the way is
+ * detached without holding up the others.
+ */
+void rfid_tick(struct outbox *ob, long long now)
+{
+    int i;
+
+    session_expire(now);
+
+    poll_loop();
+
+    for (i=0; i<reader_count && card_found > 0; i++) {
+        if (readers[i].found) {
+            card_deliver(&readers[i], ob);
+        }
+    }
+}
+
+void rfid_process(int ipc_fd)
+{
+    struct ipc_msg in[IPC_BATCH_MAX];
+    struct discovery_event ev;
+    struct rfid_reader *r;
+    static struct outbox ob;
+    struct pollfd pfd[3];
+    struct discovery_hint hints[DISCOVERY_HINTS_MAX];
+    long long next_tick, next_snapshot, next_cmd = -1, wake, now;
+    int hint_count;
+    int i, n;
+
+    ipc_queue_init(&ob.q, ipc_fd);
+
+    if (cache_enabled) {
+        cache = sector_cache_open(cache_path, SECTOR_CACHE_ENTRIES);
+        if (cache == NULL) {
+            fprintf(stderr, "RFID: Sector cache disabled.\n");
+        } else {
+            sector_cache_set_policy(cache, cache_ro_mask, cache_version_block);
+        }
+    }
+
+    dedup = dedup_create(dedup_window, DEDUP_ENTRIES);
+    if (dedup == NULL) {
+        fprintf(stderr, "RFID: Tap deduplication disabled.\n");
+    }
+
+    if (journal_dir != NULL) {
+        journal = journal_open(journal_dir, 1);
+        if (journal == NULL) {
+            fprintf(stderr, "RFID: Tap journal disabled.\n");
+        }
+    }
+    disk_start();
+
+    taps = tap_ring_create(TAP_RING_NAME, TAP_RING_SIZE);
+    if (taps == NULL) {
+        fprintf(stderr, "RFID: Card event ring disabled.\n");
+    }
+
+    bus_start();
+    hint_count = snapshot_restore(hints);
+
+    /* Readers come and go through discovery, there may be none yet */
+    if (device_glob != NULL) {
+        discovery = discovery_start(device_glob, hints, hint_count);
+        if (discovery == NULL) {
+            exit(EXIT_FAILURE);
+        }
+    }
 
-    CMD_CARD_DETECTED
-};
+    /* Tap handlers, started first so they keep normal priority */
+    if (tap_hook_cmd != NULL) {
+        workers = workpool_create(hook_threads, WORKPOOL_QUEUE);
+        job_pool = pool_create("jobs", sizeof(struct tap_job), hook_threads * WORKPOOL_QUEUE);
+        inbox_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (workers == NULL || job_pool == NULL || inbox_fd == -1) {
+            fprintf(stderr, "RFID: Could not start the tap handlers.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
 
-enum rfid_states {
-    STATE_IDLE = 0x00,
-    STATE_WAIT_FOR_CARD
-};
+    /* Only this thread talks to readers, discovery keeps its priority */
+    if (rt_priority > 0) {
+        realtime_start(rt_priority, rt_cpu);
+    }
 
-volatile int card_found = 0;
-unsigned int card_no;
-volatile unsigned int flash_on_found = 1;
-int rf_fd;
-volatile enum rfid_states rfid_state = STATE_IDLE;
+    /*
+     * Start polling after 5 s, then every 100 ms. Readers known from the
+     * snapshot are attached as soon as discovery has checked them.
+     */
+    next_tick = now_ms() + (hint_count > 0 ? 0 : 5000);
+    next_snapshot = now_ms() + SNAPSHOT_MS;
 
-void poll_loop()
+    while (1) {
+        pfd[0].fd = ipc_fd;
+        pfd[0].events = (ob.q.count <= IPC_QUEUE_LEN - OUTBOX_ROOM) ? POLLIN : 0;
+        if (ob.q.count > 0)
+            pfd[0].events |= POLLOUT;
+        pfd[0].revents = 0;
+        pfd[1].fd = (discovery != NULL) ? discovery_fd(discovery) : -1;
+        pfd[1].events = POLLIN;
+        pfd[1].revents = 0;
+        pfd[2].fd = inbox_fd;
+        pfd[2].events = POLLIN;
+        pfd[2].revents = 0;
+
+        wake = (next_cmd != -1 && next_cmd < next_tick) ? next_cmd : next_tick;
+        if (poll(pfd, 3, max(wake - now_ms(), 0)) == -1 && errno != EINTR) {
+            perror("poll");
+            exit(EXIT_FAILURE);
+        }
+
+        while (pfd[1].revents && discovery_next(discovery, &ev) == 1) {
+            if (ev.type == DISCOVERY_ATTACH) {
+                reader_attach(&ev);
+                continue;
+            }
+            for (i=0; i<reader_count; i++) {
+                if (readers[i].fd != -1 && strcmp(readers[i].path, ev.path) == 0) {
+                    reader_detach(&readers[i]);
+                }
+            }
+        }
+
+        if ((pfd[0].revents & ~POLLOUT) && (pfd[0].events & POLLIN)) {
+            n = ipc_recv_batch(ipc_fd, in, IPC_BATCH_MAX);
+            if (n == -1) {
+                fprintf(stderr, "RFID: Network process gone.\n");
+                break;
+            }
+            for (i=0; i<n; i++) {
+                rfid_dispatch(&in[i], &ob);
+            }
+        }
+
+        now = now_ms();
+        if (now >= next_tick) {
+            rfid_tick(&ob, now);
+
+            next_tick += POLL_INTERVAL_MS;
+            if (next_tick < now) {
+                next_tick = now + POLL_INTERVAL_MS;
+            }
+        }
+
+        next_cmd = cmd_queue_run(now_ms());
+
+        outbox_flush(&ob);
+
+        if (now >= next_snapshot) {
+            snapshot_write();
+            next_snapshot = now + SNAPSHOT_MS;
+        }
+    }
+
+    snapshot_write();
+    disk_stop();
+    journal_close(journal);
+
+    for (i=0; i<reader_count; i++) {
+        r = reader_get(i);
+        if (r != NULL) {
+            rf_light(r->fd, LED_RED);
+        }
+    }
+}
+
+/*
+ * Output to a client goes through a queue of lines and is written
+ * without blocking, as many lines per call as the socket takes. A
+ * client that stops reading fills only its own queue; what happens
+ * then is up to the overflow policy (-O).
+ */
+
+void net_flush(struct client *cl)
 {
-    static unsigned int count = 0;
-    static int flash_state = 0;
-    static int acked = 1;
+    struct net_queue *q = cl->q;
+    struct iovec iov[NET_QUEUE_LEN];
+    struct msghdr mh;
+    struct net_line *l;
+    long long now;
+    ssize_t n;
+    int i;
+
+    if (q->count == 0 || cl->closing)
+        return;
+
+    for (i=0; i<q->count; i++) {
+        l = &q->lines[(q->head + i) % NET_QUEUE_LEN];
+        iov[i].iov_base = l->text + (i == 0 ? q->sent : 0);
+        iov[i].iov_len = l->len - (i == 0 ? q->sent : 0);
+    }
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = iov;
+    mh.msg_iovlen = q->count;
+
+    n = sendmsg(cl->fd, &mh, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (n == -1) {
+        if (errno != EAGAIN && errno != EINTR) {
+            cl->closing = 1;
+        }
+        return;
+    }
+    cl->sent_bytes += n;
+
+    now = now_ms();
+    while (n > 0) {
+        l = &q->lines[q->head];
+        if (n < l->len - q->sent) {
+            q->sent += n;
+            break;
+        }
+        n -= l->len - q->sent;
+        q->sent = 0;
+        cl->max_lag = max(cl->max_lag, now - l->queued);
+        q->head = (q->head + 1) % NET_QUEUE_LEN;
+        q->count--;
+    }
+}
 
-    if (rfid_state == STATE_IDLE) {
-        acked = 1;
+/*
+ * Take out the line 'index' places after the oldest.
+ */
+void net_unqueue(struct net_queue *q, int index)
+{
+    for (; index > 0; index--) {
+        q->lines[(q->head + index) % NET_QUEUE_LEN] =
+            q->lines[(q->head + index - 1) % NET_QUEUE_LEN];
+    }
+    q->head = (q->head + 1) % NET_QUEUE_LEN;
+    q->count--;
+}
+
+/*
+ * Take out line 'index' to make room for a line about 'reader'. When it
+ * is the newest card_detected the client has coming, the client will
+ * never use that card session, so it is ended rather than left to
+ * hold the reader until it times out.
+ */
+void net_drop_line(struct client *cl, int index, int reader)
+{
+    struct net_queue *q = cl->q;
+    int lost = q->lines[(q->head + index) % NET_QUEUE_LEN].reader;
+    int i;
+
+    for (i=index+1; i<q->count && reader < 0 && lost >= 0; i++) {
+        if (q->lines[(q->head + i) % NET_QUEUE_LEN].reader >= 0)
+            lost = -1;
+    }
+    if (reader < 0 && lost >= 0) {
+        cl->lost_reader = lost;
     }
+    net_unqueue(q, index);
+}
 
-    if (count % 2 == 0) {
-        /* Look for card */
-        rf_request(rf_fd);
-        rf_anticoll(rf_fd, &card_no);
+/*
+ * Make room in a full queue for a line about 'reader'. Returns 0 if
+ * the client is dropped instead.
+ */
+int net_make_room(struct client *cl, int reader)
+{
+    struct net_queue *q = cl->q;
+    int i, first = (q->sent > 0) ? 1 : 0;   // A line half written stays
 
-        if ((card_no) && (rfid_state == STATE_WAIT_FOR_CARD) && (acked)) {
-            card_found = 1;
-            acked = 0;
+    if (net_overflow == OVERFLOW_DISCONNECT) {
+        fprintf(stderr, "NET: Client %u not reading, disconnecting.\n", cl->id);
+        cl->closing = 1;
+        return 0;
+    }
 
-            if (flash_on_found) {
-                flash_state = 3;
-                rf_beep(rf_fd, 10);
+    if (net_overflow == OVERFLOW_COALESCE && reader >= 0) {
+        for (i=first; i<q->count; i++) {
+            if (q->lines[(q->head + i) % NET_QUEUE_LEN].reader == reader) {
+                net_drop_line(cl, i, reader);
+                cl->coalesced++;
+                return 1;
             }
         }
     }
 
-    if (flash_state == 0) {
-        /* Blink green LED 200 ms every 2 s */
-        if (count % 20 == 0) {
-            rf_light(rf_fd, LED_GREEN);
+    net_drop_line(cl, first, reader);
+    cl->dropped++;
+    return 1;
+}
+
+/*
+ * Return a new line at the end of the queue, for the caller to fill
+ * in, or NULL if the client is being dropped.
+ */
+struct net_line *net_line(struct client *cl, int reader)
+{
+    struct net_queue *q = cl->q;
+    struct net_line *l;
+
+    if (cl->closing)
+        return NULL;
+
+    /* The socket may take more than it did at the end of the last round */
+    if (q->count == NET_QUEUE_LEN) {
+        net_flush(cl);
+    }
+    if (q->count == NET_QUEUE_LEN && !net_make_room(cl, reader))
+        return NULL;
+
+    l = &q->lines[(q->head + q->count++) % NET_QUEUE_LEN];
+    l->queued = now_ms();
+    l->reader = reader;
+    l->len = 0;
+    cl->peak = max(cl->peak, q->count);
+    return l;
+}
+
+void net_printf(struct client *cl, const char *fmt, ...)
+{
+    struct net_line *l;
+    va_list ap;
+    int n;
+
+    l = net_line(cl, -1);
+    if (l == NULL)
+        return;
+
+    va_start(ap, fmt);
+    n = vsnprintf(l->text, NET_LINE_MAX, fmt, ap);
+    va_end(ap);
+    l->len = min(n, NET_LINE_MAX - 1);
+}
+
+int net_replay_record(void *arg, uint64_t seq, const struct journal_record *rec)
+{
+    static const char *results[] = {"?", "tap", "delivered", "removed"};
+    struct client *cl = arg;
+    char hex[2 * JOURNAL_UID_MAX + 1] = "";
+
+    format_hex(hex, rec->uid, min(rec->uid_len, JOURNAL_UID_MAX));
+    net_printf(cl, "tap %llu %llu %u %s %s\n", (unsigned long long)seq,
+               (unsigned long long)rec->time, rec->reader, hex,
+               results[rec->result <= JOURNAL_REMOVED ? rec->result : 0]);
+
+    /* Stop short of a full queue, the rest follows as the client reads */
+    return cl->q->count >= NET_QUEUE_LEN - NET_QUEUE_HEADROOM;
+}
+
+/*
+ * Send the journal from 'seq' on, so that a client that reconnects
+ * can catch up on the taps it missed. The records go out a queue at a
+ * time with net_replay_more(), the client's commands wait until then.
+ * A replay leaves NET_QUEUE_HEADROOM lines free for answers and taps,
+ * so that it never sets off the overflow policy itself.
+ */
+void net_replay(struct client *cl, uint64_t seq)
+{
+    if (replay_journal == NULL && journal_dir != NULL) {
+        replay_journal = journal_open(journal_dir, 0);
+    }
+    if (replay_journal == NULL) {
+        net_printf(cl, "No journal\n");
+        return;
+    }
+
+    cl->replaying = 1;
+    cl->replay_seq = seq;
+}
+
+void net_replay_more(struct client *cl)
+{
+    cl->replay_seq = journal_replay(replay_journal, cl->replay_seq, net_replay_record, cl);
+    if (cl->q->count < NET_QUEUE_LEN - NET_QUEUE_HEADROOM) {
+        /* Not stopped by a full queue, so that was all */
+        cl->replaying = 0;
+        net_printf(cl, "replay_done %llu\n", (unsigned long long)cl->replay_seq);
+    }
+}
+
+/*
+ * Report the pools and clients of the network process. Like a replay,
+ * the answer goes out a queue at a time with net_stats_more(), leaving
+ * NET_QUEUE_HEADROOM lines free, and the client's commands wait until
+ * stats_done is out.
+ */
+void net_stats_more(struct client *cl)
+{
+    struct pool *pools[] = {client_pool, out_pool};
+    struct pool_stats st;
+    struct client *c;
+    long long now = now_ms();
+    int i, limit = NET_QUEUE_LEN - NET_QUEUE_HEADROOM;
+
+    for (; cl->stats_pool < sizeof(pools) / sizeof(pools[0]) && cl->q->count < limit;
+            cl->stats_pool++) {
+        pool_get_stats(pools[cl->stats_pool], &st);
+        net_printf(cl, "pool %s %zu %d %d %d %llu %llu\n", st.name, st.size, st.count,
+                   st.in_use, st.peak, (unsigned long long)st.gets,
+                   (unsigned long long)st.failures);
+    }
+
+    /* Clients by id, those that come and go meanwhile may be missed */
+    while (cl->q->count < limit) {
+        c = NULL;
+        for (i=0; i<client_count; i++) {
+            if (clients[i]->id > cl->stats_after && (c == NULL || clients[i]->id < c->id))
+                c = clients[i];
         }
-        if (count % 20 == 2) {
-            rf_light(rf_fd, LED_OFF);
+        if (c == NULL) {
+            cl->stats_pool = -1;
+            net_printf(cl, "stats_done\n");
+            return;
         }
-    } else {
-        /* Quick flash 5 times when card found */
-        rf_light(rf_fd, LED_GREEN);
-        usleep(50000);
-        rf_light(rf_fd, LED_OFF);
-        flash_state--;
-        printf("Flashed!\n");
+        net_printf(cl, "client %u %d %d %lld %lld %lu %lu %llu\n", c->id, c->q->count, c->peak,
+                   c->q->count > 0 ? now - c->q->lines[c->q->head].queued : 0LL,
+                   c->max_lag, c->dropped, c->coalesced, c->sent_bytes);
+        cl->stats_after = c->id;
     }
+}
 
-    count++;
+void net_stats(struct client *cl)
+{
+    cl->stats_pool = 0;
+    cl->stats_after = 0;
+    if (cl->q->count < NET_QUEUE_LEN - NET_QUEUE_HEADROOM) {
+        net_stats_more(cl);
+    }
 }
 
-int pipe_send(int pipefd, enum cmds cmd, uint8_t bufsize, void *buf)
+/*
+ * Parse one command line from the client. Returns -1 when the client
+ * wants to disconnect.
+ */
+/*
+ * Queue 'msg' from 'cl' for the RFID process and send what the socket
+ * takes. Until it has gone out, net_input() holds back the rest of the
+ * client's input.
+ */
+void net_ipc_send(struct client *cl, struct ipc_msg *msg)
 {
-    int i;
-    int status;
+    struct ipc_msg *out;
+
+    out = ipc_queue_add(&net_ipc);
+    if (out == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    memcpy(out, msg, IPC_MSG_SIZE(msg));
+    if (ipc_queue_flush(&net_ipc) == -1) {
+        exit(EXIT_FAILURE);
+    }
+    cl->ipc_seq = net_ipc.sent + net_ipc.count;
+}
 
-    if (bufsize > 0 && buf == NULL) {
+int net_command(struct client *cl)
+{
+    struct ipc_msg msg;
+    char *buf = cl->buf;
+    char keyref[10], hex[40];
+    unsigned long long seq;
+    unsigned int arg;
+
+    if ((strncmp(buf, "client_protocol ", 16) == 0) &&
+            (strlen(&buf[16])) > 0 &&
+            (strlen(&buf[16])) < 10) {
+        strncpy(cl->client_protocol, &buf[16], 9);
+        cl->client_protocol[9] = '\0';
+        cl->handshake = 1;
+        net_printf(cl, "server_protocol %s\n", PROTO_VER);
+        return 0;
+    }
+
+    if (strcmp(buf, "exit") == 0) {
         return -1;
     }
 
-    status = write(pipefd, &cmd, sizeof(cmd));
+    if (!cl->handshake) {
+        /* Protocol version not received */
+        net_printf(cl, "Please provide protocol version.\n");
+        return 0;
+    }
+
+    if (sscanf(buf, "replay %llu", &seq) == 1) {
+        net_replay(cl, seq);
+        return 0;
+    }
 
-    status = write(pipefd, &bufsize, sizeof(bufsize));
+    if (strcmp(buf, "stats") == 0) {
+        net_stats(cl);
+        return 0;
+    }
 
-    for (i=0; i<bufsize; i++) {
-        write(pipefd, buf++, 1);
+    memset(&msg, 0, IPC_HDR_SIZE);
+    msg.client = cl->id;
+    msg.reader = cl->reader;
+
+    if (strcmp(buf, "wait_for_card") == 0) {
+        printf("NET: Sending CMD_WAIT_FOR_CARD.\n");
+        msg.cmd = CMD_WAIT_FOR_CARD;
+        cl->waiting = 1;
+    } else if (sscanf(buf, "beep %u", &arg) == 1 && arg <= 0xff) {
+        msg.cmd = CMD_BEEP;
+        msg.arg = arg;
+    } else if (sscanf(buf, "light %u", &arg) == 1 && arg <= (LED_RED|LED_GREEN)) {
+        msg.cmd = CMD_LIGHT;
+        msg.arg = arg;
+    } else if (strcmp(buf, "card_ack") == 0) {
+        msg.cmd = CMD_CARD_ACK;
+        cl->waiting = 0;
+    } else if (sscanf(buf, "read_block %u %9s", &arg, keyref) == 2 &&
+            arg <= 0xff && parse_keyref(keyref, &msg) == 0) {
+        msg.cmd = CMD_READ_BLOCK;
+        msg.arg = arg;
+    } else if (sscanf(buf, "write_block %u %9s %39s", &arg, keyref, hex) == 3 &&
+            arg <= 0xff && parse_keyref(keyref, &msg) == 0 &&
+            parse_hex(hex, msg.data, 16) == 0) {
+        msg.cmd = CMD_WRITE_BLOCK;
+        msg.arg = arg;
+        msg.len = 16;
+    } else if (sscanf(buf, "read_sector %u %9s", &arg, keyref) == 2 &&
+            arg <= 0xff && parse_keyref(keyref, &msg) == 0) {
+        msg.cmd = CMD_READ_SECTOR;
+        msg.arg = arg;
+    } else if (sscanf(buf, "dump_card %9s", keyref) == 1 &&
+            parse_keyref(keyref, &msg) == 0) {
+        msg.cmd = CMD_DUMP;
+    } else {
+        net_printf(cl, "Syntax error\n");
+        return 0;
     }
 
+    net_ipc_send(cl, &msg);
+
     return 0;
 }
 
-int pipe_rcv(int pipefd, enum cmds *cmd, uint8_t bufsize, void *buf)
+/*
+ * Split client input into '\r' terminated lines and run them. Input
+ * after a command that is still waiting for the IPC socket, or after
+ * replay, is held until that is done.
+ */
+int net_input(struct client *cl, const char *data, int len)
 {
-    uint8_t len;
-    uint8_t trash;
-    int i = 0;
-    int num;
+    char ch;
+    int i;
 
-    while ((num = read(pipefd, cmd, sizeof(*cmd))) == -1);
-    if (num == 0) {
-        fprintf(stderr, "pipe: EOF\n");
-        exit(EXIT_FAILURE);
-    }
+    for (i=0; i<len; i++) {
+        ch = data[i];
+
+        if (cl->bufpos < sizeof(cl->buf)) {
+            if (ch == '\r') {
+                cl->buf[cl->bufpos++] = '\0';
+            } else if (ch == '\n') {
+            } else {
+                cl->buf[cl->bufpos++] = ch;
+            }
+        } else {
+            /* Buffer overrun. Reset buffer. */
+            cl->bufpos = 0;
+        }
 
-    while ((num = read(pipefd, &len, sizeof(len))) == -1);
-    assert(num > 0);
+        if (ch == '\r' && cl->bufpos > 0) {
+            if (net_command(cl) == -1) {
+                return -1;
+            }
+            cl->bufpos = 0;
 
-    if (buf != NULL) {
-        for (i=0; i<min(len, bufsize); i++) {
-            while ((num = read(pipefd, buf++, 1)) == -1);
-            assert(num > 0);
+            if (cl->replaying || cl->stats_pool >= 0 || cl->ipc_seq > net_ipc.sent) {
+                /* The rest waits for the answer or the RFID process */
+                cl->held_len = len - i - 1;
+                memmove(cl->held, data + i + 1, cl->held_len);
+                return 0;
+            }
         }
     }
 
-    for (; i<len; i++) {
-        while ((num = read(pipefd, &trash, 1)) == -1);
-        assert(num > 0);
+    return 0;
+}
+
+struct client *net_client(uint16_t id)
+{
+    int i;
+
+    for (i=0; i<client_count; i++) {
+        if (clients[i]->id == id)
+            return clients[i];
+    }
+    return NULL;
+}
+
+void net_reply(struct ipc_msg *msg)
+{
+    struct client *cl;
+    struct net_line *l;
+    unsigned long long card_no;
+    char *pos;
+
+    cl = net_client(msg->client);
+    if (cl == NULL) {
+        /* Answer to a client that has already left */
+        return;
     }
 
-    return len;
+    switch (msg->cmd) {
+        case CMD_CARD_DETECTED:
+            printf("NET: Received CMD_CARD_DETECTED\n");
+            cl->lost_reader = -1;
+            card_no = 0;
+            memcpy(&card_no, msg->data, min(msg->len, sizeof(card_no)));
+            cl->waiting = 0;
+            cl->reader = msg->reader;
+            l = net_line(cl, msg->reader);
+            if (l != NULL) {
+                l->len = sprintf(l->text, "card_detected %llu\n", card_no);
+            }
+            break;
+        case CMD_RESULT:
+            if (msg->status == 0) {
+                net_printf(cl, "ok\n");
+            } else {
+                net_printf(cl, "error %u\n", msg->status);
+            }
+            break;
+        case CMD_BLOCK_DATA:
+        case CMD_SECTOR_DATA:
+            l = net_line(cl, -1);
+            if (l == NULL)
+                break;
+            pos = l->text + sprintf(l->text, "%s %u ",
+                                    msg->cmd == CMD_BLOCK_DATA ? "block" : "sector", msg->arg);
+            if (msg->status == 0) {
+                pos = format_hex(pos, msg->data, msg->len);
+                pos += sprintf(pos, "\n");
+            } else {
+                pos += sprintf(pos, "error %u\n", msg->status);
+            }
+            l->len = pos - l->text;
+            break;
+        case CMD_DUMP_DONE:
+            if (msg->status == 0) {
+                net_printf(cl, "dump_done\n");
+            } else {
+                net_printf(cl, "error %u\n", msg->status);
+            }
+            break;
+        default:
+            printf("NET: Got unexpected cmd: %u.\n", msg->cmd);
+            return;
+    }
 }
 
-void rfid_process(int net_rfid[], int rfid_net[], int rfid_fd)
+/*
+ * Take a new connection. Sessions and their output buffers come from
+ * the pools, a client over the limit is turned away.
+ */
+void net_accept(int sock, uint16_t id)
 {
-    enum cmds cmd;
-    struct itimerval loop_ival;
-    struct sigaction alrm_action;
+    struct client *cl;
+    struct net_queue *q;
+    int fd;
 
-    /* Close unused pipes */
-    close(net_rfid[1]);
-    close(rfid_net[0]);
+    if ((fd = accept(sock, NULL, NULL)) == -1) {
+        perror("accept");
+        return;
+    }
 
-    rf_fd = rfid_fd;
+    cl = pool_get(client_pool);
+    q = pool_get(out_pool);
+    if (cl == NULL || q == NULL) {
+        fprintf(stderr, "NET: Too many clients.\n");
+        send(fd, "Server busy\n", 12, MSG_DONTWAIT | MSG_NOSIGNAL);
+        close(fd);
+        pool_put(client_pool, cl);
+        pool_put(out_pool, q);
+        return;
+    }
 
-    /* Set timer to 100 ms */
-    loop_ival.it_interval.tv_sec = 0;
-    loop_ival.it_interval.tv_usec = 100000;
-    loop_ival.it_value.tv_sec = 5;
-    loop_ival.it_value.tv_usec = 10;
+    memset(cl, 0, sizeof(*cl));
+    cl->lost_reader = -1;
+    cl->stats_pool = -1;
+    cl->fd = fd;
+    cl->id = id;
+    cl->q = q;
+    q->head = 0;
+    q->count = 0;
+    q->sent = 0;
+    clients[client_count++] = cl;
+}
 
-    alrm_action.sa_handler = poll_loop;
-    sigemptyset (&alrm_action.sa_mask);
-    alrm_action.sa_flags = 0;
-    sigaction(SIGALRM, &alrm_action, NULL);
+void net_close(int index)
+{
+    struct client *cl = clients[index];
+    struct ipc_msg msg;
 
-    setitimer(ITIMER_REAL, &loop_ival, NULL);
+    printf("NET: Kill client.\n");
 
-    while (1) {
-        /* poll_loop is running until card is found */
-
-        /* Wait for command */
-        printf("RFID: Waiting for command.\n");
-        pipe_rcv(net_rfid[0], &cmd, 0, NULL);
-
-        printf("RFID: got command\n");
-        switch (cmd) {
-            case CMD_WAIT_FOR_CARD:
-                printf("RFID: Received CMD_WAIT_FOR_CARD.\n");
-                card_found = 0;
-                rfid_state = STATE_WAIT_FOR_CARD;
-                while (!card_found) {
-                    usleep(10000000);
-                }
-                rfid_state = STATE_IDLE;
+    /* Stop looking for a card or end the session of a client that left */
+    memset(&msg, 0, IPC_HDR_SIZE);
+    msg.cmd = CMD_CARD_ACK;
+    msg.client = cl->id;
+    net_ipc_send(cl, &msg);
 
-                printf("RFID: Sending CMD_CARD_DETECTED.\n");
-                pipe_send(rfid_net[1], CMD_CARD_DETECTED, sizeof(card_no), &card_no);
-                break;
-            default:
-                break;
-        }
+    net_flush(cl);
+    if (close(cl->fd) == -1) {
+        perror("close net_fd");
     }
 
-    rf_light(rfid_fd, LED_RED);
+    pool_put(out_pool, cl->q);
+    pool_put(client_pool, cl);
+    clients[index] = clients[--client_count];
 }
 
-void network_process(int rfid_net[], int net_rfid[])
+/*
+ * Tell the RFID process that 'cl' lost its card_detected line.
+ */
+void net_card_lost(struct client *cl)
 {
-    char buf[50];
-    char ch;
-    char client_protocol[10];
-    int bufpos = 0;
-    int handshake;
-    int net_fd;
-    int sock;
-    int status;
-    struct sockaddr_in my_addr;
-    struct sockaddr_in client_addr;
-    socklen_t client_size;
+    struct ipc_msg msg;
+
+    memset(&msg, 0, IPC_HDR_SIZE);
+    msg.cmd = CMD_CARD_LOST;
+    msg.client = cl->id;
+    msg.reader = cl->lost_reader;
+    net_ipc_send(cl, &msg);
+    cl->lost_reader = -1;
+}
 
-    client_size = sizeof(client_addr);
+void network_process(int ipc_fd)
+{
+    char rbuf[NET_READ_SIZE];
+    int i, n, count;
+    int sock, one = 1;
+    uint16_t client_seq = 0;
+    struct client *cl;
+    struct ipc_msg msgs[IPC_BATCH_MAX];
+    struct pollfd *pfd;
+    struct sockaddr_in my_addr;
 
-    /* Close unused pipes */
-    close(net_rfid[0]);
-    close(rfid_net[1]);
+    /* Everything the clients will need, so serving them never allocates */
+    client_pool = pool_create("clients", sizeof(struct client), max_clients);
+    out_pool = pool_create("output", sizeof(struct net_queue), max_clients);
+    clients = calloc(max_clients, sizeof(*clients));
+    pfd = calloc(max_clients + 2, sizeof(*pfd));
+    if (client_pool == NULL || out_pool == NULL || clients == NULL || pfd == NULL) {
+        fprintf(stderr, "NET: Out of memory.\n");
+        exit(EXIT_FAILURE);
+    }
 
     if ((sock = socket(PF_INET, SOCK_STREAM, 0)) == -1) {
         perror("socket");
         exit(EXIT_FAILURE);
     }
 
+    /* Connections left in TIME_WAIT must not keep a restart from binding */
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
     my_addr.sin_family = PF_INET;
     my_addr.sin_port = htons(3333);
     my_addr.sin_addr.s_addr = htonl(INADDR_ANY);
@@ -235,98 +2372,105 @@ void network_process(int rfid_net[], int net_rfid[])
         exit(EXIT_FAILURE);
     }
 
-    for (;;) {
+    if (listen(sock, 16) == -1) {
+        perror("listen");
+        exit(EXIT_FAILURE);
+    }
 
-        if (listen(sock, 1) == -1) {
-            perror("listen");
-            exit(EXIT_FAILURE);
+    ipc_queue_init(&net_ipc, ipc_fd);
+
+    for (;;) {
+        pfd[0].fd = ipc_fd;
+        pfd[0].events = POLLIN;
+        if (net_ipc.count > 0)
+            pfd[0].events |= POLLOUT;
+        pfd[1].fd = sock;
+        pfd[1].events = POLLIN;
+        for (i=0; i<client_count; i++) {
+            cl = clients[i];
+            pfd[2 + i].fd = cl->fd;
+            /* Held input runs first */
+            pfd[2 + i].events = (cl->replaying || cl->stats_pool >= 0 ||
+                                 cl->held_len > 0) ? 0 : POLLIN;
+            if (cl->q->count > 0 || cl->replaying || cl->stats_pool >= 0)
+                pfd[2 + i].events |= POLLOUT;
         }
+        count = client_count;
 
-        if ((net_fd = accept(sock, (struct sockaddr *)&client_addr, &client_size)) == -1) {
-            perror("accept");
+        if (poll(pfd, count + 2, -1) == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
             exit(EXIT_FAILURE);
         }
 
-        handshake = 0;
-        bufpos = 0;
-
-        while (read(net_fd, &ch, 1)) {
-            if (bufpos < sizeof(buf)) {
-                if (ch == '\r') {
-                    buf[bufpos++] = '\0';
-                } else if (ch == '\n') {
-                } else {
-                    buf[bufpos++] = ch;
-                }
-            } else {
-                /* Buffer overrun. Reset buffer. */
-                bufpos = 0;
-            }
-
-            if (ch == '\r' && bufpos > 0) {
-                /* Parse command */
-
-                if ((strncmp(buf, "client_protocol ", 16) == 0) &&
-                        (strlen(&buf[16])) > 0 &&
-                        (strlen(&buf[16])) < 10) {
-                    strncpy(client_protocol, &buf[9], 9);
-                    client_protocol[9] = '\0';
-                    handshake = 1;
-                    sprintf(buf, "server_protocol %s\n", PROTO_VER);
-                    write(net_fd, buf, strlen(buf));
-                } else if (strcmp(buf, "exit") == 0) {
-                    break;
-                } else {
-
-                    if (handshake) {
-                        enum cmds cmd;
-                        int status;
-                        unsigned int card_no;
-
-                        if (strcmp(buf, "wait_for_card") == 0) {
-                            printf("NET: Sending CMD_WAIT_FOR_CARD.\n");
-                            pipe_send(net_rfid[1], CMD_WAIT_FOR_CARD, 0, NULL);
-
-                            printf("NET: Waiting for CMD_CARD_DETECTED.\n");
-                            status = pipe_rcv(rfid_net[0], &cmd, sizeof(card_no), &card_no);
-                            if (status == -1) {
-                                printf("NET: ERROR.\n");
-                            } else if (status == 0) {
-                                printf("NET: Nothing received.\n");
-                            }
-                            printf("NET: Got cmd: %u.\n", cmd);
-                            if (cmd == CMD_CARD_DETECTED) {
-                                printf("NET: Received CMD_CARD_DETECTED\n");
-                                sprintf(buf, "card_detected %u\n", card_no);
-                                write(net_fd, buf, strlen(buf));
-                            }
-                        } else {
-                            sprintf(buf, "Syntax error\n");
-                            write(net_fd, buf, strlen(buf));
-                        }
-                    } else {
-                        /* Protocol version not received */
-                        sprintf(buf, "Please provide protocol version.\n");
-                        write(net_fd, buf, strlen(buf));
-                    }
-                }
+        /* Backwards, a client closed here is replaced by one already seen */
+        for (i=count-1; i>=0; i--) {
+            if (pfd[2 + i].revents & POLLOUT) {
+                net_flush(clients[i]);
+            }
+            if ((pfd[2 + i].revents & ~POLLOUT) == 0)
+                continue;
+            n = read(clients[i]->fd, rbuf, sizeof(rbuf));
+            if (n == -1) {
+                perror("read");
+            }
+            if (n <= 0 || net_input(clients[i], rbuf, n) == -1) {
+                net_close(i);
+            }
+        }
 
-                bufpos = 0;
-            } // Parse command
-        } // while(read())
-        if (status == -1) {
-            perror("read");
-            exit(EXIT_FAILURE);
+        if (pfd[0].revents & POLLOUT) {
+            if (ipc_queue_flush(&net_ipc) == -1) {
+                exit(EXIT_FAILURE);
+            }
         }
 
-        printf("NET: Kill client.\n");
+        if (pfd[0].revents & ~POLLOUT) {
+            n = ipc_recv_batch(ipc_fd, msgs, IPC_BATCH_MAX);
+            if (n == -1) {
+                fprintf(stderr, "NET: RFID process gone.\n");
+                exit(EXIT_FAILURE);
+            }
+            for (i=0; i<n; i++) {
+                net_reply(&msgs[i]);
+            }
+        }
 
-        if (close(net_fd) == -1) {
-            perror("close net_fd");
-            exit(EXIT_FAILURE);
+        if (pfd[1].revents) {
+            if (++client_seq == 0)
+                client_seq++;
+            net_accept(sock, client_seq);
         }
 
-    } // for(;;)
+        for (i=client_count-1; i>=0; i--) {
+            cl = clients[i];
+            if (!cl->closing && cl->q->count < NET_QUEUE_LEN - NET_QUEUE_HEADROOM) {
+                if (cl->replaying) {
+                    net_replay_more(cl);
+                } else if (cl->stats_pool >= 0) {
+                    net_stats_more(cl);
+                }
+            }
+            if (cl->held_len > 0 && !cl->replaying && cl->stats_pool < 0 && !cl->closing &&
+                    cl->ipc_seq <= net_ipc.sent) {
+                n = cl->held_len;
+                memcpy(rbuf, cl->held, n);
+                cl->held_len = 0;
+                if (net_input(cl, rbuf, n) == -1) {
+                    net_close(i);
+                    continue;
+                }
+            }
+            if (cl->lost_reader >= 0 && !cl->closing) {
+                net_card_lost(cl);
+            }
+            net_flush(cl);
+            if (cl->closing) {
+                net_close(i);
+            }
+        }
+    }
 
     if (close(sock) == -1) {
         perror("close sock");
@@ -334,28 +2478,174 @@ void network_process(int rfid_net[], int net_rfid[])
     }
 }
 
-int main()
+/*
+ * Parse "/dev/ttyS0=0001,0002" into a bus port and its device IDs.
+ */
+int parse_bus(char *arg, struct bus_spec *spec)
 {
-    int net_rfid[2];
-    int rfid_fd;
-    int rfid_net[2];
-    pid_t cpid;
+    char *eq, *tok;
 
-    /* Set up serial port */
-    rfid_fd = open_port();
+    eq = strchr(arg, '=');
+    if (eq == NULL)
+        return -1;
+    *eq = '\0';
+    spec->path = arg;
+    spec->count = 0;
+
+    for (tok = strtok(eq + 1, ","); tok != NULL; tok = strtok(NULL, ",")) {
+        if (spec->count == BUS_MAX_NODES || parse_hex(tok, spec->dev_ids[spec->count], 2) == -1)
+            return -1;
+        spec->count++;
+    }
+    return (spec->count > 0) ? 0 : -1;
+}
 
-    /* Turn off LED */
-    rf_light(rfid_fd, LED_OFF);
+/*
+ * Parse "0001,0002" into the device IDs of a reader group.
+ */
+int parse_group(char *arg, struct group_spec *spec)
+{
+    char *tok;
 
-    if (pipe(net_rfid) == -1)
-    {
-        perror("pipe");
-        exit(EXIT_FAILURE);
+    spec->count = 0;
+    for (tok = strtok(arg, ","); tok != NULL; tok = strtok(NULL, ",")) {
+        if (spec->count == MAX_READERS || parse_hex(tok, spec->dev_ids[spec->count], 2) == -1)
+            return -1;
+        spec->count++;
+    }
+    return (spec->count > 0) ? 0 : -1;
+}
+
+void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-d device-glob] [-b port=id,...] [-k keyfile] [-c cachefile]\n"
+            "       [-R sector,...] [-V block] [-w window-ms] [-g id,...] [-L]\n"
+            "       [-r priority[,cpu]] [-j journal-dir] [-W snapshot] [-F] [-C clients]\n"
+            "       [-x tap-handler] [-X threads] [-O disconnect|drop|coalesce]\n"
+            "-V block: data block (0-2) of each sector with a counter the\n"
+            "          application bumps on every write\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+    int ipc[2];
+    int opt;
+    char *tok;
+    pid_t cpid;
+
+    while ((opt = getopt(argc, argv, "d:b:k:c:R:V:w:g:Lr:j:W:FC:x:X:O:")) != -1) {
+        switch (opt) {
+            case 'd':
+                /* Where readers show up, e.g. /dev/serial/by-id/usb-* */
+                device_glob = optarg;
+                break;
+            case 'b':
+                /* RS-485 line with readers at the given device IDs */
+                if (bus_count == MAX_BUSES || parse_bus(optarg, &bus_specs[bus_count]) == -1)
+                    usage(argv[0]);
+                bus_count++;
+                break;
+            case 'k':
+                if (keys_load(optarg) == -1)
+                    exit(EXIT_FAILURE);
+                break;
+            case 'c':
+                /* Persistent sector cache */
+                cache_path = optarg;
+                cache_enabled = 1;
+                break;
+            case 'R':
+                /* Sectors that are never written, served from the cache */
+                for (tok = strtok(optarg, ","); tok != NULL; tok = strtok(NULL, ",")) {
+                    if (atoi(tok) < 0 || atoi(tok) >= SECTOR_CACHE_SECTORS)
+                        usage(argv[0]);
+                    cache_ro_mask |= 1u << atoi(tok);
+                }
+                cache_enabled = 1;
+                break;
+            case 'V':
+                /* Data block in each sector holding its version counter */
+                cache_version_block = atoi(optarg);
+                if (cache_version_block < 0 || cache_version_block > 2)
+                    usage(argv[0]);
+                cache_enabled = 1;
+                break;
+            case 'w':
+                /* Repeats of a tap within this time are dropped, 0 = off */
+                dedup_window = atoi(optarg);
+                if (dedup_window < 0)
+                    usage(argv[0]);
+                break;
+            case 'g':
+                /* Readers that count a card once between them */
+                if (group_count == MAX_GROUPS || parse_group(optarg, &group_specs[group_count]) == -1)
+                    usage(argv[0]);
+                group_count++;
+                break;
+            case 'j':
+                /* Persistent journal of taps */
+                journal_dir = optarg;
+                break;
+            case 'W':
+                /* Readers of the last run, for a quick restart */
+                snapshot_path = optarg;
+                break;
+            case 'F':
+                /* Switch readers on their own ports to 115200 baud */
+                fast_baud = 1;
+                break;
+            case 'C':
+                /* Connections served at once, all allocated up front */
+                max_clients = atoi(optarg);
+                if (max_clients < 1 || max_clients > MAX_CLIENTS)
+                    usage(argv[0]);
+                break;
+            case 'O':
+                /* Clients that do not keep up */
+                if (strcmp(optarg, "disconnect") == 0) {
+                    net_overflow = OVERFLOW_DISCONNECT;
+                } else if (strcmp(optarg, "drop") == 0) {
+                    net_overflow = OVERFLOW_DROP;
+                } else if (strcmp(optarg, "coalesce") == 0) {
+                    net_overflow = OVERFLOW_COALESCE;
+                } else {
+                    usage(argv[0]);
+                }
+                break;
+            case 'x':
+                /* Program run on a worker for every tap */
+                tap_hook_cmd = optarg;
+                break;
+            case 'X':
+                hook_threads = atoi(optarg);
+                if (hook_threads < 1)
+                    usage(argv[0]);
+                break;
+            case 'L':
+                /* Low-latency serial, worth it on USB adapters */
+                low_latency = 1;
+                break;
+            case 'r':
+                /* Poll readers under SCHED_FIFO, optionally on one CPU */
+                rt_priority = atoi(optarg);
+                tok = strchr(optarg, ',');
+                rt_cpu = (tok != NULL) ? atoi(tok + 1) : -1;
+                if (rt_priority < 1 || rt_priority > 99)
+                    usage(argv[0]);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+
+    /* Without buses, look for readers on their own ports by default */
+    if (device_glob == NULL && bus_count == 0) {
+        device_glob = DISCOVERY_GLOB;
     }
 
-    if (pipe(rfid_net) == -1)
+    if (ipc_pair(ipc) == -1)
     {
-        perror("pipe");
         exit(EXIT_FAILURE);
     }
 
@@ -367,11 +2657,12 @@ int main()
     }
 
     if (cpid == 0) {
-        network_process(rfid_net, net_rfid);
+        close(ipc[1]);
+        network_process(ipc[0]);
     } else {
-        rfid_process(net_rfid, rfid_net, rfid_fd);
+        close(ipc[0]);
+        rfid_process(ipc[1]);
     }
 
     return 0;
 }
-
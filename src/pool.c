@@ -0,0 +1,108 @@
+// vim: ts=4 expandtab ai
+
+/*
+ * Copyright (c) 2008, Henrik Torstensson <laban@kryo.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "pool.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define POOL_ALIGN 64                   // Objects do not share cache lines
+
+struct pool {
+    const char *name;
+    size_t size;                        // Rounded up to POOL_ALIGN
+    int count;
+    int top;                            // Free objects on the stack
+    int peak;
+    uint64_t gets;
+    uint64_t failures;
+    uint8_t *objs;
+    void **free;
+};
+
+struct pool *pool_create(const char *name, size_t size, int count)
+{
+    struct pool *p;
+    int i;
+
+    if (size == 0 || count < 1)
+        return NULL;
+
+    p = calloc(1, sizeof(*p));
+    if (p == NULL)
+        return NULL;
+
+    p->name = name;
+    p->size = (size + POOL_ALIGN - 1) & ~(size_t)(POOL_ALIGN - 1);
+    p->count = count;
+    p->free = malloc(count * sizeof(*p->free));
+    if (p->free == NULL || posix_memalign((void**)&p->objs, POOL_ALIGN, p->size * count) != 0) {
+        free(p->free);
+        free(p);
+        return NULL;
+    }
+
+    /* Touch every page now rather than on the first busy minute */
+    memset(p->objs, 0, p->size * count);
+
+    /* Lowest addresses on top */
+    for (i=0; i<count; i++)
+        p->free[i] = p->objs + (count - 1 - i) * p->size;
+    p->top = count;
+
+    return p;
+}
+
+void pool_free(struct pool *p)
+{
+    if (p == NULL)
+        return;
+    free(p->objs);
+    free(p->free);
+    free(p);
+}
+
+void *pool_get(struct pool *p)
+{
+    if (p->top == 0) {
+        p->failures++;
+        return NULL;
+    }
+
+    p->gets++;
+    if (p->count - p->top + 1 > p->peak)
+        p->peak = p->count - p->top + 1;
+    return p->free[--p->top];
+}
+
+void pool_put(struct pool *p, void *obj)
+{
+    if (obj != NULL)
+        p->free[p->top++] = obj;
+}
+
+void pool_get_stats(struct pool *p, struct pool_stats *stats)
+{
+    stats->name = p->name;
+    stats->size = p->size;
+    stats->count = p->count;
+    stats->in_use = p->count - p->top;
+    stats->peak = p->peak;
+    stats->gets = p->gets;
+    stats->failures = p->failures;
+}
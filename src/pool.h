@@ -0,0 +1,76 @@
+// vim: ts=4 expandtab ai
+
+#ifndef POOL_H
+#define POOL_H
+
+/*
+ * Copyright (c) 2008, Henrik Torstensson <laban@kryo.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Fixed-size object pools.
+ *
+ * All objects of a pool are allocated and touched when it is created,
+ * so taking one later never calls the allocator or faults in a page.
+ * Free objects are kept on a stack, the most recently returned one is
+ * handed out first while it is still in the cache. An empty pool fails
+ * instead of growing, which keeps memory bounded however many clients
+ * come.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct pool;
+
+struct pool_stats {
+    const char *name;
+    size_t size;                        // Bytes per object
+    int count;                          // Objects in the pool
+    int in_use;
+    int peak;                           // Most in use at once
+    uint64_t gets;
+    uint64_t failures;                  // Gets on an empty pool
+};
+
+/*
+ * 'pool_create()' - Allocate 'count' objects of 'size' bytes, zeroed.
+ * 'name' is kept for the stats and must stay valid.
+ *
+ * Returns NULL on error.
+ */
+
+struct pool *pool_create(const char *name, size_t size, int count);
+
+void pool_free(struct pool *p);
+
+/*
+ * 'pool_get()' - Take an object. Its contents are what the last user
+ * left.
+ *
+ * Returns NULL when all objects are in use.
+ */
+
+void *pool_get(struct pool *p);
+
+/*
+ * 'pool_put()' - Return an object taken from 'p'.
+ */
+
+void pool_put(struct pool *p, void *obj);
+
+void pool_get_stats(struct pool *p, struct pool_stats *stats);
+
+#endif
@@ -0,0 +1,468 @@
+// vim: ts=4 expandtab ai
+
+/*
+ * Copyright (c) 2008, Henrik Torstensson <laban@kryo.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Card personalization station.
+ *
+ *     provision [-p port] [-l logfile] [-f] jobfile
+ *
+ * The job file holds one record per card, in the order the cards are
+ * presented:
+ *
+ *     # Key A that opens the blank cards, ff ff ff ff ff ff if not given
+ *     key ffffffffffff
+ *
+ *     card
+ *     block 4 00112233445566778899aabbccddeeff
+ *     block 5 ...
+ *     trailer 1 a0a1a2a3a4a5 ff078069 b0b1b2b3b4b5
+ *     end
+ *
+ * 'trailer' takes key A, the access bits with the general purpose byte
+ * and key B. The data blocks of every sector touched are written, read
+ * back and compared under one authentication, and only then are the
+ * trailers written. A card that fails keeps its record for the next
+ * card presented; a sector whose trailer already went in is opened
+ * with the record's key A on the next try.
+ *
+ * A thread reads and checks the next records while the current card is
+ * being written, so the reader never waits for the job file.
+ */
+
+#include "sl500.h"
+
+#include <ctype.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PREFETCH 4
+#define PRESENCE_POLL_US 10000
+#define MAX_SECTORS 40
+#define MAX_BLOCKS 256
+
+struct card_job {
+    int seq;                            // Record number in the job file
+    int line;
+    int last;                           // No more records after this
+    uint8_t key[6];                     // Key A of the blank card
+    uint8_t sectors[MAX_SECTORS];       // Sector has data or a trailer
+    uint8_t has_block[MAX_BLOCKS];
+    uint8_t has_trailer[MAX_SECTORS];
+    uint8_t block[MAX_BLOCKS][16];
+    uint8_t trailer[MAX_SECTORS][16];
+};
+
+/* Records travel from the reader thread to the main loop through here */
+struct job_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int head, count;
+    struct card_job jobs[PREFETCH];
+};
+
+struct job_queue queue = {
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0
+};
+
+const char *job_path;
+FILE *job_file;
+
+long long now_ms(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+int parse_hex(const char *hex, uint8_t *data, int len)
+{
+    int i;
+
+    if (strlen(hex) != len * 2)
+        return -1;
+    for (i=0; i<len; i++) {
+        if (!isxdigit((unsigned char)hex[i * 2]) || !isxdigit((unsigned char)hex[i * 2 + 1]) ||
+                sscanf(&hex[i * 2], "%2hhx", &data[i]) != 1)
+            return -1;
+    }
+    return 0;
+}
+
+/*
+ * Check that the access bits are stored together with their inverse. A
+ * trailer that breaks this rule locks its sector for good.
+ */
+int access_bits_ok(const uint8_t *ac)
+{
+    uint8_t c1 = ac[1] >> 4, c2 = ac[2] & 0x0f, c3 = ac[2] >> 4;
+
+    return (ac[0] & 0x0f) == (~c1 & 0x0f) &&
+        (ac[0] >> 4) == (~c2 & 0x0f) &&
+        (ac[1] & 0x0f) == (~c3 & 0x0f);
+}
+
+/*
+ * Read the next record into 'job'. Returns 1 on success, 0 at the end of
+ * the file and -1 on a bad record.
+ */
+int read_job(struct card_job *job, int *lineno)
+{
+    static uint8_t open_key[6] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
+    char line[200], word[10], arg1[40], arg2[40], arg3[40];
+    unsigned int n;
+    uint8_t keys[16];
+    int in_card = 0, block, sector;
+    char *p;
+
+    memset(job, 0, sizeof(*job));
+
+    while (fgets(line, sizeof(line), job_file) != NULL) {
+        (*lineno)++;
+        for (p = line; isspace((unsigned char)*p); p++);
+        if (*p == '\0' || *p == '#')
+            continue;
+        if (sscanf(p, "%9s", word) != 1)
+            continue;
+
+        if (!in_card) {
+            if (strcmp(word, "key") == 0 && sscanf(p, "key %39s", arg1) == 1 &&
+                    parse_hex(arg1, open_key, 6) == 0)
+                continue;
+            if (strcmp(word, "card") == 0) {
+                in_card = 1;
+                job->line = *lineno;
+                memcpy(job->key, open_key, sizeof(job->key));
+                continue;
+            }
+        } else if (strcmp(word, "end") == 0) {
+            return 1;
+        } else if (strcmp(word, "block") == 0 &&
+                sscanf(p, "block %u %39s", &n, arg1) == 2 && n < MAX_BLOCKS) {
+            block = n;
+            sector = rf_M1_block_sector(block);
+            /* Block 0 is the manufacturer's, trailers have their own line */
+            if (block != 0 && block != rf_M1_sector_block(sector) + rf_M1_sector_blocks(sector) - 1 &&
+                    parse_hex(arg1, job->block[block], 16) == 0) {
+                job->has_block[block] = 1;
+                job->sectors[sector] = 1;
+                continue;
+            }
+        } else if (strcmp(word, "trailer") == 0 &&
+                sscanf(p, "trailer %u %39s %39s %39s", &n, arg1, arg2, arg3) == 4 &&
+                n < MAX_SECTORS && parse_hex(arg1, keys, 6) == 0 &&
+                parse_hex(arg2, keys + 6, 4) == 0 && parse_hex(arg3, keys + 10, 6) == 0 &&
+                access_bits_ok(keys + 6)) {
+            memcpy(job->trailer[n], keys, 16);
+            job->has_trailer[n] = 1;
+            job->sectors[n] = 1;
+            continue;
+        }
+
+        fprintf(stderr, "%s:%d: bad line\n", job_path, *lineno);
+        return -1;
+    }
+
+    if (in_card) {
+        fprintf(stderr, "%s:%d: card without end\n", job_path, job->line);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Prefetch thread: keep up to PREFETCH parsed records ready.
+ */
+void *job_reader(void *arg)
+{
+    struct card_job *job;
+    int lineno = 0, seq = 0, res;
+
+    do {
+        pthread_mutex_lock(&queue.lock);
+        while (queue.count == PREFETCH)
+            pthread_cond_wait(&queue.cond, &queue.lock);
+        job = &queue.jobs[(queue.head + queue.count) % PREFETCH];
+        pthread_mutex_unlock(&queue.lock);
+
+        /* The slot is ours until it is counted in */
+        res = read_job(job, &lineno);
+        if (res == -1)
+            exit(EXIT_FAILURE);
+        job->seq = ++seq;
+        job->last = (res == 0);
+
+        pthread_mutex_lock(&queue.lock);
+        queue.count++;
+        pthread_cond_broadcast(&queue.cond);
+        pthread_mutex_unlock(&queue.lock);
+    } while (res == 1);
+
+    return NULL;
+}
+
+struct card_job *job_peek(void)
+{
+    struct card_job *job;
+
+    pthread_mutex_lock(&queue.lock);
+    while (queue.count == 0)
+        pthread_cond_wait(&queue.cond, &queue.lock);
+    job = &queue.jobs[queue.head];
+    pthread_mutex_unlock(&queue.lock);
+    return job;
+}
+
+void job_done(void)
+{
+    pthread_mutex_lock(&queue.lock);
+    queue.head = (queue.head + 1) % PREFETCH;
+    queue.count--;
+    pthread_cond_broadcast(&queue.cond);
+    pthread_mutex_unlock(&queue.lock);
+}
+
+/*
+ * Wait for a card other than 'prev', which is the card just done. It
+ * must have left the field before it counts as a new card.
+ */
+unsigned int wait_for_card(int fd, unsigned int prev)
+{
+    unsigned int card_no;
+
+    for (;;) {
+        if (rf_request(fd) == 0 && rf_anticoll(fd, &card_no) == 0 && card_no) {
+            if (card_no != prev)
+                return card_no;
+        } else {
+            prev = 0;
+        }
+        usleep(PRESENCE_POLL_US);
+    }
+}
+
+/*
+ * Authenticate 'sector' with the key of the blank card or, when an
+ * earlier try already wrote its trailer, with the new key A. 'done' is
+ * set in the latter case.
+ */
+uint8_t auth_sector(struct rf_session *s, struct card_job *job, int sector, int *done)
+{
+    uint8_t first = rf_M1_sector_block(sector);
+    uint8_t status;
+
+    *done = 0;
+    status = rf_session_auth(s, KEY_A, first, job->key);
+    if (status != 0 && job->has_trailer[sector]) {
+        status = rf_session_auth(s, KEY_A, first, job->trailer[sector]);
+        *done = (status == 0);
+    }
+    return status;
+}
+
+/*
+ * Write one card. Returns NULL on success or what went wrong in 'err'.
+ */
+const char *provision(struct rf_session *s, struct card_job *job, char *err)
+{
+    uint8_t data[16];
+    int sector, block, first, count, done;
+    uint8_t status;
+
+    for (sector=0; sector<MAX_SECTORS; sector++) {
+        if (!job->sectors[sector])
+            continue;
+        if (sector >= rf_M1_sectors(s->capacity)) {
+            sprintf(err, "sector %d not on card", sector);
+            return err;
+        }
+
+        first = rf_M1_sector_block(sector);
+        count = rf_M1_sector_blocks(sector);
+
+        status = auth_sector(s, job, sector, &done);
+        if (status != 0) {
+            sprintf(err, "auth sector %d status %u", sector, status);
+            return err;
+        }
+
+        for (block=first; block<first + count - 1; block++) {
+            if (!job->has_block[block])
+                continue;
+            status = rf_session_write(s, block, job->block[block]);
+            if (status != 0) {
+                sprintf(err, "write block %d status %u", block, status);
+                return err;
+            }
+        }
+
+        /* Verify under the same authentication */
+        for (block=first; block<first + count - 1; block++) {
+            if (!job->has_block[block])
+                continue;
+            status = rf_session_read(s, block, data);
+            if (status != 0 || memcmp(data, job->block[block], 16) != 0) {
+                sprintf(err, "verify block %d status %u", block, status);
+                return err;
+            }
+        }
+    }
+
+    /* Keys change only once all data is in, a failed card still opens */
+    for (sector=0; sector<MAX_SECTORS; sector++) {
+        if (!job->has_trailer[sector])
+            continue;
+
+        first = rf_M1_sector_block(sector);
+        count = rf_M1_sector_blocks(sector);
+
+        status = auth_sector(s, job, sector, &done);
+        if (status != 0) {
+            sprintf(err, "auth sector %d status %u", sector, status);
+            return err;
+        }
+        if (done)
+            continue;
+
+        status = rf_session_write(s, first + count - 1, job->trailer[sector]);
+        if (status != 0) {
+            sprintf(err, "write trailer %d status %u", sector, status);
+            return err;
+        }
+    }
+
+    return NULL;
+}
+
+void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-p port] [-l logfile] [-f] jobfile\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *port = "/dev/ttyUSB0";
+    const char *result;
+    char err[80];
+    FILE *log = stdout;
+    int fd, opt, fast = 0;
+    unsigned int card_no = 0;
+    uint8_t capacity;
+    struct rf_session s;
+    struct card_job *job;
+    pthread_t thread;
+    long long start, t0;
+    int done = 0, failed = 0;
+
+    while ((opt = getopt(argc, argv, "p:l:f")) != -1) {
+        switch (opt) {
+            case 'p':
+                port = optarg;
+                break;
+            case 'l':
+                log = fopen(optarg, "a");
+                if (log == NULL) {
+                    perror(optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'f':
+                /* Run the line at 115200 baud while provisioning */
+                fast = 1;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1)
+        usage(argv[0]);
+
+    job_path = argv[optind];
+    job_file = fopen(job_path, "r");
+    if (job_file == NULL) {
+        perror(job_path);
+        exit(EXIT_FAILURE);
+    }
+
+    fd = open_port_path(port);
+    if (fd == -1)
+        exit(EXIT_FAILURE);
+    if (fast)
+        rf_init_com(fd, BAUD_115200);
+    rf_light(fd, LED_OFF);
+    rf_session_init(&s, fd);
+
+    if (pthread_create(&thread, NULL, job_reader, NULL) != 0) {
+        fprintf(stderr, "Could not start the job reader\n");
+        exit(EXIT_FAILURE);
+    }
+
+    start = 0;
+    for (job = job_peek(); !job->last; job = job_peek()) {
+        fprintf(stderr, "Card %d: present a card...\n", job->seq);
+        card_no = wait_for_card(fd, card_no);
+        t0 = now_ms();
+        if (start == 0)
+            start = t0;
+
+        if (rf_select(fd, sizeof(card_no), (uint8_t*)&card_no, &capacity) != 0) {
+            result = "select failed";
+        } else {
+            rf_session_adopt(&s, (uint8_t*)&card_no, capacity);
+            result = provision(&s, job, err);
+        }
+        rf_session_halt(&s);
+
+        fprintf(log, "%ld %d %08x %s %lld ms\n", (long)time(NULL), job->seq, card_no,
+                result ? result : "ok", now_ms() - t0);
+        fflush(log);
+
+        if (result != NULL) {
+            /* Same record for the next card */
+            rf_light(fd, LED_RED);
+            failed++;
+            continue;
+        }
+
+        rf_light(fd, LED_GREEN);
+        rf_beep(fd, 5);
+        job_done();
+        done++;
+        if (done > 1) {
+            /* Counted from the first card, presenting it is not work done */
+            fprintf(stderr, "%d cards done, %.1f cards/min\n", done,
+                    (done - 1) * 60000.0 / max(now_ms() - start, 1));
+        }
+    }
+
+    fprintf(stderr, "Finished: %d cards, %d failures", done, failed);
+    if (done > 1) {
+        fprintf(stderr, ", %.1f cards/min", (done - 1) * 60000.0 / max(now_ms() - start, 1));
+    }
+    fprintf(stderr, "\n");
+
+    rf_light(fd, LED_OFF);
+    if (fast)
+        rf_init_com(fd, BAUD_19200);
+    return 0;
+}
@@ -0,0 +1,180 @@
+// vim: ts=4 expandtab ai
+
+/*
+ * Copyright (c) 2008, Henrik Torstensson <laban@kryo.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Times the select-and-read round of a gate: request, anticoll, select,
+ * authenticate, read block 4 and halt.
+ *
+ *     reader_bench [-n rounds]                     card model in memory
+ *     reader_bench [-n rounds] [-w file] port      real reader, optionally
+ *                                                  recording the session
+ *     reader_bench [-n rounds] -p file             replay of a recording
+ *
+ * The same round runs on every transport, so a recording made at a gate
+ * can be played back without the reader to check a change.
+ */
+
+#include "sl500_reader.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <unistd.h>
+
+/*
+ * MIFARE Classic 1K on an SL500, enough of it for the round.
+ */
+struct card_model {
+    uint8_t uid[4] = {0xde, 0xad, 0xbe, 0xef};
+    uint8_t blocks[64][16] = {};
+    bool selected = false;
+
+    int operator()(const sl500::command &cmd, uint8_t *data, int &data_len)
+    {
+        int i;
+
+        for (i=0; i<RF_CMDS; i++) {
+            if (memcmp(rf_commands[i].code, cmd.code, 2) == 0)
+                break;
+        }
+
+        switch (i) {
+            case RF_CMD_GET_MODEL:
+                data_len = 11;
+                memcpy(data, "SL500L-0608", data_len);
+                return 0x00;
+            case RF_CMD_GET_DEV:
+                data_len = 2;
+                data[0] = 0x00;
+                data[1] = 0x00;
+                return 0x00;
+            case RF_CMD_REQUEST:
+                data_len = 2;
+                data[0] = 0x04;
+                data[1] = 0x00;
+                return selected ? 0x01 : 0x00;
+            case RF_CMD_ANTICOLL:
+                data_len = 4;
+                memcpy(data, uid, 4);
+                return 0x00;
+            case RF_CMD_SELECT:
+                if (cmd.param_len != 4 || memcmp(cmd.param, uid, 4) != 0)
+                    return 0x01;
+                selected = true;
+                data_len = 1;
+                data[0] = 0x08;
+                return 0x00;
+            case RF_CMD_HALT:
+                selected = false;
+                return 0x00;
+            case RF_CMD_READ:
+                if (!selected || cmd.param[0] >= 64)
+                    return 0x01;
+                data_len = 16;
+                memcpy(data, blocks[cmd.param[0]], 16);
+                return 0x00;
+            case RF_CMD_WRITE:
+                if (!selected || cmd.param[0] >= 64)
+                    return 0x01;
+                memcpy(blocks[cmd.param[0]], &cmd.param[1], 16);
+                return 0x00;
+            case RF_CMD_AUTH:
+                return selected ? 0x00 : 0x01;
+            case RF_CMDS:
+                return 0x01;
+            default:
+                return 0x00;
+        }
+    }
+};
+
+template <typename Reader>
+static bool gate_round(Reader &r)
+{
+    static const uint8_t key[6] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
+    uint8_t block[16];
+    uint32_t card_no;
+
+    if (r.request() != 0x00 || r.anticoll(card_no) != 0x00 || r.select(card_no) != 0x00)
+        return false;
+    if (r.authenticate(KEY_A, 4, key) != 0x00 || r.read_block(4, block) != 0x00)
+        return false;
+    return r.halt() == 0x00;
+}
+
+template <typename Reader>
+static int bench(Reader &r, int rounds)
+{
+    int i, ok = 0;
+
+    auto start = sl500::clock::now();
+    for (i=0; i<rounds; i++)
+        ok += gate_round(r);
+    auto took = std::chrono::duration<double, std::micro>(sl500::clock::now() - start);
+
+    printf("%d rounds, %d with a card, %.2f us per round, %.2f us per command\n",
+           rounds, ok, took.count() / rounds, took.count() / rounds / 6);
+    return ok == rounds ? 0 : 1;
+}
+
+int main(int argc, char **argv)
+{
+    const char *record = nullptr, *replay = nullptr;
+    int opt, rounds = 100000;
+
+    while ((opt = getopt(argc, argv, "n:w:p:")) != -1) {
+        switch (opt) {
+            case 'n':
+                rounds = atoi(optarg);
+                break;
+            case 'w':
+                record = optarg;
+                break;
+            case 'p':
+                replay = optarg;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-n rounds] [-w recording] [port] | -p recording\n",
+                        argv[0]);
+                return 1;
+        }
+    }
+    if (rounds < 1)
+        rounds = 1;
+
+    try {
+        if (replay != nullptr) {
+            sl500::replay_reader r(replay);
+            return bench(r, rounds);
+        }
+        if (optind < argc && record != nullptr) {
+            sl500::basic_reader<sl500::recorder<sl500::serial_transport>> r(record, argv[optind]);
+            return bench(r, rounds);
+        }
+        if (optind < argc) {
+            sl500::serial_reader r(argv[optind]);
+            return bench(r, rounds);
+        }
+        sl500::basic_reader<sl500::loopback_transport<card_model>> r;
+        return bench(r, rounds);
+    } catch (const std::exception &e) {
+        fprintf(stderr, "%s\n", e.what());
+        return 1;
+    }
+}
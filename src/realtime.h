@@ -0,0 +1,33 @@
+// vim: ts=4 expandtab ai
+
+#ifndef REALTIME_H
+#define REALTIME_H
+
+/*
+ * Copyright (c) 2008, Henrik Torstensson <laban@kryo.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * 'realtime_start()' - Run the calling thread under SCHED_FIFO at
+ * 'priority', pinned to 'cpu' unless it is -1, and lock the process
+ * in memory so that a page fault never stalls a reader round trip.
+ * Steps that are not permitted are reported and skipped.
+ *
+ * Returns 0 if everything took, -1 otherwise.
+ */
+
+int realtime_start(int priority, int cpu);
+
+#endif
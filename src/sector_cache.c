@@ -0,0 +1,274 @@
+// vim: ts=4 expandtab ai
+
+/*
+ * Copyright (c) 2008, Henrik Torstensson <laban@kryo.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "sector_cache.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define SECTOR_CACHE_MAGIC (0x534c3543)    // "SL5C"
+#define SECTOR_BYTES 64
+#define PROBE_MAX 8
+
+struct cache_entry {
+    uint8_t uid[4];
+    uint32_t valid;                     // Bit n set when sector n is cached
+    uint64_t stamp;                     // Last use, for eviction
+    uint8_t data[SECTOR_CACHE_SECTORS][SECTOR_BYTES];
+};
+
+struct cache_hdr {
+    uint32_t magic;
+    uint32_t entries;
+    uint64_t clock;
+    struct cache_entry entry[];
+};
+
+struct sector_cache {
+    struct cache_hdr *hdr;
+    size_t map_size;
+    uint32_t ro_mask;
+    int version_block;
+    struct sector_cache_stats stats;
+};
+
+struct sector_cache *sector_cache_open(const char *path, int entries)
+{
+    struct sector_cache *c;
+    struct cache_hdr *hdr;
+    size_t bytes;
+    int fd;
+
+    bytes = sizeof(struct cache_hdr) + entries * sizeof(struct cache_entry);
+
+    if (path == NULL) {
+        hdr = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    } else {
+        fd = open(path, O_RDWR | O_CREAT, 0600);
+        if (fd == -1) {
+            perror("sector_cache_open");
+            return NULL;
+        }
+        if (ftruncate(fd, bytes) == -1) {
+            perror("sector_cache_open: ftruncate");
+            close(fd);
+            return NULL;
+        }
+        hdr = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+    }
+
+    if (hdr == MAP_FAILED) {
+        perror("sector_cache_open: mmap");
+        return NULL;
+    }
+
+    if (hdr->magic != SECTOR_CACHE_MAGIC || hdr->entries != entries) {
+        memset(hdr, 0, bytes);
+        hdr->magic = SECTOR_CACHE_MAGIC;
+        hdr->entries = entries;
+    }
+
+    c = calloc(1, sizeof(*c));
+    if (c == NULL) {
+        munmap(hdr, bytes);
+        return NULL;
+    }
+    c->hdr = hdr;
+    c->map_size = bytes;
+    c->version_block = -1;
+
+    return c;
+}
+
+void sector_cache_close(struct sector_cache *c)
+{
+    if (c == NULL)
+        return;
+    munmap(c->hdr, c->map_size);
+    free(c);
+}
+
+void sector_cache_set_policy(struct sector_cache *c, uint32_t ro_mask, int version_block)
+{
+    c->ro_mask = ro_mask;
+    c->version_block = (version_block >= 0 && version_block <= 2) ? version_block : -1;
+}
+
+static uint32_t uid_hash(const uint8_t uid[4])
+{
+    uint32_t h;
+
+    memcpy(&h, uid, sizeof(h));
+    h ^= h >> 16;
+    h *= 0x7feb352d;
+    h ^= h >> 15;
+    return h;
+}
+
+/*
+ * Find the entry for 'uid' within a short probe window. With 'create'
+ * set, take over an empty or the least recently used slot in the window
+ * if the card is not there.
+ */
+static struct cache_entry *find_entry(struct sector_cache *c, const uint8_t uid[4], int create)
+{
+    struct cache_hdr *hdr = c->hdr;
+    struct cache_entry *e, *victim = NULL;
+    uint32_t start = uid_hash(uid) % hdr->entries;
+    int i;
+
+    for (i=0; i<PROBE_MAX && i<hdr->entries; i++) {
+        e = &hdr->entry[(start + i) % hdr->entries];
+        if (e->valid && memcmp(e->uid, uid, 4) == 0) {
+            e->stamp = ++hdr->clock;
+            return e;
+        }
+        if (victim == NULL || e->valid == 0 ||
+                (victim->valid && e->stamp < victim->stamp)) {
+            victim = e;
+        }
+    }
+
+    if (!create)
+        return NULL;
+
+    memcpy(victim->uid, uid, 4);
+    victim->valid = 0;
+    victim->stamp = ++hdr->clock;
+    return victim;
+}
+
+static int cacheable(struct sector_cache *c, int sector)
+{
+    if (c == NULL || sector >= SECTOR_CACHE_SECTORS)
+        return 0;
+    return (c->ro_mask & (1u << sector)) || c->version_block >= 0;
+}
+
+int sector_cache_lookup(struct sector_cache *c, const uint8_t uid[4], int sector, uint8_t *data)
+{
+    struct cache_entry *e;
+
+    if (c == NULL || sector >= SECTOR_CACHE_SECTORS || !(c->ro_mask & (1u << sector)))
+        return 0;
+
+    e = find_entry(c, uid, 0);
+    if (e == NULL || !(e->valid & (1u << sector)))
+        return 0;
+
+    memcpy(data, e->data[sector], SECTOR_BYTES);
+    c->stats.hits++;
+    return 1;
+}
+
+void sector_cache_invalidate(struct sector_cache *c, const uint8_t uid[4], int sector)
+{
+    struct cache_entry *e;
+
+    if (c == NULL || sector >= SECTOR_CACHE_SECTORS)
+        return;
+
+    e = find_entry(c, uid, 0);
+    if (e != NULL)
+        e->valid &= ~(1u << sector);
+}
+
+uint8_t sector_cache_read(struct sector_cache *c, struct rf_session *s,
+                          uint8_t key_type, uint8_t key[6], int sector,
+                          uint8_t *data, uint16_t *len)
+{
+    struct cache_entry *e = NULL;
+    uint8_t first = rf_M1_sector_block(sector);
+    uint8_t version[16];
+    uint8_t status;
+    int vb = -1;
+    int i;
+
+    *len = 0;
+
+    /* Even a cached sector is only served to a key the card takes */
+    status = rf_session_auth(s, key_type, first, key);
+    if (status != 0)
+        return status;
+
+    if (cacheable(c, sector)) {
+        if (sector_cache_lookup(c, s->uid, sector, data)) {
+            *len = SECTOR_BYTES;
+            return 0;
+        }
+        e = find_entry(c, s->uid, 0);
+        if (e != NULL && (e->valid & (1u << sector)) &&
+                !(c->ro_mask & (1u << sector))) {
+            vb = c->version_block;
+        }
+    }
+
+    if (vb >= 0) {
+        status = rf_session_read(s, first + vb, version);
+        if (status != 0)
+            return status;
+        if (memcmp(version, e->data[sector] + vb * 16, 16) == 0) {
+            memcpy(data, e->data[sector], SECTOR_BYTES);
+            *len = SECTOR_BYTES;
+            c->stats.validated++;
+            return 0;
+        }
+    }
+
+    for (i=0; i<rf_M1_sector_blocks(sector); i++) {
+        if (i == vb) {
+            memcpy(&data[i * 16], version, 16);
+        } else {
+            status = rf_session_read(s, first + i, &data[i * 16]);
+            if (status != 0)
+                return status;
+        }
+        *len += 16;
+    }
+
+    if (cacheable(c, sector)) {
+        c->stats.misses++;
+        e = find_entry(c, s->uid, 1);
+        memcpy(e->data[sector], data, SECTOR_BYTES);
+        e->valid |= 1u << sector;
+    }
+
+    return 0;
+}
+
+uint8_t sector_cache_write(struct sector_cache *c, struct rf_session *s,
+                           uint8_t block, uint8_t *content)
+{
+    sector_cache_invalidate(c, s->uid, rf_M1_block_sector(block));
+    return rf_session_write(s, block, content);
+}
+
+void sector_cache_get_stats(struct sector_cache *c, struct sector_cache_stats *stats)
+{
+    if (c == NULL) {
+        memset(stats, 0, sizeof(*stats));
+        return;
+    }
+    *stats = c->stats;
+}
@@ -0,0 +1,106 @@
+// vim: ts=4 expandtab ai
+
+#ifndef SECTOR_CACHE_H
+#define SECTOR_CACHE_H
+
+/*
+ * Copyright (c) 2008, Henrik Torstensson <laban@kryo.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Cache of MIFARE Classic sector images keyed by card UID.
+ *
+ * Sectors listed as read-only in the policy are served from the cache
+ * once seen, after the sector has been authenticated on the card so
+ * that a wrong key or a card with a cloned UID gets nothing. Other
+ * sectors are revalidated by reading a
+ * single version block (a counter the application bumps on every
+ * write) and comparing it to the cached one, which saves the remaining
+ * block reads on a match. Writes go through to the card and drop the
+ * cached sector.
+ *
+ * The table can live in a file, so that it survives restarts, or in
+ * anonymous memory. Only the 4 block sectors (0-31) are cached.
+ */
+
+#include "sl500.h"
+
+#include <stdint.h>
+
+#define SECTOR_CACHE_SECTORS 32
+#define SECTOR_CACHE_ENTRIES 1024
+
+struct sector_cache;
+
+struct sector_cache_stats {
+    uint64_t hits;                      // Served without touching the card
+    uint64_t validated;                 // Served after a version block match
+    uint64_t misses;
+};
+
+/*
+ * 'sector_cache_open()' - Map the cache file at 'path', creating it if
+ * needed, or anonymous memory if 'path' is NULL.
+ *
+ * Returns NULL on error.
+ */
+
+struct sector_cache *sector_cache_open(const char *path, int entries);
+
+void sector_cache_close(struct sector_cache *c);
+
+/*
+ * 'sector_cache_set_policy()' - Set the read-only sectors (bit n for
+ * sector n) and the data block (0-2) within each other sector that
+ * holds its version, or -1 to not cache other sectors at all. The
+ * trailer cannot be the version: key A reads back masked and the
+ * trailer does not change when the data does.
+ */
+
+void sector_cache_set_policy(struct sector_cache *c, uint32_t ro_mask, int version_block);
+
+/*
+ * 'sector_cache_lookup()' - Copy a read-only sector from the cache.
+ *
+ * Returns 1 on a hit and 0 otherwise. Never talks to the card, the
+ * caller must have authenticated the sector first.
+ */
+
+int sector_cache_lookup(struct sector_cache *c, const uint8_t uid[4], int sector, uint8_t *data);
+
+void sector_cache_invalidate(struct sector_cache *c, const uint8_t uid[4], int sector);
+
+/*
+ * 'sector_cache_read()' - Read a whole sector through the cache.
+ *
+ * 'data' must hold 16 blocks. Returns the reader status and the number
+ * of bytes read in 'len'.
+ */
+
+uint8_t sector_cache_read(struct sector_cache *c, struct rf_session *s,
+                          uint8_t key_type, uint8_t key[6], int sector,
+                          uint8_t *data, uint16_t *len);
+
+/*
+ * 'sector_cache_write()' - Write a block and drop its sector from the
+ * cache.
+ */
+
+uint8_t sector_cache_write(struct sector_cache *c, struct rf_session *s,
+                           uint8_t block, uint8_t *content);
+
+void sector_cache_get_stats(struct sector_cache *c, struct sector_cache_stats *stats);
+
+#endif
@@ -25,11 +25,186 @@
 #include <errno.h>   /* Error number definitions */
 #include <termios.h> /* POSIX terminal control definitions */
 #include <assert.h>
+#include <linux/serial.h>
+#include <poll.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <sys/ioctl.h>
+#include <time.h>
+
+static void (*error_handler)(void) = NULL;
+static __thread jmp_buf *error_jmp = NULL;
+
+/* Device ID each port addresses its commands to, 0x0000 by default */
+static uint8_t device_ids[RF_MAX_FDS][2];
+static const uint8_t no_device[2];
+
+/* Input buffer of a port in low-latency mode */
+struct rx_buf {
+    int pos;
+    int len;
+    int timeout_ms;                     // 0 waits forever
+    uint8_t data[RF_FRAME_MAX];
+};
+
+static struct rx_buf *rx_bufs[RF_MAX_FDS];
+
+void rf_set_error_handler(void (*handler)(void))
+{
+    error_handler = handler;
+}
+
+jmp_buf *rf_set_error_jmp(jmp_buf *env)
+{
+    jmp_buf *prev = error_jmp;
+
+    error_jmp = env;
+    return prev;
+}
+
+void rf_set_device(int fd, const uint8_t dev_id[2])
+{
+    if (fd >= 0 && fd < RF_MAX_FDS) {
+        device_ids[fd][0] = dev_id[0];
+        device_ids[fd][1] = dev_id[1];
+    }
+}
+
+uint8_t *rf_device(int fd)
+{
+    if (fd >= 0 && fd < RF_MAX_FDS)
+        return device_ids[fd];
+    return (uint8_t*)no_device;
+}
+
+static struct rx_buf *rx_buf(int fd)
+{
+    if (fd >= 0 && fd < RF_MAX_FDS)
+        return rx_bufs[fd];
+    return NULL;
+}
+
+int rf_set_timeout(int fd, int tenths)
+{
+    struct termios options;
+    struct rx_buf *b = rx_buf(fd);
+
+    if (tcgetattr(fd, &options) == -1)
+        return -1;
+    if (b != NULL) {
+        /*
+         * Every read waits in poll() and then takes whatever is in, so
+         * an answer that arrives in several USB packets is not held up
+         * by an inter-byte timer in the driver.
+         */
+        b->timeout_ms = tenths * 100;
+        options.c_cc[VMIN] = 0;
+        options.c_cc[VTIME] = 0;
+    } else {
+        options.c_cc[VMIN] = (tenths > 0) ? 0 : 1;
+        options.c_cc[VTIME] = tenths;
+    }
+    return tcsetattr(fd, TCSANOW, &options);
+}
+
+/*
+ * Lower the latency timer of an FTDI adapter, which holds back short
+ * reads for 16 ms by default.
+ */
+static int set_latency_timer(int fd)
+{
+    char name[64], path[128];
+    const char *base;
+    int sysfd, ok;
+
+    if (ttyname_r(fd, name, sizeof(name)) != 0)
+        return -1;
+    base = strrchr(name, '/');
+    snprintf(path, sizeof(path), "/sys/class/tty/%s/device/latency_timer",
+             base != NULL ? base + 1 : name);
+
+    sysfd = open(path, O_WRONLY);
+    if (sysfd == -1)
+        return -1;
+    ok = (write(sysfd, "1", 1) == 1);
+    close(sysfd);
+    return ok ? 0 : -1;
+}
+
+int rf_set_low_latency(int fd)
+{
+    struct serial_struct serial;
+    struct termios options;
+    struct rx_buf *b;
+    int set = 0, tenths;
+
+    if (fd < 0 || fd >= RF_MAX_FDS || tcgetattr(fd, &options) == -1)
+        return -1;
+
+    if (ioctl(fd, TIOCGSERIAL, &serial) == 0) {
+        serial.flags |= ASYNC_LOW_LATENCY;
+        if (ioctl(fd, TIOCSSERIAL, &serial) == 0)
+            set |= RF_LL_SERIAL;
+    }
+    if (set_latency_timer(fd) == 0)
+        set |= RF_LL_TIMER;
+
+    /* Keep the timeout the port had */
+    b = rx_bufs[fd];
+    if (b == NULL) {
+        tenths = (options.c_cc[VMIN] == 0) ? options.c_cc[VTIME] : 0;
+        b = calloc(1, sizeof(*b));
+        if (b == NULL)
+            return set;
+        rx_bufs[fd] = b;
+    } else {
+        tenths = b->timeout_ms / 100;
+    }
+
+    if (rf_set_timeout(fd, tenths) == -1) {
+        rx_bufs[fd] = NULL;
+        free(b);
+        return set;
+    }
+    return set | RF_LL_FRAMED;
+}
+
+uint8_t rf_measure_rtt(int fd, int rounds, struct rf_rtt *rtt)
+{
+    struct timespec t0, t1;
+    uint8_t dev_id[2];
+    uint8_t status;
+    long us, total = 0;
+    int i;
+
+    memset(rtt, 0, sizeof(*rtt));
+    for (i=0; i<rounds; i++) {
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        status = rf_get_device_number(fd, dev_id);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        if (status != 0)
+            return status;
+
+        us = (t1.tv_sec - t0.tv_sec) * 1000000 + (t1.tv_nsec - t0.tv_nsec) / 1000;
+        if (i == 0 || us < rtt->min_us)
+            rtt->min_us = us;
+        if (us > rtt->max_us)
+            rtt->max_us = us;
+        total += us;
+        rtt->rounds++;
+    }
+    if (rtt->rounds > 0)
+        rtt->avg_us = total / rtt->rounds;
+    return 0;
+}
 
 void comm_error()
 {
+    if (error_jmp != NULL)
+        longjmp(*error_jmp, 1);
+    if (error_handler != NULL)
+        error_handler();
+
     fprintf(stderr, "Communication error, aborting!\n");
     exit(1);
 }
@@ -41,24 +216,37 @@ void comm_error()
  */
 
 int open_port(void)
+{
+    return open_port_path("/dev/ttyUSB0");
+}
+
+int open_port_path(const char *path)
 {
     int fd; /* File descriptor for the port */
 
 
-    fd = open("/dev/ttyUSB0", O_RDWR | O_NOCTTY | O_NDELAY);
+    fd = open(path, O_RDWR | O_NOCTTY | O_NDELAY);
     if (fd == -1)
     {
         /*
          * Could not open the port.
          */
 
-        perror("open_port: Unable to open /dev/ttyUSB0 - ");
+        fprintf(stderr, "open_port: Unable to open %s - %s\n", path, strerror(errno));
+        return -1;
     }
     else
     {
         fcntl(fd, F_SETFL, 0);
     }
 
+    /* Forget the settings of an earlier port with this number */
+    rf_set_device(fd, no_device);
+    if (rx_buf(fd) != NULL) {
+        free(rx_bufs[fd]);
+        rx_bufs[fd] = NULL;
+    }
+
     struct termios options;
     tcgetattr(fd, &options);
     cfsetispeed(&options, B19200);
@@ -70,9 +258,37 @@ int open_port(void)
     return fd;
 }
 
+/*
+ * Refill the input buffer of a low-latency port. Returns the number of
+ * bytes read, 0 or less on timeout or error.
+ */
+static int rx_fill(int fd, struct rx_buf *b)
+{
+    struct pollfd pfd;
+    int n;
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, b->timeout_ms > 0 ? b->timeout_ms : -1) != 1)
+        return -1;
+
+    n = read(fd, b->data, sizeof(b->data));
+    b->pos = 0;
+    b->len = (n > 0) ? n : 0;
+    return n;
+}
+
 uint8_t get_byte(int fd)
 {
+    struct rx_buf *b = rx_buf(fd);
     uint8_t res;
+
+    if (b != NULL) {
+        if (b->pos == b->len && rx_fill(fd, b) <= 0)
+            comm_error();
+        return b->data[b->pos++];
+    }
+
     if (read(fd, &res, 1) != 1)
         comm_error();
     return res;
@@ -83,76 +299,98 @@ void expect(int fd, uint8_t expected)
     uint8_t res = get_byte(fd);
     if (res != expected) {
         fprintf(stderr, "Expected 0x%02hhx, but got 0x%02hhx.\n", expected, res);
-        exit(1);
+        comm_error();
+    }
+}
+
+/*
+ * Every 0xaa after the command head is followed by a 0x00, so that the
+ * head can not appear inside a frame. Drop it.
+ */
+static uint8_t get_frame_byte(int fd)
+{
+    uint8_t res = get_byte(fd);
+
+    if (res == 0xaa)
+        expect(fd, 0x00);
+    return res;
+}
+
+int rf_build_frame(uint8_t *buf, uint8_t dev_id[2], uint8_t cmd_code[2],
+                   uint8_t param_len, uint8_t *param)
+{
+    uint8_t body[RF_PARAM_MAX + 6];
+    uint8_t ver = 0x00;
+    int i, len = 0;
+
+    if (param_len > RF_PARAM_MAX)
+        return -1;
+
+    body[0] = 5 + param_len;            // Length
+    body[1] = 0x00;
+    body[2] = dev_id[0];                // Device ID
+    body[3] = dev_id[1];
+    body[4] = cmd_code[0];              // Command code
+    body[5] = cmd_code[1];
+    if (param_len > 0)
+        memcpy(&body[6], param, param_len);
+
+    /* Verification covers everything from the device ID on */
+    for (i=2; i<6 + param_len; i++)
+        ver ^= body[i];
+
+    buf[len++] = 0xaa;                  // Command head
+    buf[len++] = 0xbb;
+    for (i=0; i<6 + param_len; i++) {
+        buf[len++] = body[i];
+        /* Avoid writing the command head 0xaabb */
+        if (body[i] == 0xaa)
+            buf[len++] = 0x00;
     }
+    buf[len++] = ver;
+    if (ver == 0xaa)
+        buf[len++] = 0x00;
+
+    return len;
 }
 
 void send_command(int fd, uint8_t dev_id[2], uint8_t cmd_code[2],
                   uint8_t param_len, uint8_t *param)
 {
-    uint8_t buf[8];
-    uint8_t ver = 0x00;
-    const uint8_t zero = 0x00;
-    int i;
+    uint8_t buf[RF_FRAME_MAX];
+    int len;
 #ifdef DEBUG_LOW_LEVEL
-    char printbuf[100 + param_len * 10];
-    int pos = 0;
+    char printbuf[100 + RF_FRAME_MAX * 3];
+    int i, pos = 0;
 #endif
 
-    buf[0] = 0xaa;                      // Command head
-    buf[1] = 0xbb;
-    buf[2] = 5 + param_len;             // Length
-    buf[3] = 0x00;
-    buf[4] = dev_id[0];                 // Device ID
-    buf[5] = dev_id[1];
-    buf[6] = cmd_code[0];               // Command code
-    buf[7] = cmd_code[1];
+    len = rf_build_frame(buf, dev_id, cmd_code, param_len, param);
+    if (len == -1) {
+        fprintf(stderr, "send_command: %d parameter bytes is too long\n", param_len);
+        return;
+    }
 
 #ifdef DEBUG_LOW_LEVEL
-    fprintf(stderr, "¤¤¤ COMMAND   Length: %2d, Command code: %02hhx %02hhx, Parameter: ", buf[2], cmd_code[0], cmd_code[1]);
+    fprintf(stderr, "¤¤¤ COMMAND   Length: %2d, Command code: %02hhx %02hhx, Parameter: ", 5 + param_len, cmd_code[0], cmd_code[1]);
     for (i=0; i<param_len; i++)
     {
         pos += sprintf(&printbuf[pos], "%02hhx ", param[i]);
     }
     pos += sprintf(&printbuf[pos], "\nSent bytes: ");
-    for (i=0; i<8; i++)
+    for (i=0; i<len; i++)
     {
         pos += sprintf(&printbuf[pos], "%02hhx ", buf[i]);
     }
-#endif
-
-    write(fd, buf, 8);
-
-    /* Calculate verification of sent bytes */
-    for (i=4; i<8; i++)
-        ver ^= buf[i];
-
-    for (i=0; i<param_len; i++) {
-        ver ^= param[i];
-        write(fd, &param[i], 1);
-#ifdef DEBUG_LOW_LEVEL
-        pos += sprintf(&printbuf[pos], "%02hhx ", param[i]);
-#endif
-
-        /* Avoid writing the command head 0xaabb */
-        if (param[i] == 0xaa) {
-#ifdef DEBUG_LOW_LEVEL
-            pos += sprintf(&printbuf[pos], "0x00 ");
-#endif
-            write(fd, &zero, 1);
-        }
-    }
-
-    /* Write verification */
-    write(fd, &ver, 1);
-#ifdef DEBUG_LOW_LEVEL
-    pos += sprintf(&printbuf[pos], "%02hhx", ver);
     fprintf(stderr, "%s\n", printbuf);
 #endif
+
+    /* One write per frame, so it goes out in as few USB packets as possible */
+    if (write(fd, buf, len) != len)
+        comm_error();
 }
 
-int receive_response(int fd, uint8_t *dev_id, uint8_t *cmd_code,
-                     uint8_t *status, int data_len, uint8_t *data)
+static int receive_frame(int fd, uint8_t *dev_id, uint8_t *cmd_code,
+                         uint8_t *status, int data_len, uint8_t *data)
 {
     uint8_t len, tmp[2];
     uint8_t ver = 0x00;
@@ -168,26 +406,25 @@ int receive_response(int fd, uint8_t *dev_id, uint8_t *cmd_code,
 
     expect(fd, 0xaa);                   // Command head
     expect(fd, 0xbb);
-    len = get_byte(fd);                 // Length
+    len = get_frame_byte(fd);           // Length
     expect(fd, 0x00);
 
 #ifdef DEBUG_LOW_LEVEL
     pos += sprintf(&printbuf[pos], "Length: %02hhx, ", len);
 #endif
 
-    tmp[0] = get_byte(fd);              // Device ID
-    tmp[1] = get_byte(fd);
+    tmp[0] = get_frame_byte(fd);        // Device ID
+    tmp[1] = get_frame_byte(fd);
     ver ^= tmp[0];
     ver ^= tmp[1];
 #ifdef DEBUG_LOW_LEVEL
     pos += sprintf(&printbuf[pos], "Device ID: %02hhx %02hhx, ", tmp[0], tmp[1]);
 #endif
-    if (dev_id != NULL) {
-        *dev_id = tmp[0];
-    }
+    dev_id[0] = tmp[0];
+    dev_id[1] = tmp[1];
 
-    tmp[0] = get_byte(fd);              // Command code
-    tmp[1] = get_byte(fd);
+    tmp[0] = get_frame_byte(fd);        // Command code
+    tmp[1] = get_frame_byte(fd);
     ver ^= tmp[0];
     ver ^= tmp[1];
     if (cmd_code != NULL) {
@@ -198,7 +435,7 @@ int receive_response(int fd, uint8_t *dev_id, uint8_t *cmd_code,
     pos += sprintf(&printbuf[pos], "Command code: %02hhx %02hhx, ", tmp[0], tmp[1]);
 #endif
 
-    tmp[0] = get_byte(fd);              // Status
+    tmp[0] = get_frame_byte(fd);        // Status
     ver ^= tmp[0];
     if (status != NULL) {
         *status = tmp[0];
@@ -208,7 +445,7 @@ int receive_response(int fd, uint8_t *dev_id, uint8_t *cmd_code,
 #endif
 
     for (i=0; i<len-6; i++) {
-        tmp[0] = get_byte(fd);          // Data range
+        tmp[0] = get_frame_byte(fd);    // Data range
         ver ^= tmp[0];
         if (i<data_len && data != NULL) {
             data[i] = tmp[0];
@@ -216,16 +453,13 @@ int receive_response(int fd, uint8_t *dev_id, uint8_t *cmd_code,
 #ifdef DEBUG_LOW_LEVEL
         pos += sprintf(&printbuf[pos], "%02hhx ", data[i]);
 #endif
-        if (tmp[0] == 0xaa) {
-            expect(fd, 0x00);
-        }
     }
 #ifdef DEBUG_LOW_LEVEL
     fprintf(stderr, "%s\n", printbuf);
 #endif
 
     //expect(fd, ver);                    // Verification
-    act_ver = get_byte(fd); // Just consume verification for now
+    act_ver = get_frame_byte(fd); // Just consume verification for now
 
     if (act_ver != ver) {
         printf("WARNING: Verification should be %02hhx but was %02hhx.\n", ver, act_ver);
@@ -234,161 +468,275 @@ int receive_response(int fd, uint8_t *dev_id, uint8_t *cmd_code,
     return len-6;
 }
 
-uint8_t rf_init_com(int fd, uint8_t rate)
+int receive_response(int fd, uint8_t *dev_id, uint8_t *cmd_code,
+                     uint8_t *status, int data_len, uint8_t *data)
 {
-    uint8_t cmd_code[] = {0x01, 0x01};
-    uint8_t dev[] = {0x00, 0x00};
-    uint8_t status;
-    struct termios options;
-    speed_t new_speed;
-
-    /* Handle unsupported baud rates */
-    if (rate == BAUD_14400 || rate == BAUD_28800 || rate > BAUD_115200)
-        return -1;
+    uint8_t *want = rf_device(fd);
+    uint8_t got[2];
+    int count;
 
-    send_command(fd, dev, cmd_code, 1, &rate);
-    receive_response(fd, NULL, NULL, &status, 0, NULL);
+    /*
+     * On a shared bus a late answer from a device that was given up on
+     * can still arrive. Only the addressed device's answer counts.
+     */
+    for (;;) {
+        count = receive_frame(fd, got, cmd_code, status, data_len, data);
+        if ((want[0] == 0x00 && want[1] == 0x00) || memcmp(got, want, 2) == 0)
+            break;
+        fprintf(stderr, "receive_response: Dropped answer from device %02hhx%02hhx.\n",
+                got[0], got[1]);
+    }
 
-    if (status == 0x00) {
-        tcgetattr(fd, &options);
-        switch (rate) {
-            case BAUD_4800:
-                new_speed = B4800;
-                break;
-            case BAUD_9600:
-                new_speed = B9600;
-                break;
-            case BAUD_19200:
-                new_speed = B19200;
-                break;
-            case BAUD_38400:
-                new_speed = B38400;
-                break;
-            case BAUD_57600:
-                new_speed = B57600;
-                break;
-            case BAUD_115200:
-                new_speed = B115200;
-                break;
-            default:
-                new_speed = cfgetispeed(&options);
-        }
-        cfsetispeed(&options, new_speed);
-        cfsetospeed(&options, new_speed);
-        tcsetattr(fd, TCSANOW, &options);
+    if (dev_id != NULL) {
+        dev_id[0] = got[0];
+        dev_id[1] = got[1];
     }
 
-    return status;
+    return count;
 }
 
-uint8_t rf_get_model(int fd, int data_len, uint8_t *data)
+/*
+ * Command table. Data lengths are those of a successful answer; failed
+ * commands may answer with anything.
+ */
+const struct rf_command rf_commands[RF_CMDS] = {
+    [RF_CMD_INIT_COM]   = {{RF_CODE_INIT_COM},  1, 0, 0},
+    [RF_CMD_GET_MODEL]  = {{RF_CODE_GET_MODEL}, 0, 1, 32},
+    [RF_CMD_INIT_DEV]   = {{RF_CODE_INIT_DEV},  2, 0, 0},
+    [RF_CMD_GET_DEV]    = {{RF_CODE_GET_DEV},   0, 2, 2},
+    [RF_CMD_BEEP]       = {{RF_CODE_BEEP},      1, 0, 0},
+    [RF_CMD_LIGHT]      = {{RF_CODE_LIGHT},     1, 0, 0},
+    [RF_CMD_INIT_TYPE]  = {{RF_CODE_INIT_TYPE}, 1, 0, 0},
+    [RF_CMD_ANTENNA]    = {{RF_CODE_ANTENNA},   1, 0, 0},
+    [RF_CMD_REQUEST]    = {{RF_CODE_REQUEST},   1, 2, 2},
+    [RF_CMD_ANTICOLL]   = {{RF_CODE_ANTICOLL},  0, 4, 10},
+    [RF_CMD_SELECT]     = {{RF_CODE_SELECT},    4, 1, 1},
+    [RF_CMD_HALT]       = {{RF_CODE_HALT},      0, 0, 16},
+    [RF_CMD_AUTH]       = {{RF_CODE_AUTH},      8, 0, 16},
+    [RF_CMD_READ]       = {{RF_CODE_READ},      1, 16, 16},
+    [RF_CMD_WRITE]      = {{RF_CODE_WRITE},     17, 0, 16},
+    [RF_CMD_UL_SELECT]  = {{RF_CODE_UL_SELECT}, 0, 7, 7},
+    [RF_CMD_UL_WRITE]   = {{RF_CODE_UL_WRITE},  5, 0, 16},
+};
+
+/*
+ * Frames of commands without variable parameters, encoded by the
+ * compiler for device 0x0000. None of their bytes is 0xaa, so there is
+ * no stuffing and the verification byte is last.
+ */
+struct rf_frame {
+    uint8_t cmd;
+    uint8_t len;
+    uint8_t buf[10];
+};
+
+#define FRAME0_(c0, c1)     9, {0xaa, 0xbb, 0x05, 0x00, 0x00, 0x00, c0, c1, (c0) ^ (c1)}
+#define FRAME1_(c0, c1, p)  10, {0xaa, 0xbb, 0x06, 0x00, 0x00, 0x00, c0, c1, p, (c0) ^ (c1) ^ (p)}
+#define FRAME0(code)        FRAME0_(code)
+#define FRAME1(code, p)     FRAME1_(code, p)
+
+static const struct rf_frame frame_get_model = {RF_CMD_GET_MODEL, FRAME0(RF_CODE_GET_MODEL)};
+static const struct rf_frame frame_get_dev = {RF_CMD_GET_DEV, FRAME0(RF_CODE_GET_DEV)};
+static const struct rf_frame frame_request = {RF_CMD_REQUEST, FRAME1(RF_CODE_REQUEST, REQ_ALL)};
+static const struct rf_frame frame_anticoll = {RF_CMD_ANTICOLL, FRAME0(RF_CODE_ANTICOLL)};
+static const struct rf_frame frame_halt = {RF_CMD_HALT, FRAME0(RF_CODE_HALT)};
+static const struct rf_frame frame_light[4] = {
+    {RF_CMD_LIGHT, FRAME1(RF_CODE_LIGHT, LED_OFF)},
+    {RF_CMD_LIGHT, FRAME1(RF_CODE_LIGHT, LED_RED)},
+    {RF_CMD_LIGHT, FRAME1(RF_CODE_LIGHT, LED_GREEN)},
+    {RF_CMD_LIGHT, FRAME1(RF_CODE_LIGHT, LED_RED | LED_GREEN)},
+};
+
+/*
+ * Read the answer to 'cmd' and check that it is one: the command code
+ * must match and a successful answer must have a sensible length.
+ */
+static uint8_t finish(int fd, int cmd, int data_len, uint8_t *data, int *count)
 {
-    uint8_t cmd_code[] = {0x04, 0x01};
-    uint8_t dev[] = {0x00, 0x00};
+    const struct rf_command *c = &rf_commands[cmd];
+    uint8_t code[2];
     uint8_t status;
+    int n;
+
+    n = receive_response(fd, NULL, code, &status, data_len, data);
+    if (count != NULL)
+        *count = n;
 
-    send_command(fd, dev, cmd_code, 0, NULL);
-    receive_response(fd, NULL, NULL, &status, data_len, data);
+    if (code[0] != c->code[0] || code[1] != c->code[1]) {
+        fprintf(stderr, "rf_transact: Answer %02hhx%02hhx to command %02hhx%02hhx\n",
+                code[0], code[1], c->code[0], c->code[1]);
+        return RF_ERR_BAD_ANSWER;
+    }
+    if (status == 0x00 && (n < c->data_min || n > c->data_max)) {
+        fprintf(stderr, "rf_transact: %d data bytes in answer to %02hhx%02hhx\n",
+                n, c->code[0], c->code[1]);
+        return RF_ERR_BAD_ANSWER;
+    }
 
     return status;
 }
 
-uint8_t rf_init_device_number(int fd, uint8_t dev_id[2])
+uint8_t rf_transact(int fd, int cmd, uint8_t param_len, uint8_t *param,
+                    int data_len, uint8_t *data, int *count)
 {
-    uint8_t cmd_code[] = {0x02, 0x01};
-    uint8_t dev[] = {0x00, 0x00};
-    uint8_t status;
+    const struct rf_command *c = &rf_commands[cmd];
 
-    send_command(fd, dev, cmd_code, 2, dev_id);
-    receive_response(fd, NULL, NULL, &status, 0, NULL);
+    assert(cmd >= 0 && cmd < RF_CMDS && param_len == c->param_len);
 
-    return status;
+    send_command(fd, rf_device(fd), (uint8_t*)c->code, param_len, param);
+    return finish(fd, cmd, data_len, data, count);
 }
 
-uint8_t rf_get_device_number(int fd, uint8_t *dev_id)
+/*
+ * Send a prebuilt frame. Only the device ID and the verification byte
+ * need patching for an addressed reader.
+ */
+static uint8_t transact_frame(int fd, const struct rf_frame *f,
+                              int data_len, uint8_t *data, int *count)
 {
-    uint8_t cmd_code[] = {0x03, 0x01};
-    uint8_t dev[] = {0x00, 0x00};
-    uint8_t status;
+    const struct rf_command *c = &rf_commands[f->cmd];
+    uint8_t *dev = rf_device(fd);
+    uint8_t buf[sizeof(f->buf)];
+    const uint8_t *out = f->buf;
+    uint8_t ver;
+
+    if (dev[0] != 0x00 || dev[1] != 0x00) {
+        ver = f->buf[f->len - 1] ^ dev[0] ^ dev[1];
+        if (dev[0] == 0xaa || dev[1] == 0xaa || ver == 0xaa) {
+            /* Would need stuffing, encode it the slow way */
+            return rf_transact(fd, f->cmd, c->param_len, (uint8_t*)&f->buf[8],
+                               data_len, data, count);
+        }
+        memcpy(buf, f->buf, f->len);
+        buf[4] = dev[0];
+        buf[5] = dev[1];
+        buf[f->len - 1] = ver;
+        out = buf;
+    }
 
-    send_command(fd, dev, cmd_code, 0, NULL);
-    receive_response(fd, NULL, NULL, &status, 2, dev_id);
+    if (write(fd, out, f->len) != f->len)
+        comm_error();
+    return finish(fd, f->cmd, data_len, data, count);
+}
 
-    return status;
+int rf_set_speed(int fd, uint8_t rate)
+{
+    struct termios options;
+    speed_t speed;
+
+    switch (rate) {
+        case BAUD_4800:
+            speed = B4800;
+            break;
+        case BAUD_9600:
+            speed = B9600;
+            break;
+        case BAUD_19200:
+            speed = B19200;
+            break;
+        case BAUD_38400:
+            speed = B38400;
+            break;
+        case BAUD_57600:
+            speed = B57600;
+            break;
+        case BAUD_115200:
+            speed = B115200;
+            break;
+        default:
+            /* 14400 and 28800 have no termios speed */
+            return -1;
+    }
+
+    if (tcgetattr(fd, &options) == -1)
+        return -1;
+    cfsetispeed(&options, speed);
+    cfsetospeed(&options, speed);
+    return tcsetattr(fd, TCSANOW, &options);
 }
 
-uint8_t rf_beep(int fd, uint8_t time)
+uint8_t rf_init_com(int fd, uint8_t rate)
 {
-    uint8_t cmd_code[] = {0x06, 0x01};
-    uint8_t dev[] = {0x00, 0x00};
     uint8_t status;
 
-    send_command(fd, dev, cmd_code, 1, &time);
-    receive_response(fd, NULL, NULL, &status, 0, NULL);
+    /* Handle unsupported baud rates */
+    if (rate == BAUD_14400 || rate == BAUD_28800 || rate > BAUD_115200)
+        return -1;
+
+    status = rf_transact(fd, RF_CMD_INIT_COM, 1, &rate, 0, NULL, NULL);
+
+    if (status == 0x00) {
+        rf_set_speed(fd, rate);
+    }
 
     return status;
 }
 
-uint8_t rf_light(int fd, uint8_t color)
+uint8_t rf_get_model(int fd, int data_len, uint8_t *data)
 {
-    uint8_t cmd_code[] = {0x07, 0x01};
-    uint8_t dev[] = {0x00, 0x00};
+    return transact_frame(fd, &frame_get_model, data_len, data, NULL);
+}
+
+uint8_t rf_init_device_number(int fd, uint8_t dev_id[2])
+{
+    uint8_t *dev = rf_device(fd);
     uint8_t status;
 
-    send_command(fd, dev, cmd_code, 1, &color);
-    receive_response(fd, NULL, NULL, &status, 0, NULL);
+    status = rf_transact(fd, RF_CMD_INIT_DEV, 2, dev_id, 0, NULL, NULL);
+
+    /* An addressed reader only answers to its new number from now on */
+    if (status == 0x00 && (dev[0] != 0x00 || dev[1] != 0x00))
+        rf_set_device(fd, dev_id);
 
     return status;
 }
 
-uint8_t rf_init_type(int fd, uint8_t mode)
+uint8_t rf_get_device_number(int fd, uint8_t *dev_id)
 {
-    uint8_t cmd_code[] = {0x08, 0x01};
-    uint8_t dev[] = {0x00, 0x00};
-    uint8_t status;
-
-    send_command(fd, dev, cmd_code, 1, &mode);
-    receive_response(fd, NULL, NULL, &status, 0, NULL);
+    return transact_frame(fd, &frame_get_dev, 2, dev_id, NULL);
+}
 
-    return status;
+uint8_t rf_beep(int fd, uint8_t time)
+{
+    return rf_transact(fd, RF_CMD_BEEP, 1, &time, 0, NULL, NULL);
 }
 
-uint8_t rf_antenna_sta(int fd, uint8_t state)
+uint8_t rf_light(int fd, uint8_t color)
 {
-    uint8_t cmd_code[] = {0x0c, 0x01};
-    uint8_t dev[] = {0x00, 0x00};
-    uint8_t status;
+    if (color <= (LED_RED | LED_GREEN))
+        return transact_frame(fd, &frame_light[color], 0, NULL, NULL);
+    return rf_transact(fd, RF_CMD_LIGHT, 1, &color, 0, NULL, NULL);
+}
 
-    send_command(fd, dev, cmd_code, 1, &state);
-    receive_response(fd, NULL, NULL, &status, 0, NULL);
+uint8_t rf_init_type(int fd, uint8_t mode)
+{
+    return rf_transact(fd, RF_CMD_INIT_TYPE, 1, &mode, 0, NULL, NULL);
+}
 
-    return status;
+uint8_t rf_antenna_sta(int fd, uint8_t state)
+{
+    return rf_transact(fd, RF_CMD_ANTENNA, 1, &state, 0, NULL, NULL);
 }
 
 uint8_t rf_request(int fd)
 {
-    uint8_t cmd_code[] = {0x01, 0x02};
-    uint8_t dev[] = {0x00, 0x00};
-    uint8_t buf[100];
-    uint8_t mode = REQ_ALL;
-    uint8_t status;
+    uint8_t buf[2];
 
-    send_command(fd, dev, cmd_code, 1, &mode);
-    receive_response(fd, NULL, NULL, &status, sizeof(buf), buf);
+    return transact_frame(fd, &frame_request, sizeof(buf), buf, NULL);
+}
 
-    return status;
+uint8_t rf_request_type(int fd, uint8_t atqa[2])
+{
+    return transact_frame(fd, &frame_request, 2, atqa, NULL);
 }
 
 uint8_t rf_anticoll(int fd, unsigned int *card_no)
 {
-    uint8_t cmd_code[] = {0x02, 0x02};
-    uint8_t dev[] = {0x00, 0x00};
-    uint8_t buf[100];
+    uint8_t buf[10];
     uint8_t status;
     int count;
 
-    send_command(fd, dev, cmd_code, 0, NULL);
-    count = receive_response(fd, NULL, NULL, &status, sizeof(buf), buf);
+    status = transact_frame(fd, &frame_anticoll, sizeof(buf), buf, &count);
 
     if (status == 0x00) {
         /* If the card ID is 4 bytes,
@@ -419,15 +767,12 @@ uint8_t rf_anticoll(int fd, unsigned int *card_no)
     return status;
 }
 
-uint8_t rf_select(int fd, int cardnbr_size, uint8_t *cardnbr)
+uint8_t rf_select(int fd, int cardnbr_size, uint8_t *cardnbr, uint8_t *capacity)
 {
-    uint8_t cmd_code[] = {0x03, 0x02};
-    uint8_t dev[] = {0x00, 0x00};
-    uint8_t buf[100];
+    uint8_t buf[1];
     uint8_t status;
 
-    send_command(fd, dev, cmd_code, cardnbr_size, cardnbr);
-    receive_response(fd, NULL, NULL, &status, sizeof(buf), buf);
+    status = rf_transact(fd, RF_CMD_SELECT, cardnbr_size, cardnbr, sizeof(buf), buf, NULL);
 
 #ifdef DEBUG_COMMANDS
     if (status == 0) {
@@ -437,28 +782,20 @@ uint8_t rf_select(int fd, int cardnbr_size, uint8_t *cardnbr)
     }
 #endif
 
+    if (capacity != NULL) {
+        *capacity = (status == 0) ? buf[0] : 0;
+    }
+
     return status;
 }
 
 uint8_t rf_halt(int fd)
 {
-    uint8_t cmd_code[] = {0x04, 0x02};
-    uint8_t dev[] = {0x00, 0x00};
-    uint8_t buf[100];
-    uint8_t status;
-
-    send_command(fd, dev, cmd_code, 0, NULL);
-    receive_response(fd, NULL, NULL, &status, sizeof(buf), buf);
-
-    return status;
+    return transact_frame(fd, &frame_halt, 0, NULL, NULL);
 }
 
 uint8_t rf_M1_authentication2(int fd, uint8_t key_type, uint8_t block, uint8_t key[6])
 {
-    uint8_t cmd_code[] = {0x07, 0x02};
-    uint8_t dev[] = {0x00, 0x00};
-    uint8_t buf[100];
-    uint8_t status;
     int i;
     uint8_t data[8] = {key_type, block};
     memcpy(&data[2], key, 6);
@@ -473,23 +810,17 @@ uint8_t rf_M1_authentication2(int fd, uint8_t key_type, uint8_t block, uint8_t k
     fprintf(stderr, "...\n");
 #endif
 
-    send_command(fd, dev, cmd_code, sizeof(data), data);
-    receive_response(fd, NULL, NULL, &status, sizeof(buf), buf);
-
-    return status;
+    return rf_transact(fd, RF_CMD_AUTH, sizeof(data), data, 0, NULL, NULL);
 }
 
 uint8_t rf_M1_read(int fd, uint8_t block, uint8_t *content)
 {
-    uint8_t cmd_code[] = {0x08, 0x02};
-    uint8_t dev[] = {0x00, 0x00};
     uint8_t status;
     int i;
     uint8_t data[] = {block};
     char printbuf[100];
 
-    send_command(fd, dev, cmd_code, sizeof(data), data);
-    receive_response(fd, NULL, NULL, &status, 16, content);
+    status = rf_transact(fd, RF_CMD_READ, sizeof(data), data, 16, content, NULL);
 
 #ifdef DEBUG_COMMANDS
     int pos = 0;
@@ -511,22 +842,320 @@ uint8_t rf_M1_read(int fd, uint8_t block, uint8_t *content)
     return status;
 }
 
+uint8_t rf_M1_write(int fd, uint8_t block, uint8_t *content)
+{
+    uint8_t data[17];
 
+    data[0] = block;
+    memcpy(&data[1], content, 16);
 
+#ifdef DEBUG_COMMANDS
+    fprintf(stderr, "Writing block %d (0x%02hhx)...\n", block, block);
+#endif
+
+    return rf_transact(fd, RF_CMD_WRITE, sizeof(data), data, 0, NULL, NULL);
+}
 
+uint8_t rf_ul_select(int fd, uint8_t uid[RF_UL_UID_LEN])
+{
+    return rf_transact(fd, RF_CMD_UL_SELECT, 0, NULL, RF_UL_UID_LEN, uid, NULL);
+}
 
+uint8_t rf_ul_read(int fd, uint8_t page, uint8_t data[16])
+{
+    return rf_transact(fd, RF_CMD_READ, 1, &page, 16, data, NULL);
+}
 
+uint8_t rf_ul_write(int fd, uint8_t page, const uint8_t data[RF_UL_PAGE_SIZE])
+{
+    uint8_t param[1 + RF_UL_PAGE_SIZE];
 
+    param[0] = page;
+    memcpy(&param[1], data, RF_UL_PAGE_SIZE);
+    return rf_transact(fd, RF_CMD_UL_WRITE, sizeof(param), param, 0, NULL, NULL);
+}
 
+uint8_t rf_ul_compat_write(int fd, uint8_t page, const uint8_t data[16])
+{
+    return rf_M1_write(fd, page, (uint8_t*)data);
+}
 
+int rf_ul_pages(const uint8_t cc[RF_UL_PAGE_SIZE])
+{
+    switch (cc[2]) {
+        case 0x06:                      // Ultralight
+            return 16;
+        case 0x12:                      // NTAG213
+            return 45;
+        case 0x3e:                      // NTAG215
+            return 135;
+        case 0x6d:                      // NTAG216
+            return 231;
+        default:
+            return min(4 + cc[2] * 2, RF_UL_PAGES_MAX);
+    }
+}
 
-void rf_M1_write(int fd)
+uint8_t rf_ul_dump(int fd, int max_pages, uint8_t *data, int *pages)
 {
-    uint8_t cmd_code[] = {0x09, 0x02};
-    uint8_t dev[] = {0x00, 0x00};
-    uint8_t buf[100];
-    uint8_t data[] = {0x04, 0x77, 0x66, 0x55, 0x44, 0x33, 0x22, 0x11, 0x00, 0x77, 0x66, 0x55, 0x44, 0x33, 0x22, 0x11, 0x00};
+    uint8_t buf[16];
+    uint8_t status;
+    int total, page, n;
+
+    *pages = 0;
 
-    send_command(fd, dev, cmd_code, sizeof(data), data);
+    /* Pages 0-3 hold the UID, lock bytes and capability container */
+    status = rf_ul_read(fd, 0, buf);
+    if (status != 0)
+        return status;
+    total = min(rf_ul_pages(&buf[12]), max_pages);
+
+    for (page=0; page<total; page+=4) {
+        if (page > 0) {
+            status = rf_ul_read(fd, page, buf);
+            if (status != 0)
+                return status;
+        }
+        /* Reads past the last page wrap around to page 0 */
+        n = min(4, total - page);
+        memcpy(&data[page * RF_UL_PAGE_SIZE], buf, n * RF_UL_PAGE_SIZE);
+        *pages = page + n;
+    }
+
+    return 0;
+}
+
+int rf_M1_sectors(uint8_t capacity)
+{
+    switch (capacity) {
+        case CAPACITY_MINI:
+            return 5;
+        case CAPACITY_4K:
+            return 40;
+        default:
+            return 16;
+    }
+}
+
+uint8_t rf_M1_sector_block(int sector)
+{
+    if (sector < 32)
+        return sector * 4;
+    return 128 + (sector - 32) * 16;
 }
 
+int rf_M1_sector_blocks(int sector)
+{
+    return (sector < 32) ? 4 : 16;
+}
+
+int rf_M1_block_sector(uint8_t block)
+{
+    if (block < 128)
+        return block / 4;
+    return 32 + (block - 128) / 16;
+}
+
+void rf_session_init(struct rf_session *s, int fd)
+{
+    memset(s, 0, sizeof(*s));
+    s->fd = fd;
+    s->auth_sector = -1;
+}
+
+void rf_session_reset(struct rf_session *s)
+{
+    rf_session_init(s, s->fd);
+}
+
+void rf_session_adopt(struct rf_session *s, uint8_t uid[4], uint8_t capacity)
+{
+    rf_session_reset(s);
+    memcpy(s->uid, uid, sizeof(s->uid));
+    s->capacity = capacity;
+    s->selected = 1;
+}
+
+uint8_t rf_session_select(struct rf_session *s)
+{
+    static const uint8_t no_uid[4];
+    unsigned int card_no;
+    uint8_t status;
+
+    if (s->selected)
+        return 0;
+
+    s->auth_sector = -1;
+
+    status = rf_request(s->fd);
+    if (status == 0)
+        status = rf_anticoll(s->fd, &card_no);
+    if (status != 0)
+        return status;
+
+    if (memcmp(s->uid, no_uid, sizeof(s->uid)) != 0 &&
+            memcmp(s->uid, &card_no, sizeof(s->uid)) != 0)
+        return RF_ERR_CARD_CHANGED;
+
+    status = rf_select(s->fd, sizeof(card_no), (uint8_t*)&card_no, &s->capacity);
+    if (status == 0) {
+        memcpy(s->uid, &card_no, sizeof(s->uid));
+        s->selected = 1;
+    }
+
+    return status;
+}
+
+uint8_t rf_session_halt(struct rf_session *s)
+{
+    uint8_t status = 0;
+
+    if (s->selected)
+        status = rf_halt(s->fd);
+    rf_session_reset(s);
+
+    return status;
+}
+
+static uint8_t session_auth(struct rf_session *s, uint8_t key_type, uint8_t block, uint8_t key[6])
+{
+    uint8_t status;
+
+    status = rf_session_select(s);
+    if (status != 0)
+        return status;
+
+    status = rf_M1_authentication2(s->fd, key_type, block, key);
+    if (status == 0) {
+        s->auth_sector = rf_M1_block_sector(block);
+        s->auth_key_type = key_type;
+        memcpy(s->auth_key, key, 6);
+    } else {
+        /* A failed authentication drops the card back to idle */
+        s->selected = 0;
+        s->auth_sector = -1;
+    }
+
+    return status;
+}
+
+uint8_t rf_session_auth(struct rf_session *s, uint8_t key_type, uint8_t block, uint8_t key[6])
+{
+    if (s->selected &&
+            s->auth_sector == rf_M1_block_sector(block) &&
+            s->auth_key_type == key_type &&
+            memcmp(s->auth_key, key, 6) == 0)
+        return 0;
+
+    return session_auth(s, key_type, block, key);
+}
+
+/*
+ * Bring the card back to where it was before a failed command: select
+ * it again and repeat the last authentication, if any.
+ */
+static uint8_t session_recover(struct rf_session *s, uint8_t block)
+{
+    int sector = s->auth_sector;
+
+    s->selected = 0;
+    s->auth_sector = -1;
+
+    if (sector != rf_M1_block_sector(block))
+        return rf_session_select(s);
+
+    return session_auth(s, s->auth_key_type, block, s->auth_key);
+}
+
+uint8_t rf_session_read(struct rf_session *s, uint8_t block, uint8_t *content)
+{
+    uint8_t status;
+
+    status = rf_session_select(s);
+    if (status == 0)
+        status = rf_M1_read(s->fd, block, content);
+    if (status != 0 && session_recover(s, block) == 0)
+        status = rf_M1_read(s->fd, block, content);
+
+    return status;
+}
+
+uint8_t rf_session_write(struct rf_session *s, uint8_t block, uint8_t *content)
+{
+    uint8_t status;
+
+    status = rf_session_select(s);
+    if (status == 0)
+        status = rf_M1_write(s->fd, block, content);
+    if (status != 0 && session_recover(s, block) == 0)
+        status = rf_M1_write(s->fd, block, content);
+
+    return status;
+}
+
+void rf_parser_init(struct rf_parser *p)
+{
+    memset(p, 0, sizeof(*p));
+}
+
+/*
+ * States: 0, 1 = command head, 2, 3 = length, 4 = body. 'stuffed' is set
+ * after a 0xaa inside the frame, whose 0x00 is dropped.
+ */
+int rf_parser_feed(struct rf_parser *p, const uint8_t *data, int len)
+{
+    uint8_t ch;
+    int i;
+
+    for (i=0; i<len && !p->done; i++) {
+        ch = data[i];
+
+        if (p->stuffed) {
+            p->stuffed = 0;
+            if (ch == 0x00)
+                continue;
+            /* Not stuffing, so that 0xaa started a new frame */
+            p->state = 1;
+        }
+
+        switch (p->state) {
+            case 0:
+                if (ch == 0xaa)
+                    p->state = 1;
+                break;
+            case 1:
+                p->state = (ch == 0xbb) ? 2 : (ch == 0xaa) ? 1 : 0;
+                break;
+            case 2:
+                p->len = ch;
+                p->pos = 0;
+                p->ver = 0;
+                p->state = (ch >= 6) ? 3 : 0;
+                break;
+            case 3:
+                p->state = (ch == 0x00) ? 4 : 0;
+                break;
+            case 4:
+                if (p->pos < p->len - 1) {
+                    p->frame[p->pos++] = ch;
+                    p->ver ^= ch;
+                } else {
+                    p->checksum_ok = (ch == p->ver);
+                    p->dev_id[0] = p->frame[0];
+                    p->dev_id[1] = p->frame[1];
+                    p->cmd_code[0] = p->frame[2];
+                    p->cmd_code[1] = p->frame[3];
+                    p->status = p->frame[4];
+                    p->data = &p->frame[5];
+                    p->data_len = p->len - 6;
+                    p->done = 1;
+                }
+                break;
+        }
+
+        if (ch == 0xaa && p->state >= 2)
+            p->stuffed = 1;
+    }
+
+    return i;
+}
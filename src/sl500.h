@@ -19,10 +19,19 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <setjmp.h>
 #include <stdint.h>
 
+#ifdef __cplusplus
+extern "C" {
+#else
 #define min(a,b) (((a) < (b)) ? (a) : (b))
 #define max(a,b) (((a) > (b)) ? (a) : (b))
+#endif
+
+/* Longest parameter list and the longest encoded frame with stuffing */
+#define RF_PARAM_MAX 250
+#define RF_FRAME_MAX (2 + 2 * (RF_PARAM_MAX + 7))
 
 #define BAUD_4800 0x00
 #define BAUD_9600 0x01
@@ -54,8 +63,96 @@
 #define KEY_A (0x60)
 #define KEY_B (0x61)
 
+/* Capacity codes returned by rf_select(), see doc/capacities.txt */
+#define CAPACITY_ULTRALIGHT (0x04)
+#define CAPACITY_1K (0x08)
+#define CAPACITY_MINI (0x09)
+#define CAPACITY_4K (0x18)
+
+/* Statuses not coming from the reader */
+#define RF_ERR_BAD_ANSWER (0xf9)        // Answer of the wrong command or length
+#define RF_ERR_CARD_CHANGED (0xfb)      // Another card answered the reselect
+
 void comm_error();
 
+/*
+ * 'rf_set_error_handler()' - Call 'handler' on communication errors
+ * instead of exiting. The handler must not return, but is expected to
+ * longjmp() back to the caller of the failed command.
+ */
+
+void rf_set_error_handler(void (*handler)(void));
+
+/*
+ * 'rf_set_error_jmp()' - Make communication errors in the calling thread
+ * longjmp() to 'env', or exit again if 'env' is NULL. Takes precedence
+ * over the error handler and lets each thread guard its own reader.
+ *
+ * Returns the previous 'env', to restore when guards are nested.
+ */
+
+jmp_buf *rf_set_error_jmp(jmp_buf *env);
+
+/*
+ * Bus mode: with several readers on one RS-485 line, each command must
+ * be addressed to one device ID. 'rf_set_device()' sets the address used
+ * by every command on 'fd' from then on, and answers from any other
+ * device are dropped. The default 0x0000 reaches any single reader.
+ */
+
+#define RF_MAX_FDS 1024
+
+void rf_set_device(int fd, const uint8_t dev_id[2]);
+
+/* 'rf_device()' - Address in use on 'fd' */
+
+uint8_t *rf_device(int fd);
+
+/*
+ * 'rf_set_timeout()' - Give up on a reader after 'tenths' of a second
+ * without a byte, with a communication error. 0 waits forever.
+ *
+ * Returns 0 on success or -1 on error.
+ */
+
+int rf_set_timeout(int fd, int tenths);
+
+/*
+ * Low-latency mode for a port. On USB-serial adapters most of a round
+ * trip is spent waiting for the adapter to pass on a few bytes; this
+ * asks the driver to hand them over at once (ASYNC_LOW_LATENCY) and
+ * turns the FTDI latency timer down to 1 ms where sysfs allows it.
+ * Answers are then read as the adapter hands them over instead of
+ * byte by byte. Settings the port does not support, as on a pty, are skipped.
+ */
+
+#define RF_LL_SERIAL 0x01               // ASYNC_LOW_LATENCY set
+#define RF_LL_TIMER 0x02                // FTDI latency timer lowered
+#define RF_LL_FRAMED 0x04               // Frame-sized reads
+
+/*
+ * 'rf_set_low_latency()' - Put the port on 'fd' in low-latency mode.
+ *
+ * Returns the RF_LL_* settings that took, or -1 on error.
+ */
+
+int rf_set_low_latency(int fd);
+
+struct rf_rtt {
+    int rounds;
+    long min_us;
+    long avg_us;
+    long max_us;
+};
+
+/*
+ * 'rf_measure_rtt()' - Time 'rounds' get device number commands.
+ *
+ * Returns 0 on success or the status of the first failed command.
+ */
+
+uint8_t rf_measure_rtt(int fd, int rounds, struct rf_rtt *rtt);
+
 /*
  * 'open_port()' - Open serial port 1.
  *
@@ -64,16 +161,140 @@ void comm_error();
 
 int open_port(void);
 
+/*
+ * 'open_port_path()' - Open the serial port at 'path' at 19200 baud.
+ *
+ * Returns the file descriptor on success or -1 on error.
+ */
+
+int open_port_path(const char *path);
+
+/*
+ * 'rf_set_speed()' - Set the port to baud rate 'rate' (BAUD_*) without
+ * telling the reader, e.g. to talk to one left at that rate.
+ *
+ * Returns 0 on success or -1 on error.
+ */
+
+int rf_set_speed(int fd, uint8_t rate);
+
 uint8_t get_byte(int fd);
 
 void expect(int fd, uint8_t expected);
 
+/*
+ * 'rf_build_frame()' - Encode a command into 'buf', which must hold
+ * RF_FRAME_MAX bytes.
+ *
+ * Returns the frame length, or -1 if there are too many parameters.
+ */
+
+int rf_build_frame(uint8_t *buf, uint8_t dev_id[2], uint8_t cmd_code[2],
+                   uint8_t param_len, uint8_t *param);
+
+/*
+ * Incremental parser for reader answers, for callers doing their own
+ * non-blocking I/O. Feed it bytes as they arrive until 'done' is set;
+ * the fields below it are valid from then on.
+ */
+
+struct rf_parser {
+    int state;
+    int stuffed;
+    uint8_t len;
+    uint8_t ver;
+    int pos;
+    uint8_t frame[256];
+
+    int done;
+    int checksum_ok;
+    uint8_t dev_id[2];
+    uint8_t cmd_code[2];
+    uint8_t status;
+    uint8_t *data;
+    int data_len;
+};
+
+void rf_parser_init(struct rf_parser *p);
+
+/*
+ * 'rf_parser_feed()' - Returns the number of bytes used. Bytes after the
+ * end of the frame are left for the next one.
+ */
+
+int rf_parser_feed(struct rf_parser *p, const uint8_t *data, int len);
+
 void send_command(int fd, uint8_t dev_id[2], uint8_t cmd_code[2],
                   uint8_t param_len, uint8_t *param);
 
 int receive_response(int fd, uint8_t *dev_id, uint8_t *cmd_code,
                      uint8_t *status, int data_len, uint8_t *data);
 
+/*
+ * Command table. Each command has a descriptor giving its code, the
+ * number of parameter bytes and the data length of a successful answer.
+ */
+
+#define RF_CODE_INIT_COM    0x01, 0x01
+#define RF_CODE_INIT_DEV    0x02, 0x01
+#define RF_CODE_GET_DEV     0x03, 0x01
+#define RF_CODE_GET_MODEL   0x04, 0x01
+#define RF_CODE_BEEP        0x06, 0x01
+#define RF_CODE_LIGHT       0x07, 0x01
+#define RF_CODE_INIT_TYPE   0x08, 0x01
+#define RF_CODE_ANTENNA     0x0c, 0x01
+#define RF_CODE_REQUEST     0x01, 0x02
+#define RF_CODE_ANTICOLL    0x02, 0x02
+#define RF_CODE_SELECT      0x03, 0x02
+#define RF_CODE_HALT        0x04, 0x02
+#define RF_CODE_AUTH        0x07, 0x02
+#define RF_CODE_READ        0x08, 0x02
+#define RF_CODE_WRITE       0x09, 0x02
+#define RF_CODE_UL_SELECT   0x12, 0x02
+#define RF_CODE_UL_WRITE    0x13, 0x02
+
+enum rf_cmd_ids {
+    RF_CMD_INIT_COM = 0,
+    RF_CMD_GET_MODEL,
+    RF_CMD_INIT_DEV,
+    RF_CMD_GET_DEV,
+    RF_CMD_BEEP,
+    RF_CMD_LIGHT,
+    RF_CMD_INIT_TYPE,
+    RF_CMD_ANTENNA,
+    RF_CMD_REQUEST,
+    RF_CMD_ANTICOLL,
+    RF_CMD_SELECT,
+    RF_CMD_HALT,
+    RF_CMD_AUTH,
+    RF_CMD_READ,
+    RF_CMD_WRITE,
+    RF_CMD_UL_SELECT,
+    RF_CMD_UL_WRITE,
+    RF_CMDS
+};
+
+struct rf_command {
+    uint8_t code[2];
+    uint8_t param_len;
+    uint8_t data_min;
+    uint8_t data_max;
+};
+
+extern const struct rf_command rf_commands[RF_CMDS];
+
+/*
+ * 'rf_transact()' - Send command 'cmd' to the reader on 'fd' and read
+ * the answer, putting up to 'data_len' data bytes in 'data' and their
+ * number in 'count' (may be NULL).
+ *
+ * Returns the reader status, or RF_ERR_BAD_ANSWER if the answer was for
+ * another command or had the wrong length.
+ */
+
+uint8_t rf_transact(int fd, int cmd, uint8_t param_len, uint8_t *param,
+                    int data_len, uint8_t *data, int *count);
+
 uint8_t rf_init_com(int fd, uint8_t rate);
 
 uint8_t rf_get_model(int fd, int data_len, uint8_t *data);
@@ -92,9 +313,27 @@ uint8_t rf_antenna_sta(int fd, uint8_t state);
 
 uint8_t rf_request(int fd);
 
+/*
+ * 'rf_request_type()' - Like rf_request(), also storing the card's
+ * answer to request (ATQA) in 'atqa'.
+ */
+
+uint8_t rf_request_type(int fd, uint8_t atqa[2]);
+
+/* Set in the ATQA of cards with a 7 byte UID, such as Ultralight */
+
+#define RF_ATQA_DOUBLE_UID(atqa) (((atqa)[0] & 0xc0) == 0x40)
+
 uint8_t rf_anticoll(int fd, unsigned int *card_no);
 
-uint8_t rf_select(int fd, int cardnbr_size, uint8_t *cardnbr);
+/*
+ * 'rf_select()' - Select a card by serial number.
+ *
+ * The capacity code of the card is stored in 'capacity' unless it is
+ * NULL.
+ */
+
+uint8_t rf_select(int fd, int cardnbr_size, uint8_t *cardnbr, uint8_t *capacity);
 
 uint8_t rf_halt(int fd);
 
@@ -102,7 +341,120 @@ uint8_t rf_M1_authentication2(int fd, uint8_t key_type, uint8_t block, uint8_t k
 
 uint8_t rf_M1_read(int fd, uint8_t block, uint8_t *content);
 
-void rf_M1_write(int fd);
+uint8_t rf_M1_write(int fd, uint8_t block, uint8_t *content);
+
+/*
+ * MIFARE Ultralight and NTAG21x. These have 4 byte pages, no keys and
+ * 7 byte UIDs. READ returns 4 pages (16 bytes) per round trip. WRITE
+ * writes one page; COMPATIBILITY WRITE takes a Classic-style 16 byte
+ * block of which only the first page is written.
+ *
+ * The reader does not pass FAST_READ or GET_VERSION through, so a dump
+ * is done in 4 page reads, sized from the capability container.
+ */
+
+#define RF_UL_UID_LEN 7
+#define RF_UL_PAGE_SIZE 4
+#define RF_UL_PAGES_MAX 256
+
+/*
+ * 'rf_ul_select()' - Run anticollision on and select a card with a 7
+ * byte UID, storing the UID in 'uid'.
+ */
+
+uint8_t rf_ul_select(int fd, uint8_t uid[RF_UL_UID_LEN]);
+
+/* 'rf_ul_read()' - Read the 4 pages from 'page' on into 'data' */
+
+uint8_t rf_ul_read(int fd, uint8_t page, uint8_t data[16]);
+
+uint8_t rf_ul_write(int fd, uint8_t page, const uint8_t data[RF_UL_PAGE_SIZE]);
+
+uint8_t rf_ul_compat_write(int fd, uint8_t page, const uint8_t data[16]);
+
+/*
+ * 'rf_ul_pages()' - Number of pages on a card, judging by its capability
+ * container (page 3). Known NTAG21x and Ultralight sizes include their
+ * configuration pages; other cards get their data area and header.
+ */
+
+int rf_ul_pages(const uint8_t cc[RF_UL_PAGE_SIZE]);
+
+/*
+ * 'rf_ul_dump()' - Read the whole selected card into 'data', which
+ * holds 'max_pages' pages, in as few round trips as the reader allows.
+ * The number of pages read is stored in 'pages'.
+ */
+
+uint8_t rf_ul_dump(int fd, int max_pages, uint8_t *data, int *pages);
+
+/*
+ * Sector layout helpers. Sectors 32 and up on 4K cards hold 16 blocks,
+ * all others 4. The last block of each sector is the sector trailer.
+ */
+
+int rf_M1_sectors(uint8_t capacity);
+
+uint8_t rf_M1_sector_block(int sector);
+
+int rf_M1_sector_blocks(int sector);
+
+int rf_M1_block_sector(uint8_t block);
+
+/*
+ * Card session. Remembers which card is selected and which sector is
+ * authenticated with which key, so that a series of operations on the
+ * same card skips the request, select and authentication commands that
+ * would not change anything. If an operation fails the card is
+ * reselected and reauthenticated once, provided the same card is still
+ * in the field.
+ */
+
+struct rf_session {
+    int fd;
+    uint8_t uid[4];
+    uint8_t capacity;
+    int selected;
+    int auth_sector;                    // -1 when not authenticated
+    uint8_t auth_key_type;
+    uint8_t auth_key[6];
+};
+
+void rf_session_init(struct rf_session *s, int fd);
+
+/*
+ * 'rf_session_select()' - Make sure a card is selected.
+ *
+ * Does nothing if a card already is. Otherwise selects the card in the
+ * field, or fails if it is not the card the session had before.
+ */
+
+uint8_t rf_session_select(struct rf_session *s);
+
+/*
+ * 'rf_session_adopt()' - Take over a card selected with rf_select().
+ */
+
+void rf_session_adopt(struct rf_session *s, uint8_t uid[4], uint8_t capacity);
+
+/*
+ * 'rf_session_reset()' - Forget the card, e.g. when it has been halted
+ * or a new one is expected.
+ */
+
+void rf_session_reset(struct rf_session *s);
+
+uint8_t rf_session_halt(struct rf_session *s);
+
+uint8_t rf_session_auth(struct rf_session *s, uint8_t key_type, uint8_t block, uint8_t key[6]);
+
+uint8_t rf_session_read(struct rf_session *s, uint8_t block, uint8_t *content);
+
+uint8_t rf_session_write(struct rf_session *s, uint8_t block, uint8_t *content);
+
+#ifdef __cplusplus
+}
+#endif
 
 #endif
 
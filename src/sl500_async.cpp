@@ -0,0 +1,340 @@
+// vim: ts=4 expandtab ai
+
+/*
+ * Copyright (c) 2008, Henrik Torstensson <laban@kryo.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "sl500_async.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <system_error>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+namespace sl500 {
+
+/*
+ * Event loop
+ */
+
+struct event_loop::detached {
+    struct promise_type {
+        detached get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+event_loop::detached event_loop::run_detached(event_loop &loop, task<void> t)
+{
+    try {
+        co_await t;
+    } catch (const std::exception &e) {
+        fprintf(stderr, "sl500: task failed: %s\n", e.what());
+    }
+    loop.live_--;
+}
+
+void event_loop::spawn(task<void> t)
+{
+    live_++;
+    run_detached(*this, std::move(t));
+}
+
+void event_loop::run()
+{
+    std::vector<struct pollfd> fds;
+    std::vector<std::coroutine_handle<>> wake;
+
+    stopped_ = false;
+    while (!stopped_ && live_ > 0) {
+        while (!ready_.empty() && !stopped_) {
+            auto h = ready_.front();
+            ready_.pop_front();
+            h.resume();
+        }
+        if (stopped_ || live_ == 0)
+            break;
+        if (waiters_.empty()) {
+            if (ready_.empty()) {
+                fprintf(stderr, "sl500: %d tasks waiting on nothing\n", live_);
+                break;
+            }
+            continue;
+        }
+
+        /* Sleep until the first deadline or until an fd gets readable */
+        auto now = clock::now();
+        auto first = waiters_.front()->deadline;
+        fds.clear();
+        for (waiter *w : waiters_) {
+            first = std::min(first, w->deadline);
+            if (w->fd >= 0)
+                fds.push_back({w->fd, POLLIN, 0});
+        }
+        int timeout = 0;
+        if (first > now)
+            timeout = std::chrono::ceil<std::chrono::milliseconds>(first - now).count();
+        if (poll(fds.data(), fds.size(), ready_.empty() ? timeout : 0) == -1 && errno != EINTR)
+            throw std::system_error(errno, std::generic_category(), "poll");
+
+        /* Unlink before resuming, the waiters live in the coroutine frames */
+        now = clock::now();
+        wake.clear();
+        size_t f = 0;
+        for (auto it = waiters_.begin(); it != waiters_.end();) {
+            waiter *w = *it;
+            bool readable = false;
+            if (w->fd >= 0)
+                readable = fds[f++].revents != 0;
+            if (readable || w->deadline <= now) {
+                w->timed_out = !readable;
+                wake.push_back(w->handle);
+                it = waiters_.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        for (auto h : wake)
+            h.resume();
+    }
+}
+
+/*
+ * Reader
+ */
+
+struct reader::lock_op {
+    reader &r;
+
+    bool await_ready() noexcept
+    {
+        if (r.busy_)
+            return false;
+        r.busy_ = true;
+        return true;
+    }
+    void await_suspend(std::coroutine_handle<> h) { r.queue_.push_back(h); }
+    void await_resume() noexcept {}
+};
+
+/* Hands the reader to the next queued command when the scope ends */
+struct reader::lock_guard {
+    reader &r;
+    ~lock_guard() { r.unlock(); }
+};
+
+reader::lock_op reader::lock()
+{
+    return lock_op{*this};
+}
+
+void reader::unlock()
+{
+    if (queue_.empty()) {
+        busy_ = false;
+        return;
+    }
+    /* Still busy, ownership passes straight to the next in line */
+    loop_.post(queue_.front());
+    queue_.pop_front();
+}
+
+reader::reader(event_loop &loop, const std::string &path)
+    : loop_(loop), owns_fd_(true)
+{
+    fd_ = open_port_path(path.c_str());
+    if (fd_ == -1)
+        throw std::system_error(errno, std::generic_category(), path);
+    fcntl(fd_, F_SETFL, fcntl(fd_, F_GETFL) | O_NONBLOCK);
+}
+
+reader::reader(event_loop &loop, int fd)
+    : loop_(loop), fd_(fd), owns_fd_(false)
+{
+    fcntl(fd_, F_SETFL, fcntl(fd_, F_GETFL) | O_NONBLOCK);
+}
+
+reader::~reader()
+{
+    if (owns_fd_)
+        close(fd_);
+}
+
+task<reader::answer> reader::command(uint8_t c0, uint8_t c1, std::vector<uint8_t> param,
+                                     clock::duration timeout)
+{
+    uint8_t dev[2] = {0x00, 0x00};
+    uint8_t cmd[2] = {c0, c1};
+    uint8_t frame[RF_FRAME_MAX];
+    uint8_t buf[256];
+    struct rf_parser parser;
+    int len;
+
+    len = rf_build_frame(frame, dev, cmd, param.size(), param.data());
+    if (len == -1 || param.size() > RF_PARAM_MAX)
+        throw std::length_error("too many parameters");
+
+    co_await lock();
+    lock_guard guard{*this};
+
+    /* Drop anything left over from an earlier timed out command */
+    while (read(fd_, buf, sizeof(buf)) > 0)
+        ;
+
+    if (write(fd_, frame, len) != len)
+        throw std::system_error(errno, std::generic_category(), "write");
+
+    auto deadline = clock::now() + timeout;
+    rf_parser_init(&parser);
+    while (!parser.done) {
+        if (!co_await loop_.readable(fd_, deadline))
+            throw timeout_error();
+
+        ssize_t n = read(fd_, buf, sizeof(buf));
+        if (n == 0)
+            throw std::runtime_error("reader went away");
+        if (n == -1) {
+            if (errno == EAGAIN || errno == EINTR)
+                continue;
+            throw std::system_error(errno, std::generic_category(), "read");
+        }
+        rf_parser_feed(&parser, buf, n);
+    }
+
+    if (!parser.checksum_ok)
+        throw std::runtime_error("bad checksum in answer");
+    if (parser.cmd_code[0] != c0 || parser.cmd_code[1] != c1)
+        co_return answer{RF_ERR_BAD_ANSWER, {}};
+
+    co_return answer{parser.status,
+                     std::vector<uint8_t>(parser.data, parser.data + parser.data_len)};
+}
+
+task<reader::answer> reader::transact(int cmd, std::vector<uint8_t> param,
+                                      clock::duration timeout)
+{
+    const struct rf_command &c = rf_commands[cmd];
+
+    if (param.size() != c.param_len)
+        throw std::length_error("wrong number of parameters");
+
+    answer a = co_await command(c.code[0], c.code[1], std::move(param), timeout);
+    if (a.status == 0x00 && (a.data.size() < c.data_min || a.data.size() > c.data_max))
+        co_return answer{RF_ERR_BAD_ANSWER, {}};
+    co_return a;
+}
+
+task<uint8_t> reader::beep(uint8_t time)
+{
+    std::vector<uint8_t> param = {time};
+
+    co_return (co_await transact(RF_CMD_BEEP, std::move(param))).status;
+}
+
+task<uint8_t> reader::light(uint8_t color)
+{
+    std::vector<uint8_t> param = {color};
+
+    co_return (co_await transact(RF_CMD_LIGHT, std::move(param))).status;
+}
+
+task<std::string> reader::model()
+{
+    answer a = co_await transact(RF_CMD_GET_MODEL);
+    co_return std::string(a.data.begin(), a.data.end());
+}
+
+task<uint8_t> reader::request()
+{
+    std::vector<uint8_t> param = {REQ_ALL};
+
+    co_return (co_await transact(RF_CMD_REQUEST, std::move(param))).status;
+}
+
+task<std::optional<uint32_t>> reader::anticoll()
+{
+    answer a = co_await transact(RF_CMD_ANTICOLL);
+    uint32_t card_no;
+
+    if (a.status != 0x00 || a.data.size() != 4)
+        co_return std::nullopt;
+    memcpy(&card_no, a.data.data(), 4);
+    co_return card_no;
+}
+
+task<uint8_t> reader::select(uint32_t card_no, uint8_t *capacity)
+{
+    std::vector<uint8_t> param(4);
+    memcpy(param.data(), &card_no, 4);
+
+    answer a = co_await transact(RF_CMD_SELECT, std::move(param));
+    if (capacity != nullptr)
+        *capacity = (a.status == 0x00 && !a.data.empty()) ? a.data[0] : 0;
+    co_return a.status;
+}
+
+task<uint8_t> reader::halt()
+{
+    co_return (co_await transact(RF_CMD_HALT)).status;
+}
+
+task<uint8_t> reader::authenticate(uint8_t key_type, uint8_t block, std::array<uint8_t, 6> key)
+{
+    std::vector<uint8_t> param = {key_type, block};
+    param.insert(param.end(), key.begin(), key.end());
+
+    co_return (co_await transact(RF_CMD_AUTH, std::move(param))).status;
+}
+
+task<block> reader::read_block(uint8_t blk)
+{
+    std::vector<uint8_t> param = {blk};
+    answer a = co_await transact(RF_CMD_READ, std::move(param));
+    block b{a.status, {}};
+
+    if (a.status == 0x00)
+        std::copy_n(a.data.begin(), 16, b.data.begin());
+    co_return b;
+}
+
+task<uint8_t> reader::write_block(uint8_t blk, std::array<uint8_t, 16> data)
+{
+    std::vector<uint8_t> param = {blk};
+    param.insert(param.end(), data.begin(), data.end());
+
+    co_return (co_await transact(RF_CMD_WRITE, std::move(param))).status;
+}
+
+task<uint32_t> reader::wait_for_card(clock::duration interval)
+{
+    for (;;) {
+        if (co_await request() == 0x00) {
+            auto card_no = co_await anticoll();
+            if (card_no && co_await select(*card_no) == 0x00)
+                co_return *card_no;
+        }
+        co_await loop_.sleep(interval);
+    }
+}
+
+} // namespace sl500
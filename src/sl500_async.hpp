@@ -0,0 +1,300 @@
+// vim: ts=4 expandtab ai
+
+#ifndef SL500_ASYNC_HPP
+#define SL500_ASYNC_HPP
+
+/*
+ * Copyright (c) 2008, Henrik Torstensson <laban@kryo.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * C++20 coroutine interface to the reader command set.
+ *
+ * Every command is a task that suspends while the reader works, so one
+ * thread can drive any number of readers:
+ *
+ *     sl500::task<void> gate(sl500::reader &r)
+ *     {
+ *         auto card = co_await r.wait_for_card();
+ *         co_await r.authenticate(KEY_A, 8, key);
+ *         auto block = co_await r.read_block(8);
+ *     }
+ *
+ *     sl500::event_loop loop;
+ *     sl500::reader a(loop, "/dev/ttyUSB0"), b(loop, "/dev/ttyUSB1");
+ *     loop.spawn(gate(a));
+ *     loop.spawn(gate(b));
+ *     loop.run();
+ *
+ * Frames are encoded and parsed by the C library (rf_build_frame() and
+ * rf_parser), only the waiting is done here.
+ */
+
+#include "sl500.h"
+#include "sl500_reader.hpp"
+
+#include <array>
+#include <chrono>
+#include <coroutine>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace sl500 {
+
+/*
+ * Lazily started coroutine producing a T. Awaiting it runs it and
+ * resumes the awaiter when it is done.
+ */
+template <typename T>
+class task;
+
+namespace detail {
+
+struct promise_base {
+    std::coroutine_handle<> continuation = std::noop_coroutine();
+    std::exception_ptr error;
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+
+    struct final_awaiter {
+        bool await_ready() noexcept { return false; }
+        template <typename P>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept
+        {
+            return h.promise().continuation;
+        }
+        void await_resume() noexcept {}
+    };
+
+    final_awaiter final_suspend() noexcept { return {}; }
+    void unhandled_exception() { error = std::current_exception(); }
+};
+
+template <typename T>
+struct promise : promise_base {
+    std::optional<T> value;
+
+    task<T> get_return_object();
+    template <typename U>
+    void return_value(U &&v) { value.emplace(std::forward<U>(v)); }
+    T result()
+    {
+        if (error)
+            std::rethrow_exception(error);
+        return std::move(*value);
+    }
+};
+
+template <>
+struct promise<void> : promise_base {
+    task<void> get_return_object();
+    void return_void() {}
+    void result()
+    {
+        if (error)
+            std::rethrow_exception(error);
+    }
+};
+
+} // namespace detail
+
+template <typename T = void>
+class task {
+public:
+    using promise_type = detail::promise<T>;
+
+    explicit task(std::coroutine_handle<promise_type> h) : h_(h) {}
+    task(task &&o) noexcept : h_(std::exchange(o.h_, {})) {}
+    task &operator=(task &&o) noexcept
+    {
+        if (this != &o) {
+            if (h_)
+                h_.destroy();
+            h_ = std::exchange(o.h_, {});
+        }
+        return *this;
+    }
+    task(const task &) = delete;
+    ~task()
+    {
+        if (h_)
+            h_.destroy();
+    }
+
+    bool await_ready() const noexcept { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter) noexcept
+    {
+        h_.promise().continuation = awaiter;
+        return h_;
+    }
+    T await_resume() { return h_.promise().result(); }
+
+private:
+    std::coroutine_handle<promise_type> h_;
+};
+
+namespace detail {
+
+template <typename T>
+task<T> promise<T>::get_return_object()
+{
+    return task<T>(std::coroutine_handle<promise<T>>::from_promise(*this));
+}
+
+inline task<void> promise<void>::get_return_object()
+{
+    return task<void>(std::coroutine_handle<promise<void>>::from_promise(*this));
+}
+
+} // namespace detail
+
+/*
+ * Single threaded poll() loop. Coroutines park themselves here while
+ * waiting for a file descriptor or a point in time.
+ */
+class event_loop {
+public:
+    struct waiter {
+        int fd;                         // -1 for a plain timer
+        clock::time_point deadline;
+        std::coroutine_handle<> handle;
+        bool timed_out = false;
+    };
+
+    /* Awaitable: resumes when 'fd' is readable or at 'deadline' */
+    struct wait_op {
+        event_loop &loop;
+        waiter w;
+
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> h)
+        {
+            w.handle = h;
+            loop.waiters_.push_back(&w);
+        }
+        bool await_resume() const noexcept { return !w.timed_out; }
+    };
+
+    wait_op readable(int fd, clock::time_point deadline)
+    {
+        return wait_op{*this, waiter{fd, deadline, {}}};
+    }
+
+    wait_op sleep(clock::duration d)
+    {
+        return wait_op{*this, waiter{-1, clock::now() + d, {}}};
+    }
+
+    /* Start 't' now and let it run to completion on its own */
+    void spawn(task<void> t);
+
+    /* Resume 'h' from the loop, on its next turn */
+    void post(std::coroutine_handle<> h) { ready_.push_back(h); }
+
+    /* Run until every spawned task is done or stop() is called */
+    void run();
+
+    void stop() { stopped_ = true; }
+
+private:
+    struct detached;
+    static detached run_detached(event_loop &loop, task<void> t);
+
+    std::vector<waiter *> waiters_;
+    std::deque<std::coroutine_handle<>> ready_;
+    int live_ = 0;
+    bool stopped_ = false;
+};
+
+struct block {
+    uint8_t status;
+    std::array<uint8_t, 16> data;
+};
+
+/*
+ * One SL500 on a serial port. Commands from different tasks on the same
+ * reader are queued and run one at a time.
+ */
+class reader {
+public:
+    reader(event_loop &loop, const std::string &path);
+    reader(event_loop &loop, int fd);
+    ~reader();
+    reader(const reader &) = delete;
+
+    int fd() const { return fd_; }
+    event_loop &loop() const { return loop_; }
+
+    struct answer {
+        uint8_t status;
+        std::vector<uint8_t> data;
+    };
+
+    /*
+     * Send a raw command and wait for the answer. Throws timeout_error
+     * if the reader does not answer within 'timeout'. An answer to
+     * another command has status RF_ERR_BAD_ANSWER.
+     */
+    task<answer> command(uint8_t c0, uint8_t c1, std::vector<uint8_t> param = {},
+                         clock::duration timeout = std::chrono::milliseconds(500));
+
+    /*
+     * Send command 'cmd' (RF_CMD_*) from rf_commands[]. An answer of the
+     * wrong length for it has status RF_ERR_BAD_ANSWER, as with
+     * rf_transact().
+     */
+    task<answer> transact(int cmd, std::vector<uint8_t> param = {},
+                          clock::duration timeout = std::chrono::milliseconds(500));
+
+    task<uint8_t> beep(uint8_t time);
+    task<uint8_t> light(uint8_t color);
+    task<std::string> model();
+    task<uint8_t> request();
+    task<std::optional<uint32_t>> anticoll();
+    task<uint8_t> select(uint32_t card_no, uint8_t *capacity = nullptr);
+    task<uint8_t> halt();
+    task<uint8_t> authenticate(uint8_t key_type, uint8_t block, std::array<uint8_t, 6> key);
+    task<block> read_block(uint8_t block);
+    task<uint8_t> write_block(uint8_t block, std::array<uint8_t, 16> data);
+
+    /*
+     * Poll every 'interval' until a card answers, then select it and
+     * return its serial number.
+     */
+    task<uint32_t> wait_for_card(clock::duration interval = std::chrono::milliseconds(100));
+
+private:
+    struct lock_op;
+    struct lock_guard;
+
+    lock_op lock();
+    void unlock();
+
+    event_loop &loop_;
+    int fd_;
+    bool owns_fd_;
+    bool busy_ = false;
+    std::deque<std::coroutine_handle<>> queue_;
+};
+
+} // namespace sl500
+
+#endif
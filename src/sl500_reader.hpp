@@ -0,0 +1,594 @@
+// vim: ts=4 expandtab ai
+
+#ifndef SL500_READER_HPP
+#define SL500_READER_HPP
+
+/*
+ * Copyright (c) 2008, Henrik Torstensson <laban@kryo.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Blocking C++ interface to the reader command set over a pluggable
+ * transport.
+ *
+ * The transport is a template parameter, so each reader type is
+ * compiled for its own transport and the calls inline; there is no
+ * virtual dispatch between a command and the bytes going out:
+ *
+ *     sl500::basic_reader<sl500::serial_transport> r("/dev/ttyUSB0");
+ *     uint32_t card_no;
+ *
+ *     if (r.request() == 0x00 && r.anticoll(card_no) == 0x00)
+ *         r.select(card_no);
+ *
+ * A transport has these members:
+ *
+ *     void send(const uint8_t *data, size_t len);
+ *     size_t receive(uint8_t *buf, size_t len, clock::time_point deadline);
+ *     void discard();
+ *
+ * receive() returns 0 when nothing arrived before 'deadline'; discard()
+ * drops input left over from a command that timed out. Errors are
+ * thrown.
+ *
+ * serial_transport is a real port, pty_transport the master side of a
+ * pseudo terminal for a simulator to open, loopback_transport a device
+ * model in memory and replay_transport a session captured with
+ * recorder. Frames are encoded and parsed by the C library
+ * (rf_build_frame() and rf_parser), the same code the daemons use.
+ */
+
+#include "sl500.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <termios.h>
+#include <unistd.h>
+
+namespace sl500 {
+
+using clock = std::chrono::steady_clock;
+
+class timeout_error : public std::runtime_error {
+public:
+    timeout_error() : std::runtime_error("reader did not answer") {}
+};
+
+/*
+ * Non-blocking file descriptor, the common part of the serial and pty
+ * transports.
+ */
+class fd_transport {
+public:
+    explicit fd_transport(int fd, bool owns_fd = false) : fd_(fd), owns_fd_(owns_fd)
+    {
+        fcntl(fd_, F_SETFL, fcntl(fd_, F_GETFL) | O_NONBLOCK);
+    }
+    ~fd_transport()
+    {
+        if (owns_fd_)
+            close(fd_);
+    }
+    fd_transport(const fd_transport &) = delete;
+    fd_transport &operator=(const fd_transport &) = delete;
+
+    int fd() const { return fd_; }
+
+    void send(const uint8_t *data, size_t len)
+    {
+        while (len > 0) {
+            ssize_t n = write(fd_, data, len);
+            if (n == -1) {
+                if (errno == EAGAIN) {
+                    struct pollfd p = {fd_, POLLOUT, 0};
+                    poll(&p, 1, -1);
+                    continue;
+                }
+                if (errno == EINTR)
+                    continue;
+                throw std::system_error(errno, std::generic_category(), "write");
+            }
+            data += n;
+            len -= n;
+        }
+    }
+
+    size_t receive(uint8_t *buf, size_t len, clock::time_point deadline)
+    {
+        for (;;) {
+            ssize_t n = read(fd_, buf, len);
+            if (n > 0)
+                return n;
+            if (n == 0 || errno == EIO)
+                throw std::runtime_error("reader went away");
+            if (errno != EAGAIN && errno != EINTR)
+                throw std::system_error(errno, std::generic_category(), "read");
+
+            auto left = std::chrono::ceil<std::chrono::milliseconds>(deadline - clock::now());
+            if (left.count() <= 0)
+                return 0;
+            struct pollfd p = {fd_, POLLIN, 0};
+            poll(&p, 1, left.count());
+        }
+    }
+
+    void discard()
+    {
+        uint8_t buf[64];
+
+        while (read(fd_, buf, sizeof(buf)) > 0)
+            ;
+    }
+
+private:
+    int fd_;
+    bool owns_fd_;
+};
+
+/*
+ * Serial port, opened at 19200 baud like open_port_path().
+ */
+class serial_transport : public fd_transport {
+public:
+    explicit serial_transport(const char *path) : fd_transport(open_checked(path), true) {}
+
+    /* Follow the reader to a new BAUD_* rate after init_com() */
+    void set_speed(uint8_t rate) { rf_set_speed(fd(), rate); }
+
+private:
+    static int open_checked(const char *path)
+    {
+        int fd = open_port_path(path);
+        if (fd == -1)
+            throw std::system_error(errno, std::generic_category(), path);
+        return fd;
+    }
+};
+
+/*
+ * Master side of a new pseudo terminal. A simulator opens path() and
+ * plays the reader.
+ */
+class pty_transport : public fd_transport {
+public:
+    pty_transport() : fd_transport(open_master(), true), path_(ptsname(fd())) {}
+
+    const std::string &path() const { return path_; }
+
+private:
+    static int open_master()
+    {
+        struct termios options;
+        int fd;
+
+        fd = posix_openpt(O_RDWR | O_NOCTTY);
+        if (fd == -1 || grantpt(fd) == -1 || unlockpt(fd) == -1)
+            throw std::system_error(errno, std::generic_category(), "posix_openpt");
+
+        /* No echo or line editing between reader and simulator */
+        tcgetattr(fd, &options);
+        cfmakeraw(&options);
+        tcsetattr(fd, TCSANOW, &options);
+        return fd;
+    }
+
+    std::string path_;
+};
+
+/*
+ * A command as it reaches a device model.
+ */
+struct command {
+    uint8_t dev_id[2];
+    uint8_t code[2];
+    const uint8_t *param;
+    int param_len;
+};
+
+/*
+ * Device model in memory. 'Device' is called for every command frame
+ *
+ *     int operator()(const sl500::command &cmd, uint8_t *data, int &data_len);
+ *
+ * and returns the status to answer with, after putting up to
+ * RF_PARAM_MAX - 1 data bytes in 'data', or -1 to stay silent. Nothing
+ * else can produce input, so an unanswered command times out at once.
+ */
+template <typename Device>
+class loopback_transport {
+public:
+    template <typename... Args>
+    explicit loopback_transport(Args &&...args) : device_(std::forward<Args>(args)...) {}
+
+    Device &device() { return device_; }
+
+    void send(const uint8_t *data, size_t len)
+    {
+        uint8_t body[RF_PARAM_MAX + 7], answer[RF_PARAM_MAX];
+        int n = 0, data_len = 0, status;
+        size_t i;
+
+        /* Undo the stuffing after the head */
+        for (i=2; i<len && n < (int)sizeof(body); i++) {
+            body[n++] = data[i];
+            if (data[i] == 0xaa && i + 1 < len && data[i + 1] == 0x00)
+                i++;
+        }
+        if (len < 2 || data[0] != 0xaa || data[1] != 0xbb || n < 7 || body[0] + 2 != n)
+            throw std::invalid_argument("loopback: bad command frame");
+
+        command cmd = {{body[2], body[3]}, {body[4], body[5]}, &body[6], body[0] - 5};
+        status = device_(cmd, &answer[1], data_len);
+        if (status == -1)
+            return;
+
+        answer[0] = status;
+        size_t at = rx_.size();
+        rx_.resize(at + RF_FRAME_MAX);
+        n = rf_build_frame(&rx_[at], cmd.dev_id, cmd.code, data_len + 1, answer);
+        rx_.resize(at + n);
+    }
+
+    size_t receive(uint8_t *buf, size_t len, clock::time_point)
+    {
+        len = std::min(len, rx_.size() - rx_pos_);
+        memcpy(buf, rx_.data() + rx_pos_, len);
+        rx_pos_ += len;
+        if (rx_pos_ == rx_.size()) {
+            rx_.clear();
+            rx_pos_ = 0;
+        }
+        return len;
+    }
+
+    void discard()
+    {
+        rx_.clear();
+        rx_pos_ = 0;
+    }
+
+private:
+    Device device_;
+    std::vector<uint8_t> rx_;
+    size_t rx_pos_ = 0;
+};
+
+/*
+ * Session recordings are text, one chunk of bytes per line as it went
+ * over the transport:
+ *
+ *     > aabb050000000401 05        sent
+ *     < aabb16000000040100...      received
+ *
+ * Lines starting with '#' are comments, spaces in the hex are ignored.
+ */
+
+/*
+ * Passes everything through to 'Transport' and writes it to a
+ * recording.
+ */
+template <typename Transport>
+class recorder {
+public:
+    template <typename... Args>
+    explicit recorder(const char *path, Args &&...args) : transport_(std::forward<Args>(args)...)
+    {
+        out_ = fopen(path, "w");
+        if (out_ == nullptr)
+            throw std::system_error(errno, std::generic_category(), path);
+    }
+    ~recorder() { fclose(out_); }
+    recorder(const recorder &) = delete;
+    recorder &operator=(const recorder &) = delete;
+
+    Transport &transport() { return transport_; }
+
+    void send(const uint8_t *data, size_t len)
+    {
+        log('>', data, len);
+        transport_.send(data, len);
+    }
+
+    size_t receive(uint8_t *buf, size_t len, clock::time_point deadline)
+    {
+        len = transport_.receive(buf, len, deadline);
+        if (len > 0)
+            log('<', buf, len);
+        return len;
+    }
+
+    void discard() { transport_.discard(); }
+
+    void set_speed(uint8_t rate)
+    {
+        if constexpr (requires(Transport &t) { t.set_speed(rate); })
+            transport_.set_speed(rate);
+    }
+
+private:
+    void log(char dir, const uint8_t *data, size_t len)
+    {
+        fprintf(out_, "%c ", dir);
+        for (size_t i=0; i<len; i++)
+            fprintf(out_, "%02x", data[i]);
+        fprintf(out_, "\n");
+    }
+
+    Transport transport_;
+    FILE *out_;
+};
+
+/*
+ * Plays back a recording. What is sent must match the recording, and
+ * the reader answers with the bytes received back then; where nothing
+ * was received the command times out.
+ */
+class replay_transport {
+public:
+    explicit replay_transport(const char *path)
+    {
+        char line[2 * RF_FRAME_MAX + 16];
+        FILE *in;
+
+        in = fopen(path, "r");
+        if (in == nullptr)
+            throw std::system_error(errno, std::generic_category(), path);
+
+        while (fgets(line, sizeof(line), in) != nullptr) {
+            if (line[0] != '>' && line[0] != '<')
+                continue;
+            chunk c = {line[0] == '>', {}};
+            for (char *p = &line[1]; *p != '\0'; p++) {
+                unsigned int byte;
+                if (isspace((unsigned char)*p))
+                    continue;
+                if (sscanf(p, "%2x", &byte) != 1 || !isxdigit((unsigned char)p[1])) {
+                    fclose(in);
+                    throw std::invalid_argument(std::string("replay: bad line in ") + path);
+                }
+                c.bytes.push_back(byte);
+                p++;
+            }
+            chunks_.push_back(std::move(c));
+        }
+        fclose(in);
+    }
+
+    /* Whether the whole recording has been played */
+    bool finished() const { return next_ == chunks_.size(); }
+
+    void send(const uint8_t *data, size_t len)
+    {
+        if (next_ == chunks_.size() || !chunks_[next_].sent ||
+                chunks_[next_].bytes.size() != len ||
+                memcmp(chunks_[next_].bytes.data(), data, len) != 0)
+            throw std::runtime_error("replay: command differs from the recording at chunk " +
+                                     std::to_string(next_ + 1));
+        next_++;
+    }
+
+    size_t receive(uint8_t *buf, size_t len, clock::time_point)
+    {
+        if (next_ == chunks_.size() || chunks_[next_].sent)
+            return 0;
+
+        const std::vector<uint8_t> &bytes = chunks_[next_].bytes;
+        len = std::min(len, bytes.size() - pos_);
+        memcpy(buf, bytes.data() + pos_, len);
+        pos_ += len;
+        if (pos_ == bytes.size()) {
+            next_++;
+            pos_ = 0;
+        }
+        return len;
+    }
+
+    void discard()
+    {
+        while (next_ < chunks_.size() && !chunks_[next_].sent)
+            next_++;
+        pos_ = 0;
+    }
+
+private:
+    struct chunk {
+        bool sent;
+        std::vector<uint8_t> bytes;
+    };
+
+    std::vector<chunk> chunks_;
+    size_t next_ = 0;
+    size_t pos_ = 0;
+};
+
+/*
+ * One SL500 on 'Transport'. The constructor arguments are passed on to
+ * the transport. Commands return the reader status like their C
+ * counterparts, RF_ERR_BAD_ANSWER for an answer to another command or
+ * of the wrong length, and throw timeout_error if there is no answer.
+ */
+template <typename Transport>
+class basic_reader {
+public:
+    template <typename... Args>
+    explicit basic_reader(Args &&...args) : transport_(std::forward<Args>(args)...) {}
+
+    Transport &transport() { return transport_; }
+
+    /* Address a reader on a bus, 0000 talks to any reader */
+    void set_device(const uint8_t dev_id[2])
+    {
+        dev_id_[0] = dev_id[0];
+        dev_id_[1] = dev_id[1];
+    }
+
+    void set_timeout(clock::duration timeout) { timeout_ = timeout; }
+
+    /*
+     * Send command 'cmd' (RF_CMD_*) and read the answer, putting up to
+     * 'data_len' data bytes in 'data' and their number in 'count'.
+     */
+    uint8_t transact(int cmd, const uint8_t *param, int data_len = 0, uint8_t *data = nullptr,
+                     int *count = nullptr)
+    {
+        const struct rf_command &c = rf_commands[cmd];
+        uint8_t frame[RF_FRAME_MAX];
+        uint8_t buf[64];
+        struct rf_parser parser;
+        size_t n;
+        int len;
+
+        len = rf_build_frame(frame, dev_id_, const_cast<uint8_t *>(c.code), c.param_len,
+                             const_cast<uint8_t *>(param));
+        transport_.send(frame, len);
+
+        auto deadline = clock::now() + timeout_;
+        rf_parser_init(&parser);
+        while (!parser.done) {
+            n = transport_.receive(buf, sizeof(buf), deadline);
+            if (n == 0) {
+                transport_.discard();
+                throw timeout_error();
+            }
+            rf_parser_feed(&parser, buf, n);
+        }
+
+        if (count != nullptr)
+            *count = parser.data_len;
+        if (!parser.checksum_ok || parser.cmd_code[0] != c.code[0] ||
+                parser.cmd_code[1] != c.code[1])
+            return RF_ERR_BAD_ANSWER;
+        if (parser.status == 0x00 &&
+                (parser.data_len < c.data_min || parser.data_len > c.data_max))
+            return RF_ERR_BAD_ANSWER;
+
+        if (data != nullptr)
+            memcpy(data, parser.data, std::min(data_len, parser.data_len));
+        return parser.status;
+    }
+
+    uint8_t init_com(uint8_t rate)
+    {
+        uint8_t status = transact(RF_CMD_INIT_COM, &rate);
+
+        if constexpr (requires(Transport &t) { t.set_speed(rate); }) {
+            if (status == 0x00)
+                transport_.set_speed(rate);
+        }
+        return status;
+    }
+
+    std::string model()
+    {
+        uint8_t buf[32];
+        int count;
+
+        if (transact(RF_CMD_GET_MODEL, nullptr, sizeof(buf), buf, &count) != 0x00)
+            return std::string();
+        return std::string((char *)buf, std::min<int>(count, sizeof(buf)));
+    }
+
+    uint8_t get_device_number(uint8_t dev_id[2])
+    {
+        return transact(RF_CMD_GET_DEV, nullptr, 2, dev_id);
+    }
+
+    uint8_t beep(uint8_t time) { return transact(RF_CMD_BEEP, &time); }
+
+    uint8_t light(uint8_t color) { return transact(RF_CMD_LIGHT, &color); }
+
+    uint8_t request(uint8_t atqa[2] = nullptr)
+    {
+        uint8_t mode = REQ_ALL, buf[2];
+
+        return transact(RF_CMD_REQUEST, &mode, 2, atqa != nullptr ? atqa : buf);
+    }
+
+    /* Leaves 'card_no' at 0 for cards with a longer UID */
+    uint8_t anticoll(uint32_t &card_no)
+    {
+        uint8_t buf[10];
+        uint8_t status;
+        int count;
+
+        status = transact(RF_CMD_ANTICOLL, nullptr, sizeof(buf), buf, &count);
+        card_no = 0;
+        if (status == 0x00 && count == 4)
+            memcpy(&card_no, buf, 4);
+        return status;
+    }
+
+    uint8_t select(uint32_t card_no, uint8_t *capacity = nullptr)
+    {
+        uint8_t param[4], buf[1];
+        uint8_t status;
+
+        memcpy(param, &card_no, 4);
+        status = transact(RF_CMD_SELECT, param, 1, buf);
+        if (capacity != nullptr)
+            *capacity = (status == 0x00) ? buf[0] : 0;
+        return status;
+    }
+
+    uint8_t halt() { return transact(RF_CMD_HALT, nullptr); }
+
+    uint8_t authenticate(uint8_t key_type, uint8_t block, const uint8_t key[6])
+    {
+        uint8_t param[8] = {key_type, block};
+
+        memcpy(&param[2], key, 6);
+        return transact(RF_CMD_AUTH, param);
+    }
+
+    uint8_t read_block(uint8_t block, uint8_t data[16])
+    {
+        return transact(RF_CMD_READ, &block, 16, data);
+    }
+
+    uint8_t write_block(uint8_t block, const uint8_t data[16])
+    {
+        uint8_t param[17] = {block};
+
+        memcpy(&param[1], data, 16);
+        return transact(RF_CMD_WRITE, param);
+    }
+
+private:
+    Transport transport_;
+    uint8_t dev_id_[2] = {0x00, 0x00};
+    clock::duration timeout_ = std::chrono::milliseconds(500);
+};
+
+using serial_reader = basic_reader<serial_transport>;
+using pty_reader = basic_reader<pty_transport>;
+using replay_reader = basic_reader<replay_transport>;
+
+} // namespace sl500
+
+#endif
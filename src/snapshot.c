@@ -0,0 +1,105 @@
+// vim: ts=4 expandtab ai
+
+/*
+ * Copyright (c) 2008, Henrik Torstensson <laban@kryo.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "snapshot.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+int snapshot_load(const char *path, struct snapshot_reader *readers, int max)
+{
+    struct snapshot_reader *r;
+    unsigned int baud, dev_id;
+    char line[256];
+    int lineno = 0, count = 0, n;
+    FILE *f;
+    char *p;
+
+    f = fopen(path, "r");
+    if (f == NULL) {
+        if (errno == ENOENT)
+            return 0;
+        perror("snapshot_load");
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), f) != NULL && count < max) {
+        lineno++;
+        for (p = line; isspace((unsigned char)*p); p++);
+        if (*p == '\0' || *p == '#')
+            continue;
+
+        r = &readers[count];
+        memset(r, 0, sizeof(*r));
+        if (sscanf(p, "reader %d %127s %u %4x %lu %lu %n", &r->index, r->path, &baud, &dev_id,
+                   &r->polls, &r->taps, &n) != 6 || r->index < 0) {
+            fprintf(stderr, "%s:%d: bad snapshot line\n", path, lineno);
+            fclose(f);
+            return -1;
+        }
+        r->baud = baud;
+        r->dev_id[0] = dev_id >> 8;
+        r->dev_id[1] = dev_id & 0xff;
+        p[strcspn(p, "\r\n")] = '\0';
+        snprintf(r->model, sizeof(r->model), "%s", &p[n]);
+        count++;
+    }
+
+    fclose(f);
+    return count;
+}
+
+int snapshot_save(const char *path, const struct snapshot_reader *readers, int count)
+{
+    const struct snapshot_reader *r;
+    char tmp[256];
+    FILE *f;
+    int i;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    f = fopen(tmp, "w");
+    if (f == NULL) {
+        perror("snapshot_save");
+        return -1;
+    }
+
+    fprintf(f, "# Reader snapshot, rewritten by mifare_socket\n");
+    for (i=0; i<count; i++) {
+        r = &readers[i];
+        fprintf(f, "reader %d %s %u %02hhx%02hhx %lu %lu %s\n", r->index, r->path, r->baud,
+                r->dev_id[0], r->dev_id[1], r->polls, r->taps, r->model);
+    }
+
+    if (fflush(f) != 0 || fsync(fileno(f)) == -1) {
+        perror("snapshot_save");
+        fclose(f);
+        unlink(tmp);
+        return -1;
+    }
+    fclose(f);
+
+    if (rename(tmp, path) == -1) {
+        perror("snapshot_save: rename");
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,64 @@
+// vim: ts=4 expandtab ai
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+/*
+ * Copyright (c) 2008, Henrik Torstensson <laban@kryo.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Reader state kept across restarts, so that the service can come
+ * back up at the speed and with the reader numbers it had. The file
+ * has one line per reader:
+ *
+ *     reader <number> <path> <baud code> <device ID> <polls> <taps> <model>
+ *
+ * and is replaced as a whole on every save. Readers are matched up by
+ * path first, so stable /dev/serial/by-id paths work best.
+ */
+
+#include <stdint.h>
+
+#define SNAPSHOT_MS 10000               // Stats are saved this often
+
+struct snapshot_reader {
+    int index;
+    char path[128];
+    uint8_t baud;                       // BAUD_*
+    uint8_t dev_id[2];
+    char model[16];
+    unsigned long polls;
+    unsigned long taps;
+};
+
+/*
+ * 'snapshot_load()' - Read up to 'max' readers from 'path'.
+ *
+ * Returns the number read; 0 if there is no file yet, -1 on error.
+ */
+
+int snapshot_load(const char *path, struct snapshot_reader *readers, int max);
+
+/*
+ * 'snapshot_save()' - Write 'count' readers to 'path', through a
+ * temporary file so that a crash never leaves half a snapshot.
+ *
+ * Returns 0 on success or -1 on error.
+ */
+
+int snapshot_save(const char *path, const struct snapshot_reader *readers, int count);
+
+#endif
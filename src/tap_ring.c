@@ -0,0 +1,266 @@
+// vim: ts=4 expandtab ai
+
+/*
+ * Copyright (c) 2008, Henrik Torstensson <laban@kryo.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "tap_ring.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TAP_RING_MAGIC (0x534c3554)    // "SL5T"
+
+/*
+ * A slot is valid when 'seq' is the event sequence number + 1. The
+ * producer zeroes it while the slot is being rewritten, so a consumer
+ * that copied a half-written event will notice and retry.
+ */
+struct tap_slot {
+    uint64_t seq;
+    struct tap_event ev;
+};
+
+struct tap_ring_hdr {
+    uint32_t magic;
+    uint32_t size;
+    uint64_t head;                      // Next sequence number to publish
+    uint32_t futex;                     // Bumped on every publish
+    uint8_t pad[44];                    // Keep slots off the header's cache line
+    struct tap_slot slots[];
+};
+
+struct tap_ring {
+    struct tap_ring_hdr *hdr;
+    size_t map_size;
+    int producer;
+};
+
+static long futex(uint32_t *uaddr, int op, uint32_t val, const struct timespec *ts)
+{
+    return syscall(SYS_futex, uaddr, op, val, ts, NULL, 0);
+}
+
+static size_t ring_bytes(uint32_t size)
+{
+    return sizeof(struct tap_ring_hdr) + size * sizeof(struct tap_slot);
+}
+
+struct tap_ring *tap_ring_create(const char *name, uint32_t size)
+{
+    struct tap_ring *ring;
+    struct tap_ring_hdr *hdr;
+    size_t bytes;
+    int fd;
+
+    if (size == 0 || (size & (size - 1)) != 0)
+        return NULL;
+
+    fd = shm_open(name, O_RDWR | O_CREAT, 0644);
+    if (fd == -1) {
+        perror("tap_ring_create: shm_open");
+        return NULL;
+    }
+
+    bytes = ring_bytes(size);
+    if (ftruncate(fd, bytes) == -1) {
+        perror("tap_ring_create: ftruncate");
+        close(fd);
+        return NULL;
+    }
+
+    hdr = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (hdr == MAP_FAILED) {
+        perror("tap_ring_create: mmap");
+        return NULL;
+    }
+
+    /*
+     * Keep the sequence numbers of a previous run, so consumers that
+     * stayed up across a restart carry on where they were.
+     */
+    if (hdr->magic != TAP_RING_MAGIC || hdr->size != size) {
+        memset(hdr, 0, bytes);
+        hdr->size = size;
+        __atomic_store_n(&hdr->magic, TAP_RING_MAGIC, __ATOMIC_RELEASE);
+    }
+
+    ring = malloc(sizeof(*ring));
+    if (ring == NULL) {
+        munmap(hdr, bytes);
+        return NULL;
+    }
+    ring->hdr = hdr;
+    ring->map_size = bytes;
+    ring->producer = 1;
+
+    return ring;
+}
+
+struct tap_ring *tap_ring_open(const char *name)
+{
+    struct tap_ring *ring;
+    struct tap_ring_hdr *hdr;
+    struct stat st;
+    int fd;
+
+    fd = shm_open(name, O_RDONLY, 0);
+    if (fd == -1) {
+        perror("tap_ring_open: shm_open");
+        return NULL;
+    }
+
+    if (fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(*hdr)) {
+        fprintf(stderr, "tap_ring_open: %s is not initialized\n", name);
+        close(fd);
+        return NULL;
+    }
+
+    hdr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (hdr == MAP_FAILED) {
+        perror("tap_ring_open: mmap");
+        return NULL;
+    }
+
+    if (__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != TAP_RING_MAGIC ||
+            ring_bytes(hdr->size) > (size_t)st.st_size) {
+        fprintf(stderr, "tap_ring_open: %s has a bad header\n", name);
+        munmap(hdr, st.st_size);
+        return NULL;
+    }
+
+    ring = malloc(sizeof(*ring));
+    if (ring == NULL) {
+        munmap(hdr, st.st_size);
+        return NULL;
+    }
+    ring->hdr = hdr;
+    ring->map_size = st.st_size;
+    ring->producer = 0;
+
+    return ring;
+}
+
+void tap_ring_close(struct tap_ring *ring)
+{
+    if (ring == NULL)
+        return;
+    munmap(ring->hdr, ring->map_size);
+    free(ring);
+}
+
+/*
+ * Called from the poll loop only, so there is a single writer and no
+ * need for anything stronger than release stores.
+ */
+void tap_ring_publish(struct tap_ring *ring, struct tap_event *ev)
+{
+    struct tap_ring_hdr *hdr = ring->hdr;
+    uint64_t seq = hdr->head;
+    struct tap_slot *slot = &hdr->slots[seq & (hdr->size - 1)];
+    struct timespec now;
+
+    if (ev->timestamp == 0) {
+        clock_gettime(CLOCK_REALTIME, &now);
+        ev->timestamp = (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+    }
+    ev->seq = seq;
+
+    __atomic_store_n(&slot->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    slot->ev = *ev;
+    __atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELEASE);
+
+    __atomic_store_n(&hdr->head, seq + 1, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&hdr->futex, 1, __ATOMIC_RELEASE);
+    futex(&hdr->futex, FUTEX_WAKE, INT32_MAX, NULL);
+}
+
+uint64_t tap_ring_head(struct tap_ring *ring)
+{
+    return __atomic_load_n(&ring->hdr->head, __ATOMIC_ACQUIRE);
+}
+
+int64_t tap_ring_next(struct tap_ring *ring, uint64_t *cursor,
+                      struct tap_event *ev, int timeout_ms)
+{
+    struct tap_ring_hdr *hdr = ring->hdr;
+    struct timespec ts, *tsp = NULL;
+    uint64_t head, seq1, seq2;
+    uint32_t wake;
+    int64_t lost = 0;
+    struct tap_slot *slot;
+
+    if (timeout_ms >= 0) {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (timeout_ms % 1000) * 1000000l;
+        tsp = &ts;
+    }
+
+    for (;;) {
+        wake = __atomic_load_n(&hdr->futex, __ATOMIC_ACQUIRE);
+        head = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+
+        if (*cursor > head) {
+            /* Producer restarted with a fresh segment */
+            *cursor = head;
+        }
+
+        if (*cursor == head) {
+            if (timeout_ms == 0)
+                return -1;
+            if (futex(&hdr->futex, FUTEX_WAIT, wake, tsp) == -1 &&
+                    errno == ETIMEDOUT)
+                return -1;
+            continue;
+        }
+
+        if (head - *cursor > hdr->size) {
+            lost += head - hdr->size - *cursor;
+            *cursor = head - hdr->size;
+        }
+
+        slot = &hdr->slots[*cursor & (hdr->size - 1)];
+        seq1 = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if (seq1 != *cursor + 1) {
+            /* Overwritten while we looked; resync against head */
+            lost++;
+            (*cursor)++;
+            continue;
+        }
+        *ev = slot->ev;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        seq2 = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+        if (seq2 != seq1) {
+            lost++;
+            (*cursor)++;
+            continue;
+        }
+
+        (*cursor)++;
+        return lost;
+    }
+}
@@ -0,0 +1,91 @@
+// vim: ts=4 expandtab ai
+
+#ifndef TAP_RING_H
+#define TAP_RING_H
+
+/*
+ * Copyright (c) 2008, Henrik Torstensson <laban@kryo.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Card event ring in a named shared memory segment.
+ *
+ * There is one producer (the process owning the readers) and any number
+ * of consumers. The producer never waits for consumers: a consumer that
+ * falls more than one ring size behind loses the oldest events and is
+ * told how many. Consumers sleep on a futex in the segment header.
+ */
+
+#include <stdint.h>
+
+#define TAP_RING_NAME "/sl500-taps"
+#define TAP_RING_SIZE 1024
+
+#define TAP_UID_MAX 10
+
+#define TAP_CARD_PRESENT (0x01)
+#define TAP_CARD_REMOVED (0x02)
+
+struct tap_event {
+    uint64_t seq;                       // Set by tap_ring_publish()
+    uint64_t timestamp;                 // CLOCK_REALTIME, nanoseconds
+    uint32_t reader;
+    uint8_t type;
+    uint8_t uid_len;
+    uint8_t uid[TAP_UID_MAX];
+};
+
+struct tap_ring;
+
+/*
+ * 'tap_ring_create()' - Create (or reset) the segment as producer.
+ *
+ * 'size' must be a power of two. Returns NULL on error.
+ */
+
+struct tap_ring *tap_ring_create(const char *name, uint32_t size);
+
+/*
+ * 'tap_ring_open()' - Map an existing segment read-only as consumer.
+ *
+ * Returns NULL on error.
+ */
+
+struct tap_ring *tap_ring_open(const char *name);
+
+void tap_ring_close(struct tap_ring *ring);
+
+void tap_ring_publish(struct tap_ring *ring, struct tap_event *ev);
+
+/*
+ * 'tap_ring_head()' - Sequence number of the next event to be published.
+ *
+ * A new consumer starts here to only see events from now on.
+ */
+
+uint64_t tap_ring_head(struct tap_ring *ring);
+
+/*
+ * 'tap_ring_next()' - Fetch the event at '*cursor' and advance it.
+ *
+ * Waits at most 'timeout_ms' milliseconds (-1 = forever) for it to be
+ * published. Returns the number of events lost before it due to
+ * overrun (normally 0), or -1 on timeout.
+ */
+
+int64_t tap_ring_next(struct tap_ring *ring, uint64_t *cursor,
+                      struct tap_event *ev, int timeout_ms);
+
+#endif
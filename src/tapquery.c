@@ -0,0 +1,128 @@
+// vim: ts=4 expandtab ai
+
+/*
+ * Copyright (c) 2008, Henrik Torstensson <laban@kryo.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Look up taps in the journal written by mifare_socket -j. Prints one
+ * line per record and the time the lookup took.
+ */
+
+#include "journal.h"
+#include "sl500.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static const char *result_names[] = {"?", "tap", "delivered", "removed"};
+
+static int print_record(void *arg, uint64_t seq, const struct journal_record *rec)
+{
+    int *printed = arg;
+    time_t secs = rec->time / 1000;
+    char when[32];
+    int i;
+
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&secs));
+    printf("%llu %s.%03u reader %u ", (unsigned long long)seq, when,
+           (unsigned int)(rec->time % 1000), rec->reader);
+    for (i=0; i<rec->uid_len && i<JOURNAL_UID_MAX; i++)
+        printf("%02hhx", rec->uid[i]);
+    printf(" %s\n", result_names[rec->result <= JOURNAL_REMOVED ? rec->result : 0]);
+    (*printed)++;
+    return 0;
+}
+
+static int parse_uid(const char *hex, uint8_t *uid)
+{
+    int len = strlen(hex) / 2, i;
+
+    if (strlen(hex) % 2 != 0 || len == 0 || len > JOURNAL_UID_MAX)
+        return -1;
+    for (i=0; i<len; i++) {
+        if (sscanf(&hex[i * 2], "%2hhx", &uid[i]) != 1)
+            return -1;
+    }
+    return len;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-d dir] [-u uid] [-H hours] [-s seq]\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *dir = JOURNAL_DIR;
+    struct journal *j;
+    struct timespec t0, t1, now;
+    uint8_t uid[JOURNAL_UID_MAX];
+    uint64_t since, seq = 0;
+    int opt, uid_len = 0, found = 0, replay = 0;
+    double hours = 24;
+
+    while ((opt = getopt(argc, argv, "d:u:H:s:")) != -1) {
+        switch (opt) {
+            case 'd':
+                dir = optarg;
+                break;
+            case 'u':
+                /* Card UID in hex, as printed */
+                uid_len = parse_uid(optarg, uid);
+                if (uid_len == -1)
+                    usage(argv[0]);
+                break;
+            case 'H':
+                hours = atof(optarg);
+                break;
+            case 's':
+                /* Everything from this sequence number on */
+                seq = strtoull(optarg, NULL, 0);
+                replay = 1;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+
+    j = journal_open(dir, 0);
+    if (j == NULL)
+        exit(EXIT_FAILURE);
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    since = (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+    since -= min((uint64_t)(hours * 3600000), since);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    if (replay) {
+        journal_replay(j, seq, print_record, &found);
+    } else if (uid_len > 0) {
+        journal_query_uid(j, uid, uid_len, since, print_record, &found);
+    } else {
+        journal_query_time(j, since, UINT64_MAX, print_record, &found);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    fprintf(stderr, "%d records in %.3f ms\n", found,
+            (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6);
+
+    journal_close(j);
+    return 0;
+}
@@ -0,0 +1,70 @@
+// vim: ts=4 expandtab ai
+
+/*
+ * Copyright (c) 2008, Henrik Torstensson <laban@kryo.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Example local consumer of the card event ring published by
+ * mifare_socket. Prints one line per event along with the time it took
+ * from publish to wakeup.
+ */
+
+#include "tap_ring.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+int main(int argc, char *argv[])
+{
+    const char *name = TAP_RING_NAME;
+    struct tap_ring *ring;
+    struct tap_event ev;
+    struct timespec now;
+    uint64_t cursor, now_ns;
+    int64_t lost;
+    int i;
+
+    if (argc > 1)
+        name = argv[1];
+
+    ring = tap_ring_open(name);
+    if (ring == NULL)
+        exit(EXIT_FAILURE);
+
+    cursor = tap_ring_head(ring);
+
+    for (;;) {
+        lost = tap_ring_next(ring, &cursor, &ev, -1);
+        if (lost < 0)
+            continue;
+        if (lost > 0)
+            printf("Lost %lld events\n", (long long)lost);
+
+        clock_gettime(CLOCK_REALTIME, &now);
+        now_ns = (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+
+        printf("%llu reader %u %s", (unsigned long long)ev.seq, ev.reader,
+               ev.type == TAP_CARD_PRESENT ? "present" : "removed");
+        for (i=0; i<ev.uid_len && i<TAP_UID_MAX; i++)
+            printf("%s%02hhx", i ? "" : " ", ev.uid[i]);
+        printf(" (%llu us)\n", (unsigned long long)(now_ns - ev.timestamp) / 1000);
+        fflush(stdout);
+    }
+
+    tap_ring_close(ring);
+    return 0;
+}
@@ -35,10 +35,52 @@ void shutdown(int fd, int errorcode)
     exit(errorcode);
 }
 
+/*
+ * Dump an Ultralight or NTAG card. No keys, 4 pages per read.
+ */
+void dump_ultralight(int fd)
+{
+    uint8_t uid[RF_UL_UID_LEN], data[RF_UL_PAGES_MAX * RF_UL_PAGE_SIZE];
+    uint8_t status;
+    int i, page, pages;
+
+    printf("Selecting Ultralight card\n");
+    status = rf_ul_select(fd, uid);
+    if (status != 0)
+    {
+        printf("ERROR %d\n", status);
+        shutdown(fd, status);
+    }
+    printf("UID:");
+    for (i=0; i<RF_UL_UID_LEN; i++)
+    {
+        printf(" %02hhx", uid[i]);
+    }
+    printf("\n");
+
+    printf("\nDumping card contents...\n");
+    status = rf_ul_dump(fd, RF_UL_PAGES_MAX, data, &pages);
+    for (page=0; page<pages; page++)
+    {
+        printf("Page %3d (0x%02hhx):", page, page);
+        for (i=0; i<RF_UL_PAGE_SIZE; i++)
+        {
+            printf(" %02hhx", data[page * RF_UL_PAGE_SIZE + i]);
+        }
+        printf("\n");
+    }
+    if (status != 0)
+    {
+        printf("ERROR %d after %d pages\n", status, pages);
+    }
+
+    shutdown(fd, status);
+}
+
 int main()
 {
     int fd;
-    uint8_t dev_id[2], buf[100];
+    uint8_t dev_id[2], buf[100], atqa[2];
     uint8_t new_dev_id[] = {0x13, 0x1a};
     uint8_t key[6];
     uint8_t status;
@@ -60,7 +102,7 @@ int main()
     /* START, MIFARE COMMANDS */
 
     printf("Request all\n");
-    status = rf_request(fd);
+    status = rf_request_type(fd, atqa);
     if (status == 20)
     {
         printf("No card - exiting...\n");
@@ -72,6 +114,11 @@ int main()
         shutdown(fd, status);
     }
 
+    if (RF_ATQA_DOUBLE_UID(atqa))
+    {
+        dump_ultralight(fd);
+    }
+
     printf("Anticollision\n");
     status = rf_anticoll(fd, &card_no);
     if (status != 0)
@@ -82,7 +129,7 @@ int main()
     printf("Card number: %u (0x%08x)\n", card_no, card_no);
 
     printf("Selecting card\n");
-    status = rf_select(fd, sizeof(card_no), (uint8_t*)&card_no);
+    status = rf_select(fd, sizeof(card_no), (uint8_t*)&card_no, NULL);
     if (status != 0)
     {
         printf("ERROR %d\n", status);
@@ -0,0 +1,268 @@
+// vim: ts=4 expandtab ai
+
+/*
+ * Copyright (c) 2008, Henrik Torstensson <laban@kryo.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "workpool.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+
+struct work {
+    work_fn fn;
+    void *arg;
+    int keyed;                          // Runs in order with its lane
+};
+
+struct lane {
+    pthread_mutex_t lock;
+    unsigned int top;                   // Oldest item, run next
+    unsigned int bottom;                // Next free slot
+    int busy;                           // A keyed item of this lane is running
+    struct work *items;
+};
+
+struct worker {
+    struct workpool *pool;
+    int index;
+    pthread_t thread;
+};
+
+struct workpool {
+    int threads;
+    unsigned int queue;                 // Power of two, the indexes wrap
+    unsigned int next;                  // Lane for the next unkeyed submit
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    int pending;                        // Items queued or running, under 'lock'
+    unsigned int events;                // Submits and finished items, under 'lock'
+    int stopping;
+    struct lane *lanes;
+    struct worker *workers;
+    struct workpool_stats stats;
+};
+
+/*
+ * Take the oldest item of lane 'i'. While a keyed item of the lane is
+ * running only unkeyed items may be taken, the oldest one is lifted
+ * out from between the keyed items, which keep their order.
+ */
+static int take(struct workpool *p, int i, struct work *w)
+{
+    struct lane *l = &p->lanes[i];
+    unsigned int n;
+    int found = 0;
+
+    pthread_mutex_lock(&l->lock);
+    if (l->top != l->bottom && !l->busy) {
+        *w = l->items[l->top++ % p->queue];
+        l->busy = w->keyed;
+        found = 1;
+    } else if (l->busy) {
+        for (n=l->top; n!=l->bottom && l->items[n % p->queue].keyed; n++)
+            ;
+        if (n != l->bottom) {
+            *w = l->items[n % p->queue];
+            for (; n+1!=l->bottom; n++)
+                l->items[n % p->queue] = l->items[(n + 1) % p->queue];
+            l->bottom--;
+            found = 1;
+        }
+    }
+    pthread_mutex_unlock(&l->lock);
+
+    return found;
+}
+
+/*
+ * Done with 'w' of lane 'i': free the lane for its next item if 'w'
+ * held it, and wake a worker.
+ */
+static void finish(struct workpool *p, int i, struct work *w)
+{
+    struct lane *l = &p->lanes[i];
+
+    if (w->keyed) {
+        pthread_mutex_lock(&l->lock);
+        l->busy = 0;
+        pthread_mutex_unlock(&l->lock);
+    }
+
+    pthread_mutex_lock(&p->lock);
+    p->pending--;
+    p->events++;
+    if (p->stopping && p->pending == 0) {
+        pthread_cond_broadcast(&p->wake);
+    } else {
+        pthread_cond_signal(&p->wake);
+    }
+    pthread_mutex_unlock(&p->lock);
+}
+
+static void *worker_main(void *arg)
+{
+    struct worker *self = arg;
+    struct workpool *p = self->pool;
+    struct work w;
+    unsigned int seen;
+    int i, lane, stop;
+
+    for (;;) {
+        pthread_mutex_lock(&p->lock);
+        seen = p->events;
+        pthread_mutex_unlock(&p->lock);
+
+        /* Own lane first, then one round over the others */
+        lane = -1;
+        for (i=0; i<p->threads && lane == -1; i++) {
+            if (take(p, (self->index + i) % p->threads, &w))
+                lane = (self->index + i) % p->threads;
+        }
+
+        if (lane != -1) {
+            if (lane != self->index)
+                __atomic_add_fetch(&p->stats.stolen, 1, __ATOMIC_RELAXED);
+            w.fn(w.arg);
+            __atomic_add_fetch(&p->stats.executed, 1, __ATOMIC_RELAXED);
+            finish(p, lane, &w);
+            continue;
+        }
+
+        /* Nothing to run, sleep until a submit or a lane frees up */
+        pthread_mutex_lock(&p->lock);
+        while (p->events == seen && !(p->stopping && p->pending == 0))
+            pthread_cond_wait(&p->wake, &p->lock);
+        stop = p->stopping && p->pending == 0;
+        pthread_mutex_unlock(&p->lock);
+        if (stop)
+            break;
+    }
+
+    return NULL;
+}
+
+struct workpool *workpool_create(int threads, int queue)
+{
+    struct workpool *p;
+    int i;
+
+    if (threads < 1 || queue < 1)
+        return NULL;
+
+    p = calloc(1, sizeof(*p));
+    if (p == NULL)
+        return NULL;
+    p->threads = threads;
+    p->queue = 1;
+    while (p->queue < queue)
+        p->queue <<= 1;
+    p->lanes = calloc(threads, sizeof(*p->lanes));
+    p->workers = calloc(threads, sizeof(*p->workers));
+    if (p->lanes == NULL || p->workers == NULL) {
+        free(p->lanes);
+        free(p->workers);
+        free(p);
+        return NULL;
+    }
+
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->wake, NULL);
+    for (i=0; i<threads; i++) {
+        pthread_mutex_init(&p->lanes[i].lock, NULL);
+        p->lanes[i].items = calloc(p->queue, sizeof(struct work));
+    }
+
+    for (i=0; i<threads; i++) {
+        p->workers[i].pool = p;
+        p->workers[i].index = i;
+        if (p->lanes[i].items == NULL ||
+                pthread_create(&p->workers[i].thread, NULL, worker_main, &p->workers[i]) != 0) {
+            p->threads = i;
+            workpool_free(p);
+            return NULL;
+        }
+    }
+
+    return p;
+}
+
+void workpool_free(struct workpool *p)
+{
+    int i;
+
+    if (p == NULL)
+        return;
+
+    pthread_mutex_lock(&p->lock);
+    p->stopping = 1;
+    pthread_cond_broadcast(&p->wake);
+    pthread_mutex_unlock(&p->lock);
+
+    for (i=0; i<p->threads; i++)
+        pthread_join(p->workers[i].thread, NULL);
+
+    for (i=0; i<p->threads; i++)
+        free(p->lanes[i].items);
+    free(p->lanes);
+    free(p->workers);
+    free(p);
+}
+
+int workpool_submit(struct workpool *p, int key, work_fn fn, void *arg)
+{
+    struct lane *l;
+    int i, tries, queued = 0;
+
+    /* A keyed item has one lane, others take the next lane with room */
+    tries = key >= 0 ? 1 : p->threads;
+    for (i=0; i<tries && !queued; i++) {
+        if (key >= 0) {
+            l = &p->lanes[key % p->threads];
+        } else {
+            l = &p->lanes[(p->next + i) % p->threads];
+        }
+        pthread_mutex_lock(&l->lock);
+        if (l->bottom - l->top < p->queue) {
+            l->items[l->bottom++ % p->queue] = (struct work){fn, arg, key >= 0};
+            queued = 1;
+        }
+        pthread_mutex_unlock(&l->lock);
+    }
+    if (key < 0)
+        p->next++;
+
+    if (!queued) {
+        p->stats.rejected++;
+        return -1;
+    }
+    p->stats.submitted++;
+
+    pthread_mutex_lock(&p->lock);
+    p->pending++;
+    p->events++;
+    pthread_cond_signal(&p->wake);
+    pthread_mutex_unlock(&p->lock);
+
+    return 0;
+}
+
+void workpool_get_stats(struct workpool *p, struct workpool_stats *stats)
+{
+    stats->submitted = p->stats.submitted;
+    stats->rejected = p->stats.rejected;
+    stats->executed = __atomic_load_n(&p->stats.executed, __ATOMIC_RELAXED);
+    stats->stolen = __atomic_load_n(&p->stats.stolen, __ATOMIC_RELAXED);
+}
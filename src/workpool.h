@@ -0,0 +1,81 @@
+// vim: ts=4 expandtab ai
+
+#ifndef WORKPOOL_H
+#define WORKPOOL_H
+
+/*
+ * Copyright (c) 2008, Henrik Torstensson <laban@kryo.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Work-stealing thread pool, for work that must not hold up the thread
+ * talking to the readers.
+ *
+ * Every worker owns a lane, a fixed ring of work run oldest first. Work
+ * with a key always goes to the same lane and runs one at a time, in
+ * the order submitted; other work is spread over the lanes in turn and
+ * has no order. A worker runs its own lane and, when that has nothing
+ * it may run, steals from the others: the oldest item of a lane with
+ * nothing running, or the oldest unkeyed item of a lane whose keyed
+ * item is still running. Workers with nothing to run sleep until work
+ * is submitted or a lane frees up. A submit to a full lane fails rather
+ * than block the submitter. Work is submitted from one thread.
+ */
+
+#include <stdint.h>
+
+#define WORKPOOL_THREADS 4
+#define WORKPOOL_QUEUE 64               // Items per lane
+
+typedef void (*work_fn)(void *arg);
+
+struct workpool;
+
+struct workpool_stats {
+    uint64_t submitted;
+    uint64_t executed;
+    uint64_t stolen;                    // Run by another worker than the lane owner
+    uint64_t rejected;                  // Submits to a full lane
+};
+
+/*
+ * 'workpool_create()' - Start 'threads' workers that queue at least
+ * 'queue' items each. The workers take the scheduling policy of the
+ * caller.
+ *
+ * Returns NULL on error.
+ */
+
+struct workpool *workpool_create(int threads, int queue);
+
+/*
+ * 'workpool_free()' - Run the work still queued, then stop the workers.
+ */
+
+void workpool_free(struct workpool *p);
+
+/*
+ * 'workpool_submit()' - Queue 'fn(arg)' to run on a worker. Work with
+ * the same 'key' >= 0 runs one at a time, in order; a negative 'key'
+ * lets it run on any lane.
+ *
+ * Returns 0 on success or -1 if the lane is full.
+ */
+
+int workpool_submit(struct workpool *p, int key, work_fn fn, void *arg);
+
+void workpool_get_stats(struct workpool *p, struct workpool_stats *stats);
+
+#endif